@@ -7,6 +7,7 @@
 #   FFTW_FOUND               ... true if fftw is found on the system
 #   FFTW_LIBRARIES           ... full path to fftw library
 #   FFTW_INCLUDES            ... fftw include directory
+#   FFTW_THREADS_FOUND       ... true if the multithreaded fftw libraries are found
 #
 # The following variables will be checked by the function
 #   FFTW_USE_STATIC_LIBS    ... if true, only static libraries are found
@@ -55,6 +56,20 @@ if( FFTW_ROOT )
     PATH_SUFFIXES "lib" "lib64"
     NO_DEFAULT_PATH
   )
+  find_library(
+    FFTW_THREADS_LIB
+    NAMES "fftw3_omp" "fftw3_threads"
+    PATHS ${FFTW_ROOT}
+    PATH_SUFFIXES "lib" "lib64"
+    NO_DEFAULT_PATH
+  )
+  find_library(
+    FFTWF_THREADS_LIB
+    NAMES "fftw3f_omp" "fftw3f_threads"
+    PATHS ${FFTW_ROOT}
+    PATH_SUFFIXES "lib" "lib64"
+    NO_DEFAULT_PATH
+  )
   #find includes
   find_path(
     FFTW_INCLUDES
@@ -79,6 +94,16 @@ else()
     NAMES "fftw3l"
     PATHS ${PKG_FFTW_LIBRARY_DIRS} ${LIB_INSTALL_DIR}
   )
+  find_library(
+    FFTW_THREADS_LIB
+    NAMES "fftw3_omp" "fftw3_threads"
+    PATHS ${PKG_FFTW_LIBRARY_DIRS} ${LIB_INSTALL_DIR}
+  )
+  find_library(
+    FFTWF_THREADS_LIB
+    NAMES "fftw3f_omp" "fftw3f_threads"
+    PATHS ${PKG_FFTW_LIBRARY_DIRS} ${LIB_INSTALL_DIR}
+  )
   find_path(
     FFTW_INCLUDES
     NAMES "fftw3.h"
@@ -89,8 +114,15 @@ set(FFTW_LIBRARIES ${FFTW_LIB} ${FFTWF_LIB})
 if(FFTWL_LIB)
   set(FFTW_LIBRARIES ${FFTW_LIBRARIES} ${FFTWL_LIB})
 endif()
+# The threaded libraries must come before the serial ones when linking
+if(FFTW_THREADS_LIB AND FFTWF_THREADS_LIB)
+  set(FFTW_LIBRARIES ${FFTW_THREADS_LIB} ${FFTWF_THREADS_LIB} ${FFTW_LIBRARIES})
+  set(FFTW_THREADS_FOUND TRUE)
+else()
+  set(FFTW_THREADS_FOUND FALSE)
+endif()
 set( CMAKE_FIND_LIBRARY_SUFFIXES ${CMAKE_FIND_LIBRARY_SUFFIXES_SAV} )
 include(FindPackageHandleStandardArgs)
 find_package_handle_standard_args(FFTW DEFAULT_MSG
                                   FFTW_INCLUDES FFTW_LIBRARIES)
-mark_as_advanced(FFTW_INCLUDES FFTW_LIBRARIES FFTW_LIB FFTWF_LIB FFTWL_LIB)
+mark_as_advanced(FFTW_INCLUDES FFTW_LIBRARIES FFTW_LIB FFTWF_LIB FFTWL_LIB FFTW_THREADS_LIB FFTWF_THREADS_LIB)
@@ -0,0 +1,110 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#include <algorithm>
+
+#include "active_set.h"
+
+active_set::active_set(long size, bool with_values, float default_value, bool full):
+    size(size), full(full), with_values(with_values), default_value(default_value), nchanged(0)
+{
+}
+
+long active_set::find(long ind)
+{
+    return std::lower_bound(index.begin(), index.end(), ind) - index.begin();
+}
+
+void active_set::get_range(int t, int nthreads, long &start, long &end)
+{
+    get_range(t, nthreads, 0, size, start, end);
+}
+
+void active_set::get_range(int t, int nthreads, long first, long last, long &start, long &end)
+{
+    long chunk = (last - first + nthreads - 1) / nthreads;
+    start = std::min(last, first + t * chunk);
+    end   = std::min(last, start + chunk);
+}
+
+void active_set::begin_update(int nthreads)
+{
+    staged_index.resize(nthreads);
+    staged_value.resize(nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        staged_index[t].clear();
+        staged_value[t].clear();
+    }
+}
+
+void active_set::end_update()
+{
+    // The slots cover contiguous ranges of coefficients in order, so the
+    // concatenation of their indices is sorted
+    long nactive = 0;
+    for (unsigned t = 0; t < staged_index.size(); t++) {
+        nactive += staged_index[t].size();
+    }
+    long nprevious = get_nactive();
+    index.swap(previous);
+    index.resize(nactive);
+    value.resize(with_values ? nactive : 0);
+
+    long pos = 0;
+    for (unsigned t = 0; t < staged_index.size(); t++) {
+        std::copy(staged_index[t].begin(), staged_index[t].end(), index.begin() + pos);
+        if (with_values) {
+            std::copy(staged_value[t].begin(), staged_value[t].end(), value.begin() + pos);
+        }
+        pos += staged_index[t].size();
+    }
+
+    // Counts the coefficients active both before and after the update
+    long ncommon = nactive;
+    if (! full) {
+        ncommon = 0;
+        std::vector<long>::iterator it = previous.begin();
+        for (long n = 0; n < nactive; n++) {
+            it = std::lower_bound(it, previous.end(), index[n]);
+            if (it == previous.end()) {
+                break;
+            }
+            if (*it == index[n]) {
+                ncommon++;
+            }
+        }
+    }
+    nchanged = nprevious + nactive - 2 * ncommon;
+    full = false;
+}
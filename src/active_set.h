@@ -0,0 +1,143 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#ifndef ACTIVE_SET_H
+#define ACTIVE_SET_H
+
+#include <vector>
+
+/*! Compressed set of active wavelet coefficients.
+ *
+ * Stores the sorted indices of the active coefficients, and optionally a
+ * value for each of them, the inactive coefficients taking a default value.
+ * The set is rebuilt in parallel, each thread pushing the active indices of
+ * a contiguous range of coefficients, so that its size follows the sparsity
+ * of the coefficients rather than their number.
+ */
+class active_set
+{
+    long size;                          /*!< Number of coefficients covered by the set */
+    bool full;                          /*!< Flag indicating that all the coefficients are active */
+    bool with_values;                   /*!< Flag indicating whether values are attached to the active coefficients */
+    float default_value;                /*!< Value of the inactive coefficients */
+
+    std::vector<long>  index;           /*!< Sorted indices of the active coefficients */
+    std::vector<long>  previous;        /*!< Indices before the last update, kept to reuse their storage */
+    long nchanged;                      /*!< Number of coefficients which entered or left the set at the last update */
+    std::vector<float> value;           /*!< Values of the active coefficients */
+
+    std::vector< std::vector<long> >  staged_index;     /*!< Indices pushed by each thread during an update */
+    std::vector< std::vector<float> > staged_value;     /*!< Values pushed by each thread during an update */
+
+public:
+    /*! Creates a set over size coefficients, initially empty or full
+     *
+     */
+    active_set(long size, bool with_values = false, float default_value = 0, bool full = false);
+
+    /*! Returns the number of active coefficients
+     *
+     */
+    long get_nactive() {
+        return full ? size : index.size();
+    }
+
+    /*! Returns true if all the coefficients are active
+     *
+     */
+    bool is_full() {
+        return full;
+    }
+
+    /*! Returns the number of coefficients which entered or left the set at the last update
+     *
+     */
+    long get_nchanged() {
+        return nchanged;
+    }
+
+    /*! Returns the sorted indices of the active coefficients, not valid for a full set
+     *
+     */
+    const long *get_index() {
+        return index.data();
+    }
+
+    /*! Returns the position of the first active coefficient with an index not lower than ind
+     *
+     */
+    long find(long ind);
+
+    /*! Returns the value of coefficient ind, cursor being a position obtained
+     * from find() for a lower index, advanced to the position of ind
+     */
+    float get_value(long ind, long &cursor) {
+        while (cursor < (long) index.size() && index[cursor] < ind) {
+            cursor++;
+        }
+        return (cursor < (long) index.size() && index[cursor] == ind) ? value[cursor] : default_value;
+    }
+
+    /*! Returns the range of coefficients processed by thread t out of nthreads during an update
+     *
+     */
+    void get_range(int t, int nthreads, long &start, long &end);
+
+    /*! Same as get_range for the coefficients in [first, last) only, so that an
+     * update can proceed through consecutive ranges with nthreads slots each
+     */
+    void get_range(int t, int nthreads, long first, long last, long &start, long &end);
+
+    /*! Starts rebuilding the set from scratch, with nthreads slots
+     *
+     */
+    void begin_update(int nthreads);
+
+    /*! Marks coefficient ind as active, called by slot t in increasing order of ind
+     *
+     */
+    void push(int t, long ind, float val = 0) {
+        staged_index[t].push_back(ind);
+        if (with_values) {
+            staged_value[t].push_back(val);
+        }
+    }
+
+    /*! Gathers the coefficients pushed in all the slots, the ranges of the
+     * slots following their order
+     */
+    void end_update();
+};
+
+#endif // ACTIVE_SET_H
@@ -0,0 +1,315 @@
+/*! Copyright CEA, 2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ *
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ *
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use,
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info".
+ *
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability.
+ *
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or
+ * data to be ensured and,  more generally, to use and operate it in the
+ * same conditions as regards security.
+ *
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ *
+ */
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <omp.h>
+
+#include "batched_nfft.h"
+#include "fftw_utils.h"
+
+/*! Window table of the plan, used in place in double precision */
+static const double *window_table(nfft_plan *plan, long size, double *&copy)
+{
+    copy = NULL;
+    return plan->psi;
+}
+
+/*! Window table of the plan, copied to single precision */
+static const float *window_table(nfft_plan *plan, long size, float *&copy)
+{
+    copy = (float *) malloc(sizeof(float) * size);
+    #pragma omp parallel for
+    for (long ind = 0; ind < size; ind++) {
+        copy[ind] = plan->psi[ind];
+    }
+    return copy;
+}
+
+template <typename T>
+batched_nfft_t<T>::batched_nfft_t(nfft_plan *plan, int nbatch):
+    batched_transform(plan->N[0], plan->N[1], plan->M_total, nbatch), plan(plan)
+{
+    n0 = plan->n[0];
+    n1 = plan->n[1];
+    m  = plan->m;
+
+    init_stripes();
+
+    psi = window_table(plan, M * 2 * (2 * m + 2), psi_copy);
+
+    c_phi_inv0 = (T *) malloc(sizeof(T) * N0);
+    c_phi_inv1 = (T *) malloc(sizeof(T) * N1);
+    for (int k = 0; k < N0; k++) {
+        c_phi_inv0[k] = plan->c_phi_inv[0][k];
+    }
+    for (int k = 0; k < N1; k++) {
+        c_phi_inv1[k] = plan->c_phi_inv[1][k];
+    }
+
+    g = fftw_api<T>::alloc(((long) n0) * n1 * nbatch);
+
+    // Each batch is transformed in place with a stride of nbatch, so that
+    // the grids of several batches can be transformed in parallel, each
+    // plan then runs on a single thread. With fewer batches than threads,
+    // as for 2D maps, the grids are instead transformed one at a time by
+    // all the threads.
+    int dimensions[2] = { n0, n1 };
+    setPlannerThreads(1);
+    plan_forward  = fftw_api<T>::plan_many(dimensions, g, nbatch, FFTW_FORWARD,  getPlannerFlags() | FFTW_UNALIGNED);
+    plan_backward = fftw_api<T>::plan_many(dimensions, g, nbatch, FFTW_BACKWARD, getPlannerFlags() | FFTW_UNALIGNED);
+    setPlannerThreads(getFFTWThreads());
+    plan_forward_mt  = NULL;
+    plan_backward_mt = NULL;
+    if (getFFTWThreads() > 1) {
+        plan_forward_mt  = fftw_api<T>::plan_many(dimensions, g, nbatch, FFTW_FORWARD,  getPlannerFlags() | FFTW_UNALIGNED);
+        plan_backward_mt = fftw_api<T>::plan_many(dimensions, g, nbatch, FFTW_BACKWARD, getPlannerFlags() | FFTW_UNALIGNED);
+    }
+}
+
+template <typename T>
+batched_nfft_t<T>::~batched_nfft_t()
+{
+    fftw_api<T>::destroy(plan_forward);
+    fftw_api<T>::destroy(plan_backward);
+    if (plan_forward_mt) {
+        fftw_api<T>::destroy(plan_forward_mt);
+        fftw_api<T>::destroy(plan_backward_mt);
+    }
+    fftw_api<T>::free(g);
+    free(stripe_start);
+    free(stripe_node);
+    free(psi_copy);
+    free(c_phi_inv0);
+    free(c_phi_inv1);
+}
+
+template <typename T>
+void batched_nfft_t<T>::init_stripes()
+{
+    // An even number of stripes, so that the window of a node only reaches
+    // the next stripe, including across the periodic boundary
+    int w = 2 * m + 2;
+    nstripes = n0 / w;
+    nstripes = nstripes >= 2 ? nstripes - nstripes % 2 : 1;
+    int width = n0 / nstripes;
+
+    stripe_start = (long *) malloc(sizeof(long) * (nstripes + 1));
+    stripe_node  = (long *) malloc(sizeof(long) * M);
+    int *stripe  = (int *) malloc(sizeof(int) * M);
+
+    for (int s = 0; s <= nstripes; s++) {
+        stripe_start[s] = 0;
+    }
+    for (long j = 0; j < M; j++) {
+        stripe[j] = std::min(window_start(j, 0) / width, nstripes - 1);
+        stripe_start[stripe[j] + 1]++;
+    }
+    for (int s = 0; s < nstripes; s++) {
+        stripe_start[s + 1] += stripe_start[s];
+    }
+    long *fill = (long *) malloc(sizeof(long) * nstripes);
+    for (int s = 0; s < nstripes; s++) {
+        fill[s] = stripe_start[s];
+    }
+    for (long j = 0; j < M; j++) {
+        stripe_node[fill[stripe[j]]++] = j;
+    }
+    free(fill);
+    free(stripe);
+}
+
+template <typename T>
+void batched_nfft_t<T>::execute_grids(plan_t p, plan_t p_mt, int first, int count)
+{
+    double t0 = omp_get_wtime();
+    if (useThreadedPlans(count)) {
+        for (int b = first; b < first + count; b++) {
+            fftw_api<T>::execute(p_mt, g + b, g + b);
+        }
+    } else {
+        #pragma omp parallel for
+        for (int b = first; b < first + count; b++) {
+            fftw_api<T>::execute(p, g + b, g + b);
+        }
+    }
+    fft_time += omp_get_wtime() - t0;
+}
+
+template <typename T>
+void batched_nfft_t<T>::trafo(int first, int count)
+{
+    int last = first + count;
+    long ng = ((long) n0) * n1;
+    int w = 2 * m + 2;
+
+    #pragma omp parallel for
+    for (long l = 0; l < ng; l++) {
+        for (int b = first; b < last; b++) {
+            g[l * nbatch + b][0] = 0;
+            g[l * nbatch + b][1] = 0;
+        }
+    }
+
+    // Deconvolution by the window function and zero padding, same as nfft_trafo_2d
+    #pragma omp parallel for
+    for (int k0 = 0; k0 < N0; k0++) {
+        int i0 = k0 < N0 / 2 ? n0 - N0 / 2 + k0 : k0 - N0 / 2;
+        T c0 = c_phi_inv0[k0];
+
+        for (int k1 = 0; k1 < N1; k1++) {
+            int i1 = k1 < N1 / 2 ? n1 - N1 / 2 + k1 : k1 - N1 / 2;
+            T c = c0 * c_phi_inv1[k1];
+
+            complex *gk = g + (((long) i0) * n1 + i1) * nbatch;
+            for (int b = first; b < last; b++) {
+                long pos = ((long) b) * N0 * N1 + ((long) k0) * N1 + k1;
+                gk[b][0] = f_hat[pos][0] * c;
+                gk[b][1] = f_hat[pos][1] * c;
+            }
+        }
+    }
+
+    execute_grids(plan_forward, plan_forward_mt, first, count);
+
+    // Interpolation at the nodes, each window is read once for all batches
+    #pragma omp parallel for
+    for (long j = 0; j < M; j++) {
+        fftw_complex *fj = f + j * nbatch;
+        const T *psi0 = psi + (j * 2) * w;
+        const T *psi1 = psi0 + w;
+
+        for (int b = first; b < last; b++) {
+            fj[b][0] = 0;
+            fj[b][1] = 0;
+        }
+
+        int i0 = window_start(j, 0);
+        for (int l0 = 0; l0 < w; l0++) {
+            int i1 = window_start(j, 1);
+            for (int l1 = 0; l1 < w; l1++) {
+                T p = psi0[l0] * psi1[l1];
+                complex *gl = g + (((long) i0) * n1 + i1) * nbatch;
+                for (int b = first; b < last; b++) {
+                    fj[b][0] += p * gl[b][0];
+                    fj[b][1] += p * gl[b][1];
+                }
+                i1 = i1 + 1 == n1 ? 0 : i1 + 1;
+            }
+            i0 = i0 + 1 == n0 ? 0 : i0 + 1;
+        }
+    }
+}
+
+template <typename T>
+void batched_nfft_t<T>::adjoint(int first, int count)
+{
+    int last = first + count;
+    long ng = ((long) n0) * n1;
+    int w = 2 * m + 2;
+
+    #pragma omp parallel for
+    for (long l = 0; l < ng; l++) {
+        for (int b = first; b < last; b++) {
+            g[l * nbatch + b][0] = 0;
+            g[l * nbatch + b][1] = 0;
+        }
+    }
+
+    // Spreading of the samples on the oversampled grids. The stripes of
+    // the same parity do not share any grid point and are processed
+    // concurrently, each task handling a group of batches. The batches are
+    // split in as many groups as needed to occupy all the threads.
+    int nphases = nstripes >= 2 ? 2 : 1;
+    int ntasks  = nstripes / nphases;
+    int ngroups = std::min(count, std::max(1, (2 * omp_get_max_threads() + ntasks - 1) / ntasks));
+
+    for (int phase = 0; phase < nphases; phase++) {
+        #pragma omp parallel for collapse(2) schedule(dynamic)
+        for (int t = 0; t < ntasks; t++) {
+            for (int grp = 0; grp < ngroups; grp++) {
+                int s       = t * nphases + phase;
+                int b_start = first + (count * grp) / ngroups;
+                int b_end   = first + (count * (grp + 1)) / ngroups;
+
+                for (long k = stripe_start[s]; k < stripe_start[s + 1]; k++) {
+                    long j = stripe_node[k];
+                    fftw_complex *fj = f + j * nbatch;
+                    const T *psi0 = psi + (j * 2) * w;
+                    const T *psi1 = psi0 + w;
+
+                    int i0 = window_start(j, 0);
+                    for (int l0 = 0; l0 < w; l0++) {
+                        int i1 = window_start(j, 1);
+                        for (int l1 = 0; l1 < w; l1++) {
+                            T p = psi0[l0] * psi1[l1];
+                            complex *gl = g + (((long) i0) * n1 + i1) * nbatch;
+                            for (int b = b_start; b < b_end; b++) {
+                                gl[b][0] += p * fj[b][0];
+                                gl[b][1] += p * fj[b][1];
+                            }
+                            i1 = i1 + 1 == n1 ? 0 : i1 + 1;
+                        }
+                        i0 = i0 + 1 == n0 ? 0 : i0 + 1;
+                    }
+                }
+            }
+        }
+    }
+
+    execute_grids(plan_backward, plan_backward_mt, first, count);
+
+    // Truncation to the N0 x N1 coefficients and deconvolution, same as nfft_adjoint_2d
+    #pragma omp parallel for
+    for (int k0 = 0; k0 < N0; k0++) {
+        int i0 = k0 < N0 / 2 ? n0 - N0 / 2 + k0 : k0 - N0 / 2;
+        T c0 = c_phi_inv0[k0];
+
+        for (int k1 = 0; k1 < N1; k1++) {
+            int i1 = k1 < N1 / 2 ? n1 - N1 / 2 + k1 : k1 - N1 / 2;
+            T c = c0 * c_phi_inv1[k1];
+
+            complex *gk = g + (((long) i0) * n1 + i1) * nbatch;
+            for (int b = first; b < last; b++) {
+                long pos = ((long) b) * N0 * N1 + ((long) k0) * N1 + k1;
+                f_hat[pos][0] = gk[b][0] * c;
+                f_hat[pos][1] = gk[b][1] * c;
+            }
+        }
+    }
+}
+
+template class batched_nfft_t<double>;
+template class batched_nfft_t<float>;
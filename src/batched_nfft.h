@@ -0,0 +1,161 @@
+/*! Copyright CEA, 2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ *
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ *
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use,
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info".
+ *
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability.
+ *
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or
+ * data to be ensured and,  more generally, to use and operate it in the
+ * same conditions as regards security.
+ *
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ *
+ */
+
+
+#ifndef BATCHED_NFFT_H
+#define BATCHED_NFFT_H
+
+#include <cmath>
+#include <nfft3.h>
+
+#include "batched_transform.h"
+
+/*! FFTW interface in the precision of the real type T.
+ *
+ */
+template <typename T> struct fftw_api;
+
+template <> struct fftw_api<double>
+{
+    typedef fftw_complex complex;
+    typedef fftw_plan    plan;
+
+    static complex *alloc(long n) { return fftw_alloc_complex(n); }
+    static void free(complex *p) { fftw_free(p); }
+    static void execute(plan p, complex *in, complex *out) { fftw_execute_dft(p, in, out); }
+    static void destroy(plan p) { fftw_destroy_plan(p); }
+    static plan plan_many(int *dimensions, complex *g, int stride, int sign, unsigned flags) {
+        return fftw_plan_many_dft(2, dimensions, 1, g, NULL, stride, 1, g, NULL, stride, 1, sign, flags);
+    }
+};
+
+template <> struct fftw_api<float>
+{
+    typedef fftwf_complex complex;
+    typedef fftwf_plan    plan;
+
+    static complex *alloc(long n) { return fftwf_alloc_complex(n); }
+    static void free(complex *p) { fftwf_free(p); }
+    static void execute(plan p, complex *in, complex *out) { fftwf_execute_dft(p, in, out); }
+    static void destroy(plan p) { fftwf_destroy_plan(p); }
+    static plan plan_many(int *dimensions, complex *g, int stride, int sign, unsigned flags) {
+        return fftwf_plan_many_dft(2, dimensions, 1, g, NULL, stride, 1, g, NULL, stride, 1, sign, flags);
+    }
+};
+
+/*! Batched 2D NFFT sharing the nodes of a precomputed nfft plan.
+ *
+ * Applies nbatch transforms at the same nodes in a single pass over the
+ * nodes, reusing the psi and phi_hut tables of the provided plan. The node
+ * values are interleaved, f[j * nbatch + b], so that the window footprint
+ * of each node is only walked once for all the batches. The oversampled
+ * grids are interleaved the same way.
+ *
+ * The oversampled grids, the window tables and the FFTs are computed in the
+ * precision of T. In single precision the psi table of the plan is copied
+ * to float, the plan can then release its own table. The Fourier
+ * coefficients and node values exchanged through batched_transform remain
+ * in double precision.
+ *
+ * The reference plan must have been initialised with PRE_PHI_HUT and its
+ * psi must have been precomputed.
+ */
+template <typename T>
+class batched_nfft_t : public batched_transform
+{
+    typedef typename fftw_api<T>::complex complex;
+    typedef typename fftw_api<T>::plan    plan_t;
+
+    nfft_plan *plan;                    /*!< Reference plan providing the nodes and window tables */
+    int  n0, n1;                        /*!< Size of the oversampled grid in each dimension */
+    int  m;                             /*!< Cut-off parameter of the window function */
+
+    const T *psi;                       /*!< Window table, the one of the plan in double precision */
+    T *psi_copy;                        /*!< Single precision copy of the window table, NULL in double precision */
+    T *c_phi_inv0, *c_phi_inv1;         /*!< Deconvolution factors in each dimension */
+
+    complex *g;                         /*!< Oversampled grids, interleaved by grid point */
+
+    int  nstripes;                      /*!< Number of stripes of rows of the oversampled grid used for the spreading */
+    long *stripe_start;                 /*!< Offset of the first node of each stripe in stripe_node */
+    long *stripe_node;                  /*!< Nodes sorted by stripe of the first row of their window */
+
+    plan_t plan_forward, plan_backward;        /*!< Plans of a single grid running on one thread */
+    plan_t plan_forward_mt, plan_backward_mt;  /*!< Plans of a single grid using all the FFTW threads, NULL with a single thread */
+
+    /*! Index of the first oversampled grid point in the window of node j along dimension t */
+    inline int window_start(long j, int t) {
+        int n = t == 0 ? n0 : n1;
+        int u = ((int) floor(plan->x[2 * j + t] * n)) - m;
+        return (u % n + n) % n;
+    }
+
+    /*! Buckets the nodes by stripe of rows, each stripe being at least as wide as the window */
+    void init_stripes();
+
+    /*! Transforms the grids of the batches first to first + count - 1 in place,
+     * concurrently with the single threaded plan p or one after the other with
+     * the threaded plan p_mt when there are fewer batches than threads
+     */
+    void execute_grids(plan_t p, plan_t p_mt, int first, int count);
+
+public:
+    using batched_transform::trafo;
+    using batched_transform::adjoint;
+
+    /*! Initialise a batch of nbatch transforms sharing the nodes of plan.
+     *
+     */
+    batched_nfft_t(nfft_plan *plan, int nbatch);
+
+    /*! Destructor
+     *
+     */
+    ~batched_nfft_t();
+
+    /*! Computes the NFFT of the batches first to first + count - 1 only
+     *
+     */
+    void trafo(int first, int count);
+
+    /*! Computes the adjoint NFFT of the batches first to first + count - 1 only
+     *
+     */
+    void adjoint(int first, int count);
+};
+
+typedef batched_nfft_t<double> batched_nfft;
+typedef batched_nfft_t<float>  batched_nfftf;
+
+#endif // BATCHED_NFFT_H
@@ -0,0 +1,139 @@
+/*! Copyright CEA, 2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ *
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ *
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use,
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info".
+ *
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability.
+ *
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or
+ * data to be ensured and,  more generally, to use and operate it in the
+ * same conditions as regards security.
+ *
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ *
+ */
+
+#ifndef BATCHED_TRANSFORM_H
+#define BATCHED_TRANSFORM_H
+
+#include <fftw3.h>
+
+/*! Batch of 2D non-equispaced transforms sharing the same nodes.
+ *
+ * Holds the Fourier coefficients of each batch, stored plane by plane as in
+ * nfft_plan::f_hat, and the samples at the nodes, interleaved by node as
+ * f[j * nbatch + b]. Derived classes implement the transform between the two.
+ */
+class batched_transform
+{
+protected:
+    int  nbatch;                        /*!< Number of transforms computed simultaneously */
+    int  N0, N1;                        /*!< Number of Fourier coefficients in each dimension */
+    long M;                             /*!< Number of nodes */
+
+    fftw_complex *f_hat;                /*!< Fourier coefficients, stored plane by plane */
+    fftw_complex *f;                    /*!< Samples at the nodes, interleaved by node */
+    double fft_time;                    /*!< Time spent in the FFTs of the grids, in seconds */
+
+public:
+    /*! Allocates the coefficients and samples of nbatch transforms of size N0 x N1 at M nodes
+     *
+     */
+    batched_transform(int N0, int N1, long M, int nbatch):
+        nbatch(nbatch), N0(N0), N1(N1), M(M), fft_time(0)
+    {
+        f_hat = fftw_alloc_complex(((long) N0) * N1 * nbatch);
+        f     = fftw_alloc_complex(M * nbatch);
+
+        for (long ind = 0; ind < ((long) N0) * N1 * nbatch; ind++) {
+            f_hat[ind][0] = 0;
+            f_hat[ind][1] = 0;
+        }
+        for (long ind = 0; ind < M * nbatch; ind++) {
+            f[ind][0] = 0;
+            f[ind][1] = 0;
+        }
+    }
+
+    /*! Destructor
+     *
+     */
+    virtual ~batched_transform()
+    {
+        fftw_free(f_hat);
+        fftw_free(f);
+    }
+
+    /*! Returns the Fourier coefficients of batch b, stored as in nfft_plan::f_hat
+     *
+     */
+    fftw_complex *get_f_hat(int b) {
+        return f_hat + ((long) b) * N0 * N1;
+    }
+
+    /*! Returns the interleaved samples, the value of batch b at node j is f[j * nbatch + b]
+     *
+     */
+    fftw_complex *get_f() {
+        return f;
+    }
+
+    /*! Returns the number of transforms in the batch
+     *
+     */
+    int get_nbatch() {
+        return nbatch;
+    }
+
+    /*! Returns the time spent in the FFTs of the grids, in seconds
+     *
+     */
+    double get_fft_time() {
+        return fft_time;
+    }
+
+    /*! Computes the transform of all batches, from f_hat to f
+     *
+     */
+    void trafo() {
+        trafo(0, nbatch);
+    }
+
+    /*! Computes the transform of the batches first to first + count - 1 only
+     *
+     */
+    virtual void trafo(int first, int count) = 0;
+
+    /*! Computes the adjoint transform of all batches, from f to f_hat
+     *
+     */
+    void adjoint() {
+        adjoint(0, nbatch);
+    }
+
+    /*! Computes the adjoint transform of the batches first to first + count - 1 only
+     *
+     */
+    virtual void adjoint(int first, int count) = 0;
+};
+
+#endif // BATCHED_TRANSFORM_H
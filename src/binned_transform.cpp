@@ -0,0 +1,227 @@
+/*! Copyright CEA, 2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ *
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ *
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use,
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info".
+ *
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability.
+ *
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or
+ * data to be ensured and,  more generally, to use and operate it in the
+ * same conditions as regards security.
+ *
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ *
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <omp.h>
+
+#include "binned_transform.h"
+#include "fftw_utils.h"
+
+binned_transform::binned_transform(nfft_plan *plan, int nbatch):
+    batched_transform(plan->N[0], plan->N[1], plan->M_total, nbatch)
+{
+    long npixels = get_npixels();
+
+    // Grid point p0 along each dimension sits at x = p0 / N modulo 1, with the
+    // same convention as the nfft
+    pixel = (long *) malloc(sizeof(long) * M);
+    for (long j = 0; j < M; j++) {
+        int p0 = ((int) floor(plan->x[2 * j] * N0 + 0.5)) % N0;
+        int p1 = ((int) floor(plan->x[2 * j + 1] * N1 + 0.5)) % N1;
+        p0 = p0 < 0 ? p0 + N0 : p0;
+        p1 = p1 < 0 ? p1 + N1 : p1;
+        pixel[j] = ((long) p0) * N1 + p1;
+    }
+
+    // Nodes sorted by pixel, so that the accumulation can be done pixel by pixel
+    pixel_start = (long *) malloc(sizeof(long) * (npixels + 1));
+    pixel_node  = (long *) malloc(sizeof(long) * M);
+    for (long p = 0; p <= npixels; p++) {
+        pixel_start[p] = 0;
+    }
+    for (long j = 0; j < M; j++) {
+        pixel_start[pixel[j] + 1]++;
+    }
+    for (long p = 0; p < npixels; p++) {
+        pixel_start[p + 1] += pixel_start[p];
+    }
+    long *fill = (long *) malloc(sizeof(long) * npixels);
+    for (long p = 0; p < npixels; p++) {
+        fill[p] = pixel_start[p];
+    }
+    for (long j = 0; j < M; j++) {
+        pixel_node[fill[pixel[j]]++] = j;
+    }
+    free(fill);
+
+    g = fftw_alloc_complex(npixels * nbatch);
+
+    // Same split of the threads as batched_nfft, over the batches when there
+    // are enough of them, within each grid otherwise
+    int dimensions[2] = { N0, N1 };
+    setPlannerThreads(1);
+    plan_forward  = fftw_plan_many_dft(2, dimensions, 1,
+                                       g, NULL, nbatch, 1,
+                                       g, NULL, nbatch, 1,
+                                       FFTW_FORWARD, getPlannerFlags() | FFTW_UNALIGNED);
+    plan_backward = fftw_plan_many_dft(2, dimensions, 1,
+                                       g, NULL, nbatch, 1,
+                                       g, NULL, nbatch, 1,
+                                       FFTW_BACKWARD, getPlannerFlags() | FFTW_UNALIGNED);
+    setPlannerThreads(getFFTWThreads());
+    plan_forward_mt  = NULL;
+    plan_backward_mt = NULL;
+    if (getFFTWThreads() > 1) {
+        plan_forward_mt  = fftw_plan_many_dft(2, dimensions, 1,
+                                              g, NULL, nbatch, 1,
+                                              g, NULL, nbatch, 1,
+                                              FFTW_FORWARD, getPlannerFlags() | FFTW_UNALIGNED);
+        plan_backward_mt = fftw_plan_many_dft(2, dimensions, 1,
+                                              g, NULL, nbatch, 1,
+                                              g, NULL, nbatch, 1,
+                                              FFTW_BACKWARD, getPlannerFlags() | FFTW_UNALIGNED);
+    }
+}
+
+binned_transform::~binned_transform()
+{
+    fftw_destroy_plan(plan_forward);
+    fftw_destroy_plan(plan_backward);
+    if (plan_forward_mt) {
+        fftw_destroy_plan(plan_forward_mt);
+        fftw_destroy_plan(plan_backward_mt);
+    }
+    fftw_free(g);
+    free(pixel);
+    free(pixel_start);
+    free(pixel_node);
+}
+
+void binned_transform::execute_grids(fftw_plan p, fftw_plan p_mt, int first, int count)
+{
+    double t0 = omp_get_wtime();
+    if (useThreadedPlans(count)) {
+        for (int b = first; b < first + count; b++) {
+            fftw_execute_dft(p_mt, g + b, g + b);
+        }
+    } else {
+        #pragma omp parallel for
+        for (int b = first; b < first + count; b++) {
+            fftw_execute_dft(p, g + b, g + b);
+        }
+    }
+    fft_time += omp_get_wtime() - t0;
+}
+
+void binned_transform::synthesis(int first, int count)
+{
+    int last = first + count;
+
+    // Swap the half spaces so that the zero frequency lands on the first grid point
+    #pragma omp parallel for
+    for (int k0 = 0; k0 < N0; k0++) {
+        int i0 = k0 < N0 / 2 ? k0 + N0 / 2 : k0 - N0 / 2;
+
+        for (int k1 = 0; k1 < N1; k1++) {
+            int i1 = k1 < N1 / 2 ? k1 + N1 / 2 : k1 - N1 / 2;
+
+            fftw_complex *gk = g + (((long) i0) * N1 + i1) * nbatch;
+            for (int b = first; b < last; b++) {
+                long pos = ((long) b) * N0 * N1 + ((long) k0) * N1 + k1;
+                gk[b][0] = f_hat[pos][0];
+                gk[b][1] = f_hat[pos][1];
+            }
+        }
+    }
+
+    execute_grids(plan_forward, plan_forward_mt, first, count);
+}
+
+void binned_transform::analysis(int first, int count)
+{
+    int last = first + count;
+
+    execute_grids(plan_backward, plan_backward_mt, first, count);
+
+    #pragma omp parallel for
+    for (int k0 = 0; k0 < N0; k0++) {
+        int i0 = k0 < N0 / 2 ? k0 + N0 / 2 : k0 - N0 / 2;
+
+        for (int k1 = 0; k1 < N1; k1++) {
+            int i1 = k1 < N1 / 2 ? k1 + N1 / 2 : k1 - N1 / 2;
+
+            fftw_complex *gk = g + (((long) i0) * N1 + i1) * nbatch;
+            for (int b = first; b < last; b++) {
+                long pos = ((long) b) * N0 * N1 + ((long) k0) * N1 + k1;
+                f_hat[pos][0] = gk[b][0];
+                f_hat[pos][1] = gk[b][1];
+            }
+        }
+    }
+}
+
+void binned_transform::trafo(int first, int count)
+{
+    int last = first + count;
+
+    synthesis(first, count);
+
+    #pragma omp parallel for
+    for (long j = 0; j < M; j++) {
+        fftw_complex *fj = f + j * nbatch;
+        fftw_complex *gp = g + pixel[j] * nbatch;
+        for (int b = first; b < last; b++) {
+            fj[b][0] = gp[b][0];
+            fj[b][1] = gp[b][1];
+        }
+    }
+}
+
+void binned_transform::adjoint(int first, int count)
+{
+    int last = first + count;
+    long npixels = get_npixels();
+
+    // Accumulation of the samples in their pixel, each pixel gathering its
+    // own nodes so that there are no write conflicts between threads
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (long p = 0; p < npixels; p++) {
+        fftw_complex *gp = g + p * nbatch;
+        for (int b = first; b < last; b++) {
+            gp[b][0] = 0;
+            gp[b][1] = 0;
+        }
+
+        for (long k = pixel_start[p]; k < pixel_start[p + 1]; k++) {
+            fftw_complex *fj = f + pixel_node[k] * nbatch;
+            for (int b = first; b < last; b++) {
+                gp[b][0] += fj[b][0];
+                gp[b][1] += fj[b][1];
+            }
+        }
+    }
+
+    analysis(first, count);
+}
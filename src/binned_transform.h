@@ -0,0 +1,123 @@
+/*! Copyright CEA, 2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ *
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ *
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use,
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info".
+ *
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability.
+ *
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or
+ * data to be ensured and,  more generally, to use and operate it in the
+ * same conditions as regards security.
+ *
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ *
+ */
+
+#ifndef BINNED_TRANSFORM_H
+#define BINNED_TRANSFORM_H
+
+#include <nfft3.h>
+
+#include "batched_transform.h"
+
+/*! Batched 2D transform evaluated on the pixel grid.
+ *
+ * Each node of the reference nfft plan is assigned to the closest point of
+ * the N0 x N1 grid, so that the transform reduces to a plain FFT followed by
+ * a lookup of the pixel values. The grids are interleaved by pixel,
+ * g[p * nbatch + b], and can be accessed directly to work on per-pixel
+ * quantities instead of individual nodes.
+ */
+class binned_transform : public batched_transform
+{
+    long *pixel;                        /*!< Index of the grid point associated to each node */
+    long *pixel_start;                  /*!< Offset of the first node of each pixel in pixel_node */
+    long *pixel_node;                   /*!< Nodes sorted by pixel */
+
+    fftw_complex *g;                    /*!< Pixel grids, interleaved by pixel */
+
+    fftw_plan plan_forward, plan_backward;        /*!< Plans of a single grid running on one thread */
+    fftw_plan plan_forward_mt, plan_backward_mt;  /*!< Plans of a single grid using all the FFTW threads, NULL with a single thread */
+
+    /*! Transforms the grids of the batches first to first + count - 1 in place,
+     * concurrently with the single threaded plan p or one after the other with
+     * the threaded plan p_mt when there are fewer batches than threads
+     */
+    void execute_grids(fftw_plan p, fftw_plan p_mt, int first, int count);
+
+public:
+    using batched_transform::trafo;
+    using batched_transform::adjoint;
+
+    /*! Initialise a batch of nbatch transforms at the nodes of plan, binned on the N0 x N1 grid.
+     *
+     */
+    binned_transform(nfft_plan *plan, int nbatch);
+
+    /*! Destructor
+     *
+     */
+    ~binned_transform();
+
+    /*! Returns the index of the pixel in which node j falls
+     *
+     */
+    long get_pixel(long j) {
+        return pixel[j];
+    }
+
+    /*! Returns the number of pixels of the grid
+     *
+     */
+    long get_npixels() {
+        return ((long) N0) * N1;
+    }
+
+    /*! Returns the interleaved pixel grids, the value of batch b at pixel p is g[p * nbatch + b]
+     *
+     */
+    fftw_complex *get_grid() {
+        return g;
+    }
+
+    /*! Evaluates the batches first to first + count - 1 on the pixel grid, from f_hat to g
+     *
+     */
+    void synthesis(int first, int count);
+
+    /*! Adjoint of synthesis, from g to f_hat
+     *
+     */
+    void analysis(int first, int count);
+
+    /*! Computes the transform of the batches first to first + count - 1 only
+     *
+     */
+    void trafo(int first, int count);
+
+    /*! Computes the adjoint transform of the batches first to first + count - 1 only
+     *
+     */
+    void adjoint(int first, int count);
+};
+
+#endif // BINNED_TRANSFORM_H
@@ -0,0 +1,88 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#include <iostream>
+
+#include "convergence_monitor.h"
+
+convergence_monitor::convergence_monitor():
+    niter(0), tol(0), iter(0), rel_change(0), primal_res(0), dual_res(0), support_change(0),
+    total_iter(0), total_niter(0)
+{
+}
+
+void convergence_monitor::begin_stage(const std::string &name, long niter, double tol)
+{
+    stage = name;
+    this->niter = niter;
+    this->tol = tol;
+    iter = 0;
+    rel_change = primal_res = dual_res = support_change = 0;
+}
+
+bool convergence_monitor::update(double rel_change, double primal_res, double dual_res, double support_change)
+{
+    this->rel_change     = rel_change;
+    this->primal_res     = primal_res;
+    this->dual_res       = dual_res;
+    this->support_change = support_change;
+
+    if (iter % 100 == 0) {
+        std::cout << "Relative change : " << rel_change << " ; primal residual : " << primal_res
+                  << " ; dual residual : " << dual_res << " ; support changes : " << support_change << std::endl;
+    }
+    iter++;
+
+    return tol > 0 && rel_change < tol && primal_res < tol && dual_res < tol && support_change < tol;
+}
+
+void convergence_monitor::end_stage()
+{
+    total_iter  += iter;
+    total_niter += niter;
+
+    if (iter < niter) {
+        std::cout << "Stage " << stage << " converged after " << iter << " iterations out of " << niter << std::endl;
+    } else {
+        std::cout << "Stage " << stage << " ran its " << niter << " iterations" << std::endl;
+    }
+    std::cout << "Relative change : " << rel_change << " ; primal residual : " << primal_res
+              << " ; dual residual : " << dual_res << " ; support changes : " << support_change << std::endl;
+}
+
+void convergence_monitor::print_summary()
+{
+    std::cout << "Iterations run : " << total_iter << " out of " << total_niter
+              << ", saved by early stopping : " << total_niter - total_iter << std::endl;
+}
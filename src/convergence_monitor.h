@@ -0,0 +1,90 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#ifndef CONVERGENCE_MONITOR_H
+#define CONVERGENCE_MONITOR_H
+
+#include <string>
+
+/*! Tracks the convergence of the stages of a reconstruction.
+ *
+ * The solvers report at each iteration the relative change of the primal
+ * iterate, the relative primal and dual residuals and the fraction of
+ * wavelet coefficients entering or leaving the support. A stage is stopped
+ * as soon as all of them fall below its tolerance, a zero tolerance running
+ * the stage for its full number of iterations.
+ */
+class convergence_monitor
+{
+    std::string stage;                  /*!< Name of the current stage */
+    long niter;                         /*!< Maximum number of iterations of the current stage */
+    double tol;                         /*!< Tolerance of the current stage */
+    long iter;                          /*!< Number of iterations run in the current stage */
+
+    double rel_change;                  /*!< Relative change of the primal iterate at the last iteration */
+    double primal_res;                  /*!< Relative primal residual at the last iteration */
+    double dual_res;                    /*!< Relative dual residual at the last iteration */
+    double support_change;              /*!< Fraction of support changes at the last iteration */
+
+    long total_iter;                    /*!< Number of iterations run in all the stages */
+    long total_niter;                   /*!< Maximum number of iterations of all the stages */
+
+public:
+    /*! Creates a monitor without any stage
+     *
+     */
+    convergence_monitor();
+
+    /*! Starts a new stage of at most niter iterations
+     *
+     */
+    void begin_stage(const std::string &name, long niter, double tol);
+
+    /*! Records the metrics of an iteration, returns true when the stage has converged
+     *
+     */
+    bool update(double rel_change, double primal_res, double dual_res, double support_change);
+
+    /*! Reports the number of iterations and the final metrics of the stage
+     *
+     */
+    void end_stage();
+
+    /*! Reports the number of iterations saved over all the stages
+     *
+     */
+    void print_summary();
+};
+
+#endif // CONVERGENCE_MONITOR_H
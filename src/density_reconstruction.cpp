@@ -33,11 +33,14 @@
  */
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <omp.h>
 #ifdef DEBUG_FITS
 #include <sparse2d/IM_IO.h>
 #endif
 
 #include "density_reconstruction.h"
+#include "fftw_utils.h"
 
 using namespace std;
 
@@ -53,8 +56,15 @@ density_reconstruction::density_reconstruction(boost::property_tree::ptree confi
     nrandom       = config.get<int>("parameters.nrandom", 1000.0);
     nreweights    = config.get<int>("parameters.nreweights", 5);
     positivity    = config.get<bool>("parameters.positivity", false);
+    tol           = config.get<double>("parameters.tol", 0);
+    tol_reweight  = config.get<double>("parameters.tol_reweight", tol);
+    tol_debias    = config.get<double>("parameters.tol_debias", tol);
     double bl_reg = config.get<double>("parameters.battle_lemarie_reg", 0.1);
     double ls_reg = config.get<double>("parameters.last_scale_reg", 0.1);
+    std::string wavelet_backend = config.get("parameters.wavelet_backend", "auto");
+    std::string wavelet_cache = config.get<bool>("parameters.wavelet_cache", true) ? getCacheDirectory(config) : "";
+    double pyramid_tol = config.get<bool>("parameters.wavelet_pyramid", false) ? config.get<double>("parameters.wavelet_pyramid_tol", 1e-3) : 0;
+    size_t wavelet_memory = config.get<size_t>("parameters.wavelet_memory", 0) << 20;
 
 
     cout << "Using following reconstruction parameters :" << endl;
@@ -65,14 +75,30 @@ density_reconstruction::density_reconstruction(boost::property_tree::ptree confi
     npix = f->get_npix();
     nlp  = f->get_nlp();
 
-    // Allocate wavelet transform
-    wav = new wavelet_transform(npix, nscales, nlp);
+    // Allocate wavelet transform, timing both backends unless one is set
+    if (wavelet_backend == "auto") {
+        wavelet_backend = pyramid_tol > 0 ? "fft" : wavelet_transform::fastest_backend(npix, nscales, nlp, wavelet_cache, wavelet_memory);
+    }
+    wav = new wavelet_transform(npix, nscales, nlp, wavelet_backend, wavelet_cache, pyramid_tol, wavelet_memory);
+    if (config.get<bool>("parameters.check_wavelet", false)) {
+        if (! wav->check_frames()) {
+            std::cout << "The wavelet frames do not match the impulse responses of the starlet transform" << std::endl;
+            exit(-1);
+        }
+        if (! wav->check_backend()) {
+            std::cout << "The " << (pyramid_tol > 0 ? "pyramidal" : wavelet_backend) << " wavelet transform does not match the reference transform" << std::endl;
+            exit(-1);
+        }
+    }
 
     // Effective number of frames
     nframes = wav->get_nframes();
 
-    ncoeff = npix * npix * nlp;
-    nwavcoeff = npix * npix * nframes * nlp;
+    // Half spectra of the real density planes
+    nhalf  = npix / 2 + 1;
+    ncoeff = npix * nhalf * nlp;
+    nreal  = npix * npix * nlp;
+    nwavcoeff = wav->get_ncoeff() * nlp;
 
     // Allocating internal arrays
     delta       = fftwf_alloc_complex(ncoeff);
@@ -82,20 +108,14 @@ density_reconstruction::density_reconstruction(boost::property_tree::ptree confi
     delta_grad  = fftwf_alloc_complex(ncoeff);
     delta_tmp   = fftwf_alloc_complex(ncoeff);
     delta_tmp_f = fftwf_alloc_complex(ncoeff);
-    delta_trans = fftwf_alloc_complex(ncoeff);
+    delta_real  = (float *) fftwf_malloc(sizeof(float) * nreal);
     alpha       = (float *) malloc(sizeof(float) * nwavcoeff);
     alpha_u     = (float *) malloc(sizeof(float) * nwavcoeff);
     alpha_res   = (float *) malloc(sizeof(float) * nwavcoeff);
     alpha_tmp   = (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_prox  = (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_prox_prev= (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_prox_old= (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_grad_old= (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_grad= (float *) malloc(sizeof(float) * nwavcoeff);
     alpha_rec   = (float *) malloc(sizeof(float) * nwavcoeff);
     thresholds  = (float *) malloc(sizeof(float) * nwavcoeff);
     weights     = (float *) malloc(sizeof(float) * nwavcoeff);
-    support     = (float *) malloc(sizeof(float) * nwavcoeff);
 
     // Initialise internal arrays
     for (long ind = 0; ind < ncoeff; ind++) {
@@ -120,23 +140,19 @@ density_reconstruction::density_reconstruction(boost::property_tree::ptree confi
         alpha_u[ind]   = 0;
         alpha_res[ind] = 0;
         alpha_rec[ind] = 0;
-        alpha_prox[ind] = 0;
-        alpha_prox_prev[ind] = 0;
-        alpha_prox_old[ind] = 0;
-        alpha_grad[ind] = 0;
-        alpha_grad_old[ind] = 0;
         alpha_tmp[ind] = 0;
         thresholds[ind] = 0;
         weights[ind]   = 1;
-        support[ind]   = 1;
     }
 
+    support = new active_set(nwavcoeff);
+    monitor = new convergence_monitor();
+
     // Initialise the proximal operator
-    #ifdef CUDA_ACC
-    prox = new spg(npix, nlp, nframes, f->get_preconditioning_matrix(), thresholds);
-    #endif
+    prox = new spg(npix, nlp, wav->get_ncoeff(), f->get_preconditioning_matrix(), thresholds);
 
     // Normalization factor for the fft
+    fft_time      = 0;
     fftFactor     = 1.0 / (((double)npix) * npix);
 
     int dimensions[2] = { npix, npix };
@@ -148,6 +164,9 @@ density_reconstruction::density_reconstruction(boost::property_tree::ptree confi
     getDeviceCount(&nGPU);
     getGPUs(whichGPUs);
 
+    // The GPU transforms work on the full spectra
+    fft_frame = fftwf_alloc_complex(npix * npix * nlp);
+
     cufftResult ret = cufftCreate(&fft_plan);
 
     if (nGPU > 1) {
@@ -171,15 +190,18 @@ density_reconstruction::density_reconstruction(boost::property_tree::ptree confi
 
     }
 #else
-    fft_frame = fftwf_alloc_complex(npix * npix * nlp);
-    plan_forward = fftwf_plan_many_dft(rank, dimensions, nlp ,
-                                      fft_frame, NULL, 1, npix*npix,
-                                      fft_frame, NULL, 1, npix*npix,
-                                      FFTW_FORWARD, FFTW_MEASURE);
-    plan_backward = fftwf_plan_many_dft(rank, dimensions, nlp,
-                                       fft_frame, NULL, 1, npix*npix,
-                                       fft_frame, NULL, 1, npix*npix,
-                                       FFTW_BACKWARD, FFTW_MEASURE);
+    fft_frame  = fftwf_alloc_complex(ncoeff);
+    real_frame = (float *) fftwf_malloc(sizeof(float) * nreal);
+
+    int embed_half[2] = { npix, nhalf };
+    plan_forward = fftwf_plan_many_dft_r2c(rank, dimensions, nlp,
+                                           real_frame, dimensions, 1, npix * npix,
+                                           fft_frame,  embed_half, 1, npix * nhalf,
+                                           getPlannerFlags());
+    plan_backward = fftwf_plan_many_dft_c2r(rank, dimensions, nlp,
+                                            fft_frame,  embed_half, 1, npix * nhalf,
+                                            real_frame, dimensions, 1, npix * npix,
+                                            getPlannerFlags());
 #endif
 
 
@@ -213,19 +235,18 @@ density_reconstruction::~density_reconstruction()
     fftwf_free(delta_grad);
     fftwf_free(delta_tmp);
     fftwf_free(delta_tmp_f);
-    fftwf_free(delta_trans);
+    fftwf_free(delta_real);
     free(sigma_thr);
     free(alpha);
     free(alpha_u);
     free(alpha_res);
     free(alpha_tmp);
-    free(alpha_prox);
-    free(alpha_prox_prev);
-    free(alpha_prox_old);
-    free(alpha_grad);
-    free(alpha_grad_old);
     free(thresholds);
     free(weights);
+    delete support;
+    delete monitor;
+
+    delete prox;
 
 #ifdef CUDA_ACC
     if (nGPU > 1) {
@@ -234,37 +255,52 @@ density_reconstruction::~density_reconstruction()
         cudaFree(d_frame);
     }
     cufftDestroy(fft_plan);
-
-    delete prox;
 #else
     fftwf_destroy_plan(plan_backward);
     fftwf_destroy_plan(plan_forward);
-    fftwf_free(fft_frame);
+    fftwf_free(real_frame);
 #endif
+    fftwf_free(fft_frame);
 
 }
 
 
-void density_reconstruction::direct_fourier_transform(fftwf_complex *input, fftwf_complex *output)
+void density_reconstruction::direct_fourier_transform(float *input, fftwf_complex *output)
 {
 
 #ifdef CUDA_ACC
+    #pragma omp parallel for
+    for (long ind = 0; ind < nreal; ind++) {
+        fft_frame[ind][0] = input[ind]; fft_frame[ind][1] = 0;
+    }
+    double t0 = omp_get_wtime();
     if (nGPU > 1) {
-        cufftXtMemcpy(fft_plan, d_frameXt, input, CUFFT_COPY_HOST_TO_DEVICE);
+        cufftXtMemcpy(fft_plan, d_frameXt, fft_frame, CUFFT_COPY_HOST_TO_DEVICE);
         cufftXtExecDescriptorC2C(fft_plan, d_frameXt, d_frameXt, CUFFT_FORWARD);
-        cufftXtMemcpy(fft_plan, output, d_frameXt, CUFFT_COPY_DEVICE_TO_HOST);
+        cufftXtMemcpy(fft_plan, fft_frame, d_frameXt, CUFFT_COPY_DEVICE_TO_HOST);
     } else {
-        cudaMemcpy(d_frame, input, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyHostToDevice);
+        cudaMemcpy(d_frame, fft_frame, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyHostToDevice);
         cufftExecC2C(fft_plan, d_frame, d_frame, CUFFT_FORWARD);
-        cudaMemcpy(output, d_frame, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyDeviceToHost);
+        cudaMemcpy(fft_frame, d_frame, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyDeviceToHost);
     }
-#else
+    fft_time += omp_get_wtime() - t0;
 
+    // Only keeps the non negative frequencies along x
     #pragma omp parallel for
     for (long ind = 0; ind < ncoeff; ind++) {
-       fft_frame[ind][0] = input[ind][0]; fft_frame[ind][1] = input[ind][1];
+        long row = ind / nhalf;
+        int kx = ind % nhalf;
+        output[ind][0] = fft_frame[row * npix + kx][0]; output[ind][1] = fft_frame[row * npix + kx][1];
+    }
+#else
+
+    #pragma omp parallel for
+    for (long ind = 0; ind < nreal; ind++) {
+       real_frame[ind] = input[ind];
     }
+    double t0 = omp_get_wtime();
     fftwf_execute(plan_forward);
+    fft_time += omp_get_wtime() - t0;
     #pragma omp parallel for
     for (long ind = 0; ind < ncoeff; ind++) {
         output[ind][0] = fft_frame[ind][0]; output[ind][1] = fft_frame[ind][1];
@@ -273,17 +309,39 @@ void density_reconstruction::direct_fourier_transform(fftwf_complex *input, fftw
 }
 
 
-void density_reconstruction::inverse_fourier_transform(fftwf_complex *input, fftwf_complex *output)
+void density_reconstruction::inverse_fourier_transform(fftwf_complex *input, float *output)
 {
 #ifdef CUDA_ACC
+    // Rebuilds the full spectra from the Hermitian symmetry
+    #pragma omp parallel for
+    for (long ind = 0; ind < nreal; ind++) {
+        int z  = ind / (npix * npix);
+        int ky = (ind / npix) % npix;
+        int kx = ind % npix;
+        fftwf_complex *in = input + z * npix * nhalf;
+        if (kx < nhalf) {
+            fft_frame[ind][0] = in[ky * nhalf + kx][0];
+            fft_frame[ind][1] = in[ky * nhalf + kx][1];
+        } else {
+            long sym = ((npix - ky) % npix) * nhalf + (npix - kx);
+            fft_frame[ind][0] =  in[sym][0];
+            fft_frame[ind][1] = -in[sym][1];
+        }
+    }
+    double t0 = omp_get_wtime();
     if (nGPU > 1) {
-        cufftXtMemcpy(fft_plan, d_frameXt, input, CUFFT_COPY_HOST_TO_DEVICE);
+        cufftXtMemcpy(fft_plan, d_frameXt, fft_frame, CUFFT_COPY_HOST_TO_DEVICE);
         cufftXtExecDescriptorC2C(fft_plan, d_frameXt, d_frameXt, CUFFT_INVERSE);
-        cufftXtMemcpy(fft_plan, output, d_frameXt, CUFFT_COPY_DEVICE_TO_HOST);
+        cufftXtMemcpy(fft_plan, fft_frame, d_frameXt, CUFFT_COPY_DEVICE_TO_HOST);
     } else {
-        cudaMemcpy(d_frame, input, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyHostToDevice);
+        cudaMemcpy(d_frame, fft_frame, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyHostToDevice);
         cufftExecC2C(fft_plan, d_frame, d_frame, CUFFT_INVERSE);
-        cudaMemcpy(output, d_frame, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyDeviceToHost);
+        cudaMemcpy(fft_frame, d_frame, sizeof(cufftComplex)* npix * npix * nlp, cudaMemcpyDeviceToHost);
+    }
+    fft_time += omp_get_wtime() - t0;
+    #pragma omp parallel for
+    for (long ind = 0; ind < nreal; ind++) {
+        output[ind] = fft_frame[ind][0];
     }
 #else
 
@@ -291,10 +349,12 @@ void density_reconstruction::inverse_fourier_transform(fftwf_complex *input, fft
     for (long ind = 0; ind < ncoeff; ind++) {
         fft_frame[ind][0] = input[ind][0]; fft_frame[ind][1] = input[ind][1];
     }
+    double t0 = omp_get_wtime();
     fftwf_execute(plan_backward);
+    fft_time += omp_get_wtime() - t0;
     #pragma omp parallel for
-    for (long ind = 0; ind < ncoeff; ind++) {
-        output[ind][0] = fft_frame[ind][0]; output[ind][1] = fft_frame[ind][1];
+    for (long ind = 0; ind < nreal; ind++) {
+        output[ind] = real_frame[ind];
     }
 #endif
 }
@@ -302,6 +362,7 @@ void density_reconstruction::inverse_fourier_transform(fftwf_complex *input, fft
 
 void density_reconstruction::run_main_iteration(long int niter, bool debias)
 {
+    f->set_debias(debias);
 
 #ifdef DEBUG_FITS
     dblarray rec_delta(f->get_npix(), f->get_npix(), f->get_nlp());
@@ -311,6 +372,10 @@ void density_reconstruction::run_main_iteration(long int niter, bool debias)
     double old_tk = 1.0;
     double tk;
 
+    // Compute adjoint of the wavelet transform, then kept up to date at the
+    // end of each iteration
+    wav->trans_adjoint(alpha_u, delta_u);
+
     for (long iter = 0; iter < niter; iter++) {
         std::cout << "Iteration : " << iter << std::endl;
 
@@ -318,9 +383,6 @@ void density_reconstruction::run_main_iteration(long int niter, bool debias)
         std::memcpy(delta_grad, delta, sizeof(fftwf_complex) * ncoeff);
         f->gradient(delta_grad);
 
-        // Compute adjoint of the wavelet transform
-        wav->trans_adjoint(alpha_u, delta_u);
-
         // Updating delta by a gradient step
             #pragma omp parallel for
             for (long ind = 0; ind < ncoeff; ind++) {
@@ -329,31 +391,26 @@ void density_reconstruction::run_main_iteration(long int niter, bool debias)
             }
 
         // Apply positivity and/or E mode constraint
-        inverse_fourier_transform(delta_tmp, delta_tmp);
+        inverse_fourier_transform(delta_tmp, delta_real);
         if(positivity){
              #pragma omp parallel for
-            for (long ind = 0; ind < ncoeff; ind++) {
-                alpha_tmp[ind] = delta_tmp[ind][0] * fftFactor;
+            for (long ind = 0; ind < nreal; ind++) {
+                alpha_tmp[ind] = delta_real[ind] * fftFactor;
             }
 
-#ifdef CUDA_ACC
             prox->prox_pos(alpha_tmp);
-#else
 
-#endif
             #pragma omp parallel for
-            for (long ind = 0; ind < ncoeff; ind++) {
-                delta_tmp[ind][0] = delta_tmp[ind][0] * fftFactor - alpha_tmp[ind];
-                delta_tmp[ind][1] = 0;
+            for (long ind = 0; ind < nreal; ind++) {
+                delta_real[ind] = delta_real[ind] * fftFactor - alpha_tmp[ind];
             }
         }else{
             #pragma omp parallel for
-            for (long ind = 0; ind < ncoeff; ind++) {
-                delta_tmp[ind][0] *= fftFactor;
-                delta_tmp[ind][1] = 0;
+            for (long ind = 0; ind < nreal; ind++) {
+                delta_real[ind] *= fftFactor;
             }
         }
-        direct_fourier_transform(delta_tmp, delta_tmp);
+        direct_fourier_transform(delta_real, delta_tmp);
         ///////////////////////////////////////////////////////
 
 
@@ -370,27 +427,62 @@ void density_reconstruction::run_main_iteration(long int niter, bool debias)
           alpha_tmp[ind] = alpha_u[ind] + sig * alpha_tmp[ind];
         }
 
-#ifdef CUDA_ACC
         prox->prox_l1(alpha_tmp,1000);
-#else
-        // TODO: Implement CPU prox operator
-#endif
 
         // Fista update of the iterates
         tk = 0.5 * (1.0 + sqrt(1.0 + 4.0 * old_tk * old_tk));
-        // Updating delta
-        #pragma omp parallel for
+        // Updating delta, delta_old receiving the first part of the primal
+        // residual, (delta_prev - delta) / tau - delta_u
+        double ddelta2 = 0, delta2 = 0;
+        #pragma omp parallel for reduction(+:ddelta2,delta2)
         for (long ind = 0; ind < ncoeff; ind++) {
-            delta[ind][0] = delta_tmp[ind][0] + (old_tk - 1.) / tk * (delta_tmp[ind][0] - delta[ind][0]);
-            delta[ind][1] = delta_tmp[ind][1] + (old_tk - 1.) / tk * (delta_tmp[ind][1] - delta[ind][1]);
+            float re = delta_tmp[ind][0] + (old_tk - 1.) / tk * (delta_tmp[ind][0] - delta[ind][0]);
+            float im = delta_tmp[ind][1] + (old_tk - 1.) / tk * (delta_tmp[ind][1] - delta[ind][1]);
+            double dr = delta[ind][0] - re;
+            double di = delta[ind][1] - im;
+            ddelta2 += dr * dr + di * di;
+            delta2  += re * re + im * im;
+            delta_old[ind][0] = dr / tau - delta_u[ind][0];
+            delta_old[ind][1] = di / tau - delta_u[ind][1];
+            delta[ind][0] = re;
+            delta[ind][1] = im;
         }
-        // Updating alpha
-        #pragma omp parallel for
-        for (long ind = 0; ind < nwavcoeff; ind++) {
-            alpha_u[ind] = alpha_tmp[ind] + (old_tk - 1.) / tk * (alpha_tmp[ind] - alpha_u[ind]);
+        // Updating alpha, the support gathering the coefficients at the bound
+        // of the weighted l1 ball
+        double dalpha2 = 0, alpha2 = 0;
+        support->begin_update(omp_get_max_threads());
+        #pragma omp parallel reduction(+:dalpha2,alpha2)
+        {
+            int t = omp_get_thread_num();
+            long start, end;
+            support->get_range(t, omp_get_num_threads(), start, end);
+            for (long ind = start; ind < end; ind++) {
+                float val = alpha_tmp[ind] + (old_tk - 1.) / tk * (alpha_tmp[ind] - alpha_u[ind]);
+                dalpha2 += (val - alpha_u[ind]) * (val - alpha_u[ind]);
+                alpha2  += val * val;
+                if (fabs(val) >= weights[ind] * (1.0 - 1e-5)) {
+                    support->push(t, ind);
+                }
+                alpha_u[ind] = val;
+            }
         }
+        support->end_update();
 
         old_tk = tk;
+
+        // Compute adjoint of the wavelet transform and completes the primal residual
+        wav->trans_adjoint(alpha_u, delta_u);
+        double primal2 = 0;
+        #pragma omp parallel for reduction(+:primal2)
+        for (long ind = 0; ind < ncoeff; ind++) {
+            double pr = delta_old[ind][0] + delta_u[ind][0];
+            double pi = delta_old[ind][1] + delta_u[ind][1];
+            primal2 += pr * pr + pi * pi;
+        }
+
+        delta2 = std::max(delta2, 1e-30);
+        bool converged = monitor->update(sqrt(ddelta2 / delta2), tau * sqrt(primal2 / delta2), sqrt(dalpha2 / std::max(alpha2, 1e-30)),
+                                         ((double) support->get_nchanged()) / nwavcoeff);
 #ifdef DEBUG_FITS
         get_density_map(rec_delta.buffer());
         if(iter % 10 == 0){
@@ -400,139 +492,52 @@ void density_reconstruction::run_main_iteration(long int niter, bool debias)
         }
         fits_write_dblarr(name, rec_delta);
 #endif
+        if (converged) {
+            break;
+        }
     }
 }
 
-void density_reconstruction::analysis_prox(fftwf_complex *delta_in)
+void density_reconstruction::apply_preconditioning(const float *in, float *out, long nplane)
 {
-    int niter =500;
-    double tau_prox = 0.001;
-    double old_tk = 1.0;
-    double tk = 1.0;
-    float opt0=1.0;
-    float opt=0;
-
-    // Corrects for the preconditioning matrix
     const double *P = f->get_preconditioning_matrix();
 
-    for (int iter = 0; iter < niter; iter ++) {
+    // Pixels processed together, for which the products of all the planes stay in cache
+    const long block = 1024;
+    long nblocks = nplane / block + (nplane % block > 0 ? 1 : 0);
 
-        // Compute gradient
-        wav->trans_adjoint(alpha_prox, delta_tmp_f);
+    #pragma omp parallel
+    {
+        double *acc = (double *) malloc(sizeof(double) * block);
 
-        for (int z = 0; z < nlp; z++) {
-            for (long ind = 0; ind < npix*npix ; ind++) {
-                delta_trans[z * npix * npix + ind][0] = 0;
-                delta_trans[z * npix * npix + ind][1] = 0;
+        #pragma omp for schedule(static)
+        for (long i = 0; i < nblocks; i++) {
+            long start = i * block;
+            long nb = std::min(block, nplane - start);
 
-                for (int z2 = 0; z2 < nlp; z2++) {
-                    delta_trans[z * npix * npix + ind][0] += P[z * nlp + z2] * delta_tmp_f[z2 * npix * npix + ind][0];
-                    delta_trans[z * npix * npix + ind][1] += P[z * nlp + z2] * delta_tmp_f[z2 * npix * npix + ind][1];
+            for (int z = 0; z < nlp; z++) {
+                for (long b = 0; b < nb; b++) {
+                    acc[b] = 0;
                 }
-            }
-        }
-
-        #pragma omp parallel for
-        for (long ind = 0; ind < ncoeff; ind++) {
-            delta_trans[ind][0] = delta_in[ind][0] / tau - delta_trans[ind][0];
-            delta_trans[ind][1] = delta_in[ind][1] / tau - delta_trans[ind][1];
-        }
-
-        for (int z = 0; z < nlp; z++) {
-            for (long ind = 0; ind < npix*npix ; ind++) {
-                delta_tmp_f[z * npix * npix + ind][0] = 0;
-                delta_tmp_f[z * npix * npix + ind][1] = 0;
-
                 for (int z2 = 0; z2 < nlp; z2++) {
-                    delta_tmp_f[z * npix * npix + ind][0] += P[z * nlp + z2] * delta_trans[z2 * npix * npix + ind][0];
-                    delta_tmp_f[z * npix * npix + ind][1] += P[z * nlp + z2] * delta_trans[z2 * npix * npix + ind][1];
+                    const float *x = &in[z2 * nplane + start];
+                    const double c = P[z * nlp + z2];
+                    #pragma omp simd
+                    for (long b = 0; b < nb; b++) {
+                        acc[b] += c * x[b];
+                    }
+                }
+                float *y = &out[z * nplane + start];
+                for (long b = 0; b < nb; b++) {
+                    y[b] = acc[b];
                 }
             }
         }
 
-
-        wav->transform(delta_tmp_f, alpha_grad);
-
-        // Compute BB update
-        double ss=0;
-        double sy=0;
-        double yy=0;
-        double s=0;
-        double y=0;
-        for (long ind = 0; ind < nwavcoeff; ind++) {
-            s = (alpha_prox[ind] - alpha_prox_old[ind]);
-            alpha_prox_old[ind] = alpha_prox[ind];
-            y = (alpha_grad[ind] - alpha_grad_old[ind]);
-            alpha_grad_old[ind] = alpha_grad[ind];
-            ss += s * s;
-            yy += y * y;
-            sy += s * y;
-        }
-
-        if(iter > 0){
-            if(iter % 2)
-                tau_prox = -sy/yy;
-            else
-                tau_prox = -ss/sy;
-        }
-        opt = 0;
-        for (long ind = 0; ind < nwavcoeff; ind++) {
-
-            double dum = alpha_prox[ind];
-            double w = weights[ind];
-            double g = alpha_grad[ind];
-            double o;
-            // Compute optimality check
-            if( dum >=  w*(1.0 - 1e-5)){
-                o = fabsf(fmaxf(0.0f, -g)) / fmaxf(w, 1e-5f);
-            }else  if( dum <= -w*(1.0 - 1e-5)) {
-                o = fabsf(fmaxf(0.0f, g)) / fmaxf(w, 1e-5f);
-            }else{
-                o = fabsf(g) / fmaxf(w, 1e-5f);
-            }
-            opt = o > opt ? o : opt;
-            // Gradient descent
-            dum = alpha_prox[ind] + tau_prox * alpha_grad[ind];
-
-            // Projection
-            double val = dum - copysign(max(fabs(dum) - weights[ind], 0.0), dum);
-            alpha_prox[ind] = val;
-        }
-
-        opt0 = opt < opt0 ? opt : opt0;
-        if (iter  % 100 == 0) std::cout << iter << " opt : " << opt << " ; tau : " << tau_prox <<std::endl;
-
-        if((opt < old_opt) || (opt < 5e-3) || ((iter >= 0.5*niter) && (opt == opt0) )){
-            std::cout << iter << " opt : " << opt << " ; tau : " << tau_prox <<std::endl;
-            break;
-        }
-
-    }
-
-    old_opt = opt0;
-
-    // Return prox
-    wav->trans_adjoint(alpha_prox, delta_tmp_f);
-
-    for (int z = 0; z < nlp; z++) {
-        for (long ind = 0; ind < npix*npix ; ind++) {
-            delta_trans[z * npix * npix + ind][0] = 0;
-            delta_trans[z * npix * npix + ind][1] = 0;
-
-            for (int z2 = 0; z2 < nlp; z2++) {
-                delta_trans[z * npix * npix + ind][0] += P[z * nlp + z2] * delta_tmp_f[z2 * npix * npix + ind][0];
-                delta_trans[z * npix * npix + ind][1] += P[z * nlp + z2] * delta_tmp_f[z2 * npix * npix + ind][1];
-            }
-        }
-    }
-
-    for (long ind = 0; ind < ncoeff; ind++) {
-        delta_in[ind][0] = delta_in[ind][0] - delta_trans[ind][0] * tau;
-        delta_in[ind][1] = delta_in[ind][1] - delta_trans[ind][1] * tau;
+        free(acc);
     }
 }
 
-
 void density_reconstruction::reconstruct()
 {
     std::cout << "Computing thresholds" << std::endl;
@@ -540,40 +545,53 @@ void density_reconstruction::reconstruct()
     compute_thresholds(nrandom);
 
     for (long z = 0 ; z < nlp ; z++) {
-        long offset = z * nframes * npix * npix;
+        long offset = z * wav->get_ncoeff();
         for (long n = 0; n < nframes; n++) {
-            for (long ind = 0; ind < npix * npix; ind++) {
-                weights[offset + n * npix * npix + ind] = sigma_thr[n] * thresholds[offset + n * npix * npix + ind];
+            for (long ind = offset + wav->get_frame_offset(n); ind < offset + wav->get_frame_offset(n + 1); ind++) {
+                weights[ind] = sigma_thr[n] * thresholds[ind];
             }
         }
     }
 
 #ifdef DEBUG_FITS
-    // Saves the thresholds
-    fltarray thr;
-    thr.alloc(weights, npix,npix,nframes*nlp);
-    fits_write_fltarr("thresholds.fits", thr);
+    // Saves the thresholds, as a cube when the frames share the same grid
+    if (! wav->is_pyramid()) {
+        fltarray thr;
+        thr.alloc(weights, npix,npix,nframes*nlp);
+        fits_write_fltarr("thresholds.fits", thr);
+    }
 #endif
 
-#ifdef CUDA_ACC
     prox->update_weights(weights);
-#endif
 
     std::cout << "Running main iteration" << std::endl;
+    monitor->begin_stage("main", nRecIter, tol);
     run_main_iteration(nRecIter);
+    monitor->end_stage();
 
     // Reweighted l1 loop
     for (int i = 0; i < nreweights ; i++) {
             f->update_covariance(delta);
             compute_thresholds(nrandom / 2);
             compute_weights();
+            monitor->begin_stage("reweighting " + std::to_string(i + 1), nRecIter / 2, tol_reweight);
             run_main_iteration(nRecIter / 2);
+            monitor->end_stage();
         }
 
     std::cout  << "Starting debiasing " << std::endl;
     // Final debiasing step
     f->update_covariance(delta);
+    monitor->begin_stage("debias", nRecIterDebias, tol_debias);
     run_main_iteration(nRecIterDebias, true);
+    monitor->end_stage();
+    monitor->print_summary();
+
+    f->print_reduced_shear_stats();
+
+    std::cout << "Time spent in FFTs with " << omp_get_max_threads() << " threads : "
+              << fft_time + wav->get_fft_time() + f->get_fft_time() << " s (wavelet transform : " << wav->get_fft_time()
+              << " s, lensing operator : " << f->get_fft_time() << " s)" << std::endl;
 }
 
 void density_reconstruction::compute_thresholds(int niter)
@@ -585,9 +603,8 @@ void density_reconstruction::compute_thresholds(int niter)
 
     for (int i = 0; i < niter ; i++) {
         f->gradient_noise(delta_rec);
-        f->combine_components(delta_rec, delta_trans);
 
-        wav->transform(delta_trans, alpha_tmp);
+        wav->transform(delta_rec, alpha_tmp);
 
         // Compute gradient step
         for (long ind = 0; ind < nwavcoeff; ind++) {
@@ -596,15 +613,17 @@ void density_reconstruction::compute_thresholds(int niter)
         }
     }
     for (long z = 0 ; z < nlp ; z++) {
-        long offset = z * nframes * npix * npix;
+        long offset = z * wav->get_ncoeff();
         for (long n = 0; n < nframes; n++) {
+            long start = offset + wav->get_frame_offset(n);
+            long end   = offset + wav->get_frame_offset(n + 1);
             double maxThr = 0;
-            for (long ind = 0; ind < npix * npix; ind++) {
-                thresholds[offset + n * npix * npix + ind] = sqrt(1.0 / ((double) niter) * thresholds[offset + n * npix * npix + ind]);
-                maxThr = thresholds[offset + n * npix * npix + ind] > maxThr ? thresholds[offset + n * npix * npix + ind] : maxThr;
+            for (long ind = start; ind < end; ind++) {
+                thresholds[ind] = sqrt(1.0 / ((double) niter) * thresholds[ind]);
+                maxThr = thresholds[ind] > maxThr ? thresholds[ind] : maxThr;
             }
-            for (long ind = 0; ind < npix * npix; ind++) {
-                thresholds[offset + n * npix * npix + ind] = max(thresholds[offset + n * npix * npix + ind], (float) maxThr * 0.1f);
+            for (long ind = start; ind < end; ind++) {
+                thresholds[ind] = max(thresholds[ind], (float) maxThr * 0.1f);
             }
         }
     }
@@ -663,12 +682,11 @@ void density_reconstruction::compute_weights()
         delta_tmp[ind][0] = delta[ind][0] * fftFactor;
         delta_tmp[ind][1] = delta[ind][1] * fftFactor;
     }
-    inverse_fourier_transform(delta_tmp, delta_tmp);
-    for (long ind = 0; ind < ncoeff; ind++) {
-        delta_tmp[ind][0] = max(delta_tmp[ind][0], 0.0f);
-        delta_tmp[ind][1] = 0;
+    inverse_fourier_transform(delta_tmp, delta_real);
+    for (long ind = 0; ind < nreal; ind++) {
+        delta_real[ind] = max(delta_real[ind], 0.0f);
     }
-    direct_fourier_transform(delta_tmp, delta_tmp);
+    direct_fourier_transform(delta_real, delta_tmp);
 
     wav->transform(delta_tmp, alpha_res);
 
@@ -684,25 +702,30 @@ void density_reconstruction::compute_weights()
 void density_reconstruction::get_density_map(double *d)
 {
 
+    #pragma omp parallel for
     for (long ind = 0; ind < ncoeff; ind++) {
         delta_tmp[ind][0] = delta[ind][0] * fftFactor;
         delta_tmp[ind][1] = delta[ind][1] * fftFactor;
     }
-    inverse_fourier_transform(delta_tmp, delta_tmp);
+    inverse_fourier_transform(delta_tmp, delta_real);
 
-    // Corrects for the preconditioning matrix
-    const double *P = f->get_preconditioning_matrix();
+    // Corrects for the preconditioning matrix, delta_tmp is large enough to
+    // hold the real planes
+    float *delta_prec = (float *) delta_tmp;
+    apply_preconditioning(delta_real, delta_prec, npix * npix);
 
+    #pragma omp parallel for
     for (int z = 0; z < nlp; z++) {
         for (int y = 0; y < npix ; y++) {
             for (int x = 0; x < npix ; x++) {
                 long pos = (npix - y - 1) * npix + (npix - x - 1);
-                d[z * npix * npix + x * npix + y] = 0;
-                for (int z2 = 0; z2 < nlp; z2++) {
-                    d[z * npix * npix + x * npix + y] += P[z * nlp + z2] * delta_tmp[z2 * npix * npix + pos][0];
-                }
+                d[z * npix * npix + x * npix + y] = delta_prec[z * npix * npix + pos];
             }
-
         }
     }
 }
+
+void density_reconstruction::initialise_from(const fftwf_complex *spectrum, int npix_coarse)
+{
+    interpolateSpectrum(spectrum, npix_coarse, delta, npix, nlp);
+}
@@ -45,12 +45,14 @@
 
 #ifdef CUDA_ACC
 #include <cufftXt.h>
-#include "spg.h"
 #include "gpu_utils.h"
 #endif
 
 
 #include "wavelet_transform.h"
+#include "active_set.h"
+#include "convergence_monitor.h"
+#include "spg.h"
 
 
 class density_reconstruction
@@ -62,23 +64,25 @@ class density_reconstruction
     double lambda;                      /*!< Regularisation parameter. */
     int    nreweights;                  /*!< Number of reweighted l1 iterations.*/
     bool   positivity;                  /*!< Apply positivity constraint on the reconstruction. */
+    double tol;                         /*!< Convergence tolerance of the main iterations, 0 to run them all. */
+    double tol_reweight;                /*!< Convergence tolerance of the reweighted iterations. */
+    double tol_debias;                  /*!< Convergence tolerance of the debiasing iterations. */
     
     // Internal parameters
     int npix;                           /*!< Number of pixels. */
     int nlp;                            /*!< Number of lens planes. */
+    int nhalf;                          /*!< Number of stored frequencies along x for the half spectra. */
     int ncoeff;                         /*!< Number of reconstruction coefficients. */
+    long nreal;                         /*!< Number of pixels in the real density planes. */
     int nframes;                        /*!< Total number of wavelet frames. */
     int nwavcoeff;                      /*!< Number of wavelet coefficients. */
     int nrandom;                        /*!< Number of noise randomisations for building thresholds. */
     double * sigma_thr;                 /*!< Array storing the regularisation parameter for each wavelet frame. */
     double mu1, mu2, sig, tau;          /*!< Hyper-parameters for the algorithm. */
-    float old_opt;
 
     wavelet_transform *wav;             /*!< Wavelet transform operator. */
     field *f;                           /*!< Lensing field to use for the reconstruction.*/
-#ifdef CUDA_ACC
     spg   *prox;                        /*!< SPG algorithm for fast evaluation of simple proximal operators */
-#endif
     
     // Internal reconstruction arrays
     fftwf_complex * delta;
@@ -88,20 +92,16 @@ class density_reconstruction
     fftwf_complex * delta_grad;
     fftwf_complex * delta_tmp;
     fftwf_complex * delta_tmp_f;
-    fftwf_complex * delta_trans;
+    float * delta_real;
     float * alpha;                     
     float * alpha_u;
     float * alpha_res;
     float * alpha_rec;
     float * alpha_tmp;
-    float * alpha_grad_old;
-    float * alpha_grad;
-    float * alpha_prox;
-    float * alpha_prox_prev;
-    float * alpha_prox_old;
     float * thresholds;
-    float * support;
     float * weights;
+    active_set * support;               /*!< Coefficients at the bound of the weighted l1 ball. */
+    convergence_monitor * monitor;      /*!< Convergence metrics and early stopping of the stages. */
     
     double fftFactor;
     
@@ -113,16 +113,21 @@ class density_reconstruction
     cufftHandle  fft_plan;
     cufftComplex  *d_frame;
 #else
-    fftwf_complex *fft_frame;
+    float *real_frame;
     fftwf_plan plan_forward, plan_backward;
 #endif
+    fftwf_complex *fft_frame;
+    double fft_time;                    /*!< Time spent in the FFTs of the density planes, in seconds. */
 
     double get_spectral_norm_prox(int niter, double tol);
     
-    void direct_fourier_transform(fftwf_complex *in, fftwf_complex *out);
-    void inverse_fourier_transform(fftwf_complex *in, fftwf_complex *out);
+    void direct_fourier_transform(float *in, fftwf_complex *out);
+    void inverse_fourier_transform(fftwf_complex *in, float *out);
     
-    void analysis_prox(fftwf_complex* delta_in);
+    /*! Mixes the lens planes with the preconditioning matrix, out[z] = sum_z2 P[z, z2] in[z2],
+     * for planes of nplane contiguous floats, processed in blocks of pixels.
+     */
+    void apply_preconditioning(const float *in, float *out, long nplane);
 
 public:
     
@@ -136,8 +141,8 @@ public:
      */
     ~density_reconstruction();
     
-     /*! Run the main iteration of the reconstruction algorithm for a number of iterations.
-     * 
+     /*! Run the main iteration of the reconstruction algorithm for a number of iterations,
+     * or until the stage started on the convergence monitor has converged.
      */
     void run_main_iteration(long niter, bool debias=false);
     
@@ -160,6 +165,18 @@ public:
      * 
      */
     void get_density_map(double *density);
+
+    /*! Returns the half spectra of the current density planes
+     *
+     */
+    const fftwf_complex *get_spectrum() {
+        return delta;
+    }
+
+    /*! Starts from the density planes of a reconstruction over the same
+     * field on a coarser grid of npix_coarse pixels, given by their spectra.
+     */
+    void initialise_from(const fftwf_complex *spectrum, int npix_coarse);
     
 };
 
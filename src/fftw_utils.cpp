@@ -0,0 +1,207 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#include <iostream>
+#include <sstream>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fftw3.h>
+
+#include "fftw_utils.h"
+
+static unsigned plannerFlags = FFTW_MEASURE;
+
+unsigned getPlannerFlags()
+{
+    return plannerFlags;
+}
+
+void setPlannerFlags(unsigned flags)
+{
+    plannerFlags = flags;
+}
+
+static int fftwThreads = 1;
+
+void setFFTWThreads(int nthreads)
+{
+#ifdef FFTW_THREADS
+    fftwThreads = nthreads;
+    setPlannerThreads(nthreads);
+#endif
+}
+
+int getFFTWThreads()
+{
+    return fftwThreads;
+}
+
+void setPlannerThreads(int nthreads)
+{
+#ifdef FFTW_THREADS
+    fftw_plan_with_nthreads(nthreads);
+    fftwf_plan_with_nthreads(nthreads);
+#endif
+}
+
+bool useThreadedPlans(int ngrids)
+{
+    return ngrids < fftwThreads;
+}
+
+std::string getCacheDirectory(boost::property_tree::ptree config)
+{
+    // Defaults to the user cache directory
+    std::string dir = config.get("parameters.cache_dir", "");
+    if (dir.empty()) {
+        const char *cache = getenv("XDG_CACHE_HOME");
+        const char *home  = getenv("HOME");
+        if (cache != NULL) {
+            dir = cache;
+        } else if (home != NULL) {
+            dir = std::string(home) + "/.cache";
+            mkdir(dir.c_str(), 0755);
+        } else {
+            return "";
+        }
+        dir += "/glimpse";
+    }
+    // Failures are reported when reading or writing the cached files
+    mkdir(dir.c_str(), 0755);
+    return dir;
+}
+
+std::string getWisdomFile(boost::property_tree::ptree config)
+{
+    if (! config.get<bool>("parameters.fftw_wisdom", true)) {
+        return "";
+    }
+    std::string dir = getCacheDirectory(config);
+    if (dir.empty()) {
+        return "";
+    }
+
+    char host[256];
+    if (gethostname(host, sizeof(host)) != 0) {
+        snprintf(host, sizeof(host), "unknown");
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    // The sizes, batch counts and strides of all the plans follow from
+    // these entries, the wisdom is also only valid for one FFTW version
+    const char *entries[] = { "survey.size", "survey.units",
+                              "field.pixel_size", "field.units", "field.padding",
+                              "field.nlp", "field.include_flexion",
+                              "field.backend", "field.toeplitz",
+                              "parameters.nscales", "parameters.wavelet_backend" };
+    std::stringstream key;
+    key << fftw_version;
+    for (unsigned i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+        key << ";" << entries[i] << "=" << config.get(entries[i], "");
+    }
+
+    std::stringstream fileName;
+    fileName << dir << "/" << host << "_" << std::hex << std::hash<std::string>()(key.str());
+    return fileName.str();
+}
+
+bool importWisdom(std::string baseName)
+{
+    if (baseName.empty()) {
+        return false;
+    }
+    bool found  = fftw_import_wisdom_from_filename((baseName + ".fftw").c_str());
+    bool foundf = fftwf_import_wisdom_from_filename((baseName + ".fftwf").c_str());
+    if (found || foundf) {
+        std::cout << "Loaded FFTW wisdom from " << baseName << std::endl;
+    }
+    return found || foundf;
+}
+
+bool exportWisdom(std::string baseName)
+{
+    if (baseName.empty()) {
+        return false;
+    }
+
+    // Written to temporary files first, so that concurrent jobs never read
+    // partially written wisdom
+    std::stringstream suffix;
+    suffix << "." << getpid();
+    std::string fileName  = baseName + ".fftw";
+    std::string fileNamef = baseName + ".fftwf";
+    bool saved = fftw_export_wisdom_to_filename((fileName + suffix.str()).c_str()) &&
+                 fftwf_export_wisdom_to_filename((fileNamef + suffix.str()).c_str());
+    saved = saved && rename((fileName + suffix.str()).c_str(), fileName.c_str()) == 0 &&
+                     rename((fileNamef + suffix.str()).c_str(), fileNamef.c_str()) == 0;
+    if (! saved) {
+        remove((fileName + suffix.str()).c_str());
+        remove((fileNamef + suffix.str()).c_str());
+        std::cout << "Warning: Could not save FFTW wisdom to " << baseName << std::endl;
+    }
+    return saved;
+}
+
+void interpolateSpectrum(const fftwf_complex *in, int npixIn, fftwf_complex *out, int npixOut, int nplanes)
+{
+    long nhalfIn  = npixIn / 2 + 1;
+    long nhalfOut = npixOut / 2 + 1;
+    int nyquist = std::min(npixIn, npixOut) / 2;
+
+    // The unnormalised transforms scale with the number of pixels
+    double scale = ((double) npixOut) * npixOut / (((double) npixIn) * npixIn);
+
+    #pragma omp parallel for
+    for (int z = 0; z < nplanes; z++) {
+        for (int y = 0; y < npixOut; y++) {
+            int ky = y < npixOut / 2 ? y : y - npixOut;
+            int yIn = ky >= 0 ? ky : ky + npixIn;
+            for (int x = 0; x < nhalfOut; x++) {
+                long pos = z * npixOut * nhalfOut + y * nhalfOut + x;
+                if (abs(ky) < nyquist && x < nyquist) {
+                    long posIn = z * npixIn * nhalfIn + yIn * nhalfIn + x;
+                    out[pos][0] = in[posIn][0] * scale;
+                    out[pos][1] = in[posIn][1] * scale;
+                } else {
+                    out[pos][0] = 0;
+                    out[pos][1] = 0;
+                }
+            }
+        }
+    }
+}
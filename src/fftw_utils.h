@@ -0,0 +1,100 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#ifndef FFTW_UTILS_H
+#define FFTW_UTILS_H
+
+#include <string>
+#include <fftw3.h>
+#include <boost/property_tree/ptree.hpp>
+
+/*! Planner flags shared by all the FFTW plans, FFTW_MEASURE by default
+ *
+ */
+unsigned getPlannerFlags();
+
+/*! Sets the planner flags used for the plans created from now on
+ *
+ */
+void setPlannerFlags(unsigned flags);
+
+/*! Sets the number of threads of FFTW, used by the plans created from now on
+ * and by the plans executed one grid at a time. Only 1 without multithreaded FFTW.
+ */
+void setFFTWThreads(int nthreads);
+
+/*! Returns the number of threads set by setFFTWThreads
+ *
+ */
+int getFFTWThreads();
+
+/*! Sets the number of threads of the plans created from now on, in both
+ * precisions, without changing the one returned by getFFTWThreads
+ */
+void setPlannerThreads(int nthreads);
+
+/*! Returns true if ngrids independent transforms are faster executed one
+ * after the other with threaded plans than concurrently with single
+ * threaded plans, that is when there are fewer grids than threads
+ */
+bool useThreadedPlans(int ngrids);
+
+/*! Returns the directory holding the files cached between runs, created if
+ * needed, an empty string if it cannot be determined
+ */
+std::string getCacheDirectory(boost::property_tree::ptree config);
+
+/*! Returns the base name of the wisdom cache files for this host and for the
+ * transform sizes set by the configuration, an empty string if the cache
+ * is disabled
+ */
+std::string getWisdomFile(boost::property_tree::ptree config);
+
+/*! Imports the double and single precision wisdom from the cache files,
+ * returns true if some wisdom was found
+ */
+bool importWisdom(std::string baseName);
+
+/*! Exports the double and single precision wisdom to the cache files
+ *
+ */
+bool exportWisdom(std::string baseName);
+
+/*! Fourier interpolation of nplanes consecutive half spectra from a grid of
+ * npixIn pixels to a grid of npixOut pixels covering the same field, the
+ * frequencies not represented below both Nyquist frequencies being set to zero
+ */
+void interpolateSpectrum(const fftwf_complex *in, int npixIn, fftwf_complex *out, int npixOut, int nplanes);
+
+#endif
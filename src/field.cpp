@@ -33,10 +33,14 @@
  */
 
 #include "field.h"
+#include "fftw_utils.h"
 
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <vector>
+#include <algorithm>
 #include <gsl/gsl_integration.h>
 #include <gsl/gsl_interp.h>
 
@@ -54,6 +58,54 @@
 
 #include <armadillo>
 
+/*! Cut-off parameter of the default window function, as chosen by nfft_init_2d.
+ *
+ */
+static int default_window_cut_off()
+{
+    nfft_plan p;
+    nfft_init_2d(&p, 16, 16, 1);
+    int m = p.m;
+    nfft_finalize(&p);
+    return m;
+}
+
+/*! Initialises a plan of N x N coefficients at M nodes holding only the nodes and the deconvolution factors.
+ *
+ * The coefficients, samples and oversampled grids are held by the batched
+ * transforms, the plan is never transformed itself.
+ */
+static void init_node_plan(nfft_plan *plan, int N, long M)
+{
+    int n0 = 1;
+    while (n0 < N) {
+        n0 *= 2;
+    }
+    int Ns[2] = { N, N };
+    int n[2]  = { 2 * n0, 2 * n0 };
+    nfft_init_guru(plan, 2, Ns, M, n, default_window_cut_off(), PRE_PHI_HUT | MALLOC_X, FFTW_ESTIMATE);
+}
+
+/*! Allocates and computes the psi table of the plan, as nfft_init does with PRE_PSI.
+ *
+ */
+static void precompute_psi(nfft_plan *plan)
+{
+    plan->psi = (double *) nfft_malloc(sizeof(double) * plan->M_total * plan->d * (2 * plan->m + 2));
+    plan->flags |= PRE_PSI;
+    nfft_precompute_one_psi(plan);
+}
+
+/*! Releases the psi table of the plan.
+ *
+ */
+static void release_psi(nfft_plan *plan)
+{
+    nfft_free(plan->psi);
+    plan->psi = NULL;
+    plan->flags &= ~PRE_PSI;
+}
+
 field::field(boost::property_tree::ptree config, survey *su)
 {
     surv = su;
@@ -103,6 +155,8 @@ field::field(boost::property_tree::ptree config, survey *su)
     double survey_size = surv->get_size();
     npix = survey_size / pixel_size;
     npix = npix + (npix % 2) + 2 * padding_size;
+    // The grid size can be imposed, as for the coarse levels of the multigrid schedule
+    npix = config.get<int>("field.npix", npix);
     size = npix * pixel_size;
     std::cout << "Number of pixels : " << npix << " Pixel size : " << pixel_size << std::endl;
 
@@ -115,6 +169,39 @@ field::field(boost::property_tree::ptree config, survey *su)
         }
     }
 
+    // Backend used to evaluate the lensing operator at the galaxy positions
+    std::string backend_str = config.get("field.backend", "nfft");
+    binned = false;
+    single_nfft = false;
+    if (backend_str.find("binned") != std::string::npos) {
+        binned = true;
+    } else if (backend_str.find("nfftf") != std::string::npos) {
+        single_nfft = true;
+    } else if (backend_str.find("nfft") == std::string::npos) {
+        std::cout << "Unknown field backend " << backend_str << ", using nfft" << std::endl;
+    }
+
+    // Precomputed normal operator, only available with the nfft backend
+    toeplitz = config.get<bool>("field.toeplitz", false);
+    if (toeplitz && binned) {
+        std::cout << "Toeplitz normal operator not available with the binned backend" << std::endl;
+        toeplitz = false;
+    }
+
+    // Schedule of the reduced shear correction
+    conv_every  = config.get<int>("field.reduced_shear_every", 1);
+    conv_tol    = config.get<double>("field.reduced_shear_tol", 0.);
+    conv_freeze_debias = config.get<bool>("field.reduced_shear_freeze_debias", false);
+    if (conv_every < 1) {
+        std::cout << "Invalid reduced_shear_every, updating the reduced shear correction at each iteration" << std::endl;
+        conv_every = 1;
+    }
+    conv_frozen = false;
+    conv_valid  = false;
+    conv_age    = 0;
+    n_conv_eval = 0;
+    n_conv_skip = 0;
+
     // Initialize the random number generator
     const gsl_rng_type *T;
     T = gsl_rng_default;
@@ -130,6 +217,34 @@ field::field(boost::property_tree::ptree config, survey *su)
     // Load data from the survey
     ngal = surv->get_ngal();
 
+    // Positions of the galaxies on the [-0.5, 0.5)^2 domain of the nfft
+    double *pos = (double *) malloc(sizeof(double) * 2 * ngal);
+    for (long ind = 0; ind < ngal;  ind++) {
+        double ra  = surv->get_ra(ind);
+        double dec = surv->get_dec(ind);
+        double denom = cos(center_dec) * cos(dec) * cos(ra  - center_ra) + sin(center_dec) * sin(dec);
+        double X =  cos(dec) * sin(ra  - center_ra) / denom;
+        double Y = (cos(center_dec) * sin(dec) - cos(dec) * sin(center_dec) * cos(ra - center_ra)) / denom;
+
+        double val = -0.5 + ((X) / size);
+        val = val < -0.5 ? val + 1.0 : val;
+        pos[2 * ind]  = val ;
+        val = -0.5 + ((Y) / size);
+        val = val < -0.5 ? val + 1.0 : val;
+        pos[2 * ind + 1] = val;
+    }
+
+    // Galaxies are stored along a space filling curve, so that neighbouring
+    // galaxies access neighbouring grid points in the nfft
+    gal_index = (long *) malloc(sizeof(long) * ngal);
+    if (config.get<bool>("field.sort_galaxies", true)) {
+        sort_galaxies(pos);
+    } else {
+        for (long i = 0; i < ngal; i++) {
+            gal_index[i] = i;
+        }
+    }
+
     // Allocate data arrays
     shear_gamma1 = (double *) malloc(sizeof(double) * ngal);
     shear_gamma2 = (double *) malloc(sizeof(double) * ngal);
@@ -151,16 +266,17 @@ field::field(boost::property_tree::ptree config, survey *su)
 
     // Loading data from the survey and initializing arrays
     for (long i = 0; i < ngal; i++) {
-        shear_gamma1[i] = surv->get_gamma1(i);
-        shear_gamma2[i] = surv->get_gamma2(i);
-        w_e[i]          = surv->get_shear_weight(i);
+        long c = gal_index[i];
+        shear_gamma1[i] = surv->get_gamma1(c);
+        shear_gamma2[i] = surv->get_gamma2(c);
+        w_e[i]          = surv->get_shear_weight(c);
         res_gamma1[i] = 0;
         res_gamma2[i] = 0;
 
         if (include_flexion) {
-            flexion_f1[i] = surv->get_F1(i);
-            flexion_f2[i] = surv->get_F2(i);
-            w_f[i]        = surv->get_flexion_weight(i);
+            flexion_f1[i] = surv->get_F1(c);
+            flexion_f2[i] = surv->get_F2(c);
+            w_f[i]        = surv->get_flexion_weight(c);
             res_f1[i] = 0;
             res_f2[i] = 0;
         }
@@ -169,37 +285,46 @@ field::field(boost::property_tree::ptree config, survey *su)
         cov[i]        = 1.;
     }
 
-    // Initialize the lensing planes, with one nfft per plane
-    ps = (nfft_plan **) malloc((nlp) * sizeof(nfft_plan *));
+    // Initialize the nfft plan holding the galaxy positions
     fft_frame = fftwf_alloc_complex(npix * npix * nlp);
+    nhalf     = npix / 2 + 1;
+    conv_ref  = conv_tol > 0 ? fftwf_alloc_complex(npix * nhalf * nlp) : NULL;
+
+    // Full spectra of the shear and flexion components used by the operators
+    delta_full = fftwf_alloc_complex((include_flexion ? 2 : 1) * npix * npix * nlp);
 
     // Normalization factor for the fft
     fftFactor =1.0/(((double)npix)*npix);
 
-    for (int i = 0; i < nlp; i++) {
-        // Create the nfft plan
-        ps[i] = new nfft_plan;
-        nfft_init_2d(ps[i], npix, npix, ngal);
-        // Set up the nodes at the galaxy positions
-        for (long ind = 0; ind < ngal;  ind++) {
-            double ra  = surv->get_ra(ind);
-            double dec = surv->get_dec(ind);
-            double denom = cos(center_dec) * cos(dec) * cos(ra  - center_ra) + sin(center_dec) * sin(dec);
-            double X =  cos(dec) * sin(ra  - center_ra) / denom;
-            double Y = (cos(center_dec) * sin(dec) - cos(dec) * sin(center_dec) * cos(ra - center_ra)) / denom;
+    ps = new nfft_plan();
+    init_node_plan(ps, npix, ngal);
 
-            double val = -0.5 + ((X) / size);
-            val = val < -0.5 ? val + 1.0 : val;
-            ps[i]->x[2 * ind]  = val ;
-            val = -0.5 + ((Y) / size);
-            val = val < -0.5 ? val + 1.0 : val;
-            ps[i]->x[2 * ind + 1] = val;
-        }
-        /** precompute psi, the entries of the matrix B */
-        nfft_precompute_one_psi(ps[i]);
-        if (nfft_check(ps[i])) {
-            std::cout << "Problem " << nfft_check(ps[i]) << std::endl;
-        }
+    // Set up the nodes at the galaxy positions
+    for (long ind = 0; ind < ngal;  ind++) {
+        ps->x[2 * ind]     = pos[2 * gal_index[ind]];
+        ps->x[2 * ind + 1] = pos[2 * gal_index[ind] + 1];
+    }
+    free(pos);
+
+    // The binned backend only needs the nodes
+    if (! binned) {
+        precompute_psi(ps);
+    }
+
+    // All the lens planes of the shear, flexion and convergence fields are
+    // transformed together, sharing the nodes and psi
+    flex_batch = nlp;
+    conv_batch = include_flexion ? 2 * nlp : nlp;
+    bins = NULL;
+    if (binned) {
+        bins   = new binned_transform(ps, conv_batch + nlp);
+        planes = bins;
+    } else if (single_nfft) {
+        // The gridder keeps its own single precision copy of psi
+        planes = new batched_nfftf(ps, conv_batch + nlp);
+        release_psi(ps);
+    } else {
+        planes = new batched_nfft(ps, conv_batch + nlp);
     }
 
     // Initialize the lensing kernel for each galaxy
@@ -251,6 +376,31 @@ field::field(boost::property_tree::ptree config, survey *su)
         sig_frac = flexion_sigma / shear_sigma;
    }
 
+    npairs = nlp * (nlp + 1) / 2;
+
+    if (binned) {
+        init_bins();
+        bin_measurements();
+        std::cout << "Binned " << ngal << " galaxies in " << nbins << " pixels" << std::endl;
+    }
+
+    toep_fft_time = 0;
+    if (toeplitz) {
+        init_toeplitz();
+        compute_toeplitz_kernels();
+        compute_toeplitz_data();
+    }
+
+    // Accuracy of the backend against the double precision nfft, or the
+    // binned backend for the nfft itself
+    if (config.get<bool>("field.check_backend", false)) {
+        if (! check_backend()) {
+            std::cout << "The " << (binned ? "binned" : (single_nfft ? "nfftf" : "nfft"))
+                      << " backend does not match the reference backend" << std::endl;
+            exit(-1);
+        }
+    }
+
 }
 
 field::~field()
@@ -268,6 +418,7 @@ field::~field()
     free(cov);
     free(lensKernel);
     free(lensKernelTrue);
+    free(gal_index);
 
     if (include_flexion) {
         free(res_f1);
@@ -278,11 +429,35 @@ field::~field()
     }
 
     // Deallocate nfft plans
-    for (int i = 0; i < nlp; i++) {
-        nfft_finalize(ps[i]);
-    }
-    free(ps);
+    delete planes;
+    nfft_finalize(ps);
+    delete ps;
     fftw_free(fft_frame);
+    fftwf_free(delta_full);
+    if (conv_ref) {
+        fftwf_free(conv_ref);
+    }
+    if (binned) {
+        free(bin_index);
+        free(bin_pixel);
+        free(bin_start);
+        free(bin_gal);
+        free(bin_w);
+        fftw_free(bin_y);
+    }
+    if (toeplitz) {
+        fftw_destroy_plan(toep_forward);
+        fftw_destroy_plan(toep_backward);
+        if (toep_forward_mt) {
+            fftw_destroy_plan(toep_forward_mt);
+            fftw_destroy_plan(toep_backward_mt);
+        }
+        fftw_free(toep_kernel);
+        fftw_free(toep_grid);
+        fftw_free(toep_data);
+        nfft_finalize(ps2);
+        delete ps2;
+    }
 }
 
 
@@ -309,26 +484,53 @@ void field::get_pixel_coordinates(double* ra, double* dec)
     }
 }
 
-void field::gradient(fftwf_complex *delta)
+void field::gradient(fftwf_complex *kappa)
 {
-    forward_operator(delta);
+    fftwf_complex *delta = delta_full;
+    bool convergence = reduced_shear_due(kappa);
 
-    // Compute residuals, note that we only differentiate for the second term here.
-    #pragma omp parallel for
-    for (int i = 0; i < ngal ; i++) {
-        double factor = std::max(1. - res_conv[i], 0.);
-        res_gamma1[i] = cov[i] * w_e[i] * (factor * shear_gamma1[i] - res_gamma1[i]);
-        res_gamma2[i] = cov[i] * w_e[i] * (factor * shear_gamma2[i] - res_gamma2[i]);
-        if (include_flexion) {
-            res_f1[i] = cov[i] * w_f[i] * (factor * flexion_f1[i] - res_f1[i]);
-            res_f2[i] = cov[i] * w_f[i] * (factor * flexion_f2[i] - res_f2[i]);
+    expand_spectrum(kappa, delta);
+
+    if (bins || toeplitz) {
+        // The measurements are only needed through their precomputed sums
+        if (convergence) {
+            evaluate_convergence(delta);
         }
+    } else {
+        forward_operator(delta, convergence);
+    }
+
+    if (convergence) {
+        convergence_updated(kappa);
+    } else {
+        conv_age++;
+        n_conv_skip++;
     }
 
-    adjoint_operator(delta);
+    if (bins) {
+        binned_gradient(delta);
+    } else if (toeplitz) {
+        toeplitz_gradient(delta);
+    } else {
+        // Compute residuals, note that we only differentiate for the second term here.
+        #pragma omp parallel for
+        for (int i = 0; i < ngal ; i++) {
+            double factor = std::max(1. - res_conv[i], 0.);
+            res_gamma1[i] = cov[i] * w_e[i] * (factor * shear_gamma1[i] - res_gamma1[i]);
+            res_gamma2[i] = cov[i] * w_e[i] * (factor * shear_gamma2[i] - res_gamma2[i]);
+            if (include_flexion) {
+                res_f1[i] = cov[i] * w_f[i] * (factor * flexion_f1[i] - res_f1[i]);
+                res_f2[i] = cov[i] * w_f[i] * (factor * flexion_f2[i] - res_f2[i]);
+            }
+        }
+
+        adjoint_operator(delta);
+    }
+
+    reduce_spectrum(delta, kappa);
 }
 
-void field::gradient_noise(fftwf_complex *delta)
+void field::gradient_noise(fftwf_complex *kappa)
 {
     for (long ind = 0; ind < ngal; ind++) {
         double theta1 = gsl_ran_flat(rng, 0, 2.0 * M_PI);
@@ -344,111 +546,110 @@ void field::gradient_noise(fftwf_complex *delta)
 
     }
 
-    adjoint_operator(delta,false);
+    adjoint_operator(delta_full, false);
+    reduce_spectrum(delta_full, kappa);
 }
 
-void field::forward_operator(fftwf_complex *delta)
+void field::forward_operator(fftwf_complex *delta, bool convergence)
 {
-    double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
+    fftw_complex *f = planes->get_f();
+    int nbatch = planes->get_nbatch();
 
-    fftwf_complex *deltaFlex = delta + nlp * npix * npix;
-
-    // First apply the kappa to gamma transform
-    #pragma omp parallel for
-    for (int z = 0; z < nlp; z++) {
-
-        double k1, k2, k1k1, k2k2, k1k2, ksqr;
-        double denom;
-
-        // Compute residuals (1 - Ax)y - Bx
-        for (int y = 0; y < npix ; y++) {
-            k2 = (y - npix / 2) * freqFactor;
-            int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
-
-            for (int x = 0; x < npix ; x++) {
-                k1 = (x - npix / 2) * freqFactor;
-                int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
-
-                long pos = ky * npix + kx + z * (npix * npix);
-                if (k1 == 0 && k2 == 0) {
-                    ps[z]->f_hat[y * npix + x][0] = 0;
-                    ps[z]->f_hat[y * npix + x][1] = 0;
-                    continue;
-                }
-
-                k1k1 = k1 * k1;
-                k2k2 = k2 * k2;
-                k1k2 = k1 * k2;
-                ksqr = k1k1 + k2k2;
+    // Convergence field used for the reduced shear correction
+    if (convergence) {
+        combine_components(delta, fft_frame);
+    }
 
-                denom = 1.0 / ksqr;
-                ps[z]->f_hat[y * npix + x][0] = denom * (delta[pos][0] * (k2k2 - k1k1) + delta[pos][1] * (2.0 * k1k2));
-                ps[z]->f_hat[y * npix + x][1] = denom * (delta[pos][1] * (k2k2 - k1k1) - delta[pos][0] * (2.0 * k1k2));
-            }
-        }
+    fill_spectra(delta, convergence);
 
-        nfft_trafo_2d(ps[z]);
+    if (convergence) {
+        planes->trafo();
+    } else {
+        planes->trafo(0, conv_batch);
     }
 
     // Apply the lensing efficiency kernel
     #pragma omp parallel for
-    for (int i = 0; i < ngal ; i++) {
+    for (long i = 0; i < ngal ; i++) {
+        fftw_complex *fi = f + i * nbatch;
+
         res_gamma1[i] = 0;
         res_gamma2[i] = 0;
         for (int z = 0; z < nlp ; z++) {
             double q = lensKernel[i * nlp + z];
-            res_gamma1[i] += q * ps[z]->f[i][0] * fftFactor;
-            res_gamma2[i] += q * ps[z]->f[i][1] * fftFactor;
+            res_gamma1[i] += q * fi[z][0] * fftFactor;
+            res_gamma2[i] += q * fi[z][1] * fftFactor;
         }
-    }
-
-    if (include_flexion) {
-        #pragma omp parallel for
-        for (int z = 0; z < nlp; z++) {
 
-            double k1, k2;
+        if (convergence) {
+            res_conv[i] = 0;
+            for (int z = 0; z < nlp ; z++) {
+                res_conv[i] += lensKernelTrue[i * nlp + z] * fi[conv_batch + z][0] * fftFactor;
+            }
+        }
 
-            for (int y = 0; y < npix ; y++) {
-                k2 = (y - npix / 2) * freqFactor;
-                int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
+        if (include_flexion) {
+            res_f1[i] = 0;
+            res_f2[i] = 0;
+            for (int z = 0; z < nlp ; z++) {
+                double q = lensKernel[i * nlp + z];
+                res_f1[i] += q * fi[flex_batch + z][0] * fftFactor;
+                res_f2[i] += q * fi[flex_batch + z][1] * fftFactor;
+            }
+        }
+    }
+}
 
-                for (int x = 0; x < npix ; x++) {
-                    k1 = (x - npix / 2) * freqFactor;
-                    int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
 
-                    long pos = ky * npix + kx + z * (npix * npix);
+void field::adjoint_operator(fftwf_complex *delta, bool preconditionning)
+{
+    fftw_complex *f = planes->get_f();
+    int nbatch = planes->get_nbatch();
+    double *kernel  = preconditionning ? lensKernel : lensKernelTrue;
 
-                    ps[z]->f_hat[y * npix + x][0] = deltaFlex[pos][0];
-                    ps[z]->f_hat[y * npix + x][1] = deltaFlex[pos][1];
-                }
-            }
+    // Shear and flexion residuals are spread on the grid in a single pass
+    #pragma omp parallel for
+    for (long i = 0; i < ngal ; i++) {
+        fftw_complex *fi = f + i * nbatch;
 
-            nfft_trafo_2d(ps[z]);
+        for (int z = 0; z < nlp; z++) {
+            double q = kernel[i * nlp + z];
+            fi[z][0] = res_gamma1[i] * q;
+            fi[z][1] = res_gamma2[i] * q;
         }
 
-        // Apply the lensing efficiency kernel
-        #pragma omp parallel for
-        for (int i = 0; i < ngal ; i++) {
-            res_f1[i] = 0;
-            res_f2[i] = 0;
-            for (int z = 0; z < nlp ; z++) {
+        if (include_flexion) {
+            for (int z = 0; z < nlp; z++) {
                 double q = lensKernel[i * nlp + z];
-                res_f1[i] += q * ps[z]->f[i][0] * fftFactor;
-                res_f2[i] += q * ps[z]->f[i][1] * fftFactor;
+                fi[flex_batch + z][0] = res_f1[i] * q;
+                fi[flex_batch + z][1] = res_f2[i] * q;
             }
         }
     }
 
+    planes->adjoint(0, conv_batch);
 
-    // Compute the value of the field evaluated at each galaxy position
-    combine_components(delta, fft_frame);
+    read_spectra(delta);
+}
+
+void field::fill_spectra(fftwf_complex *delta, bool convergence)
+{
+    double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
+
+    fftwf_complex *deltaFlex = delta + nlp * npix * npix;
+
+    // Fill the spectra of the shear, flexion and convergence for each plane,
+    // so that they can all be transformed in a single pass
     #pragma omp parallel for
     for (int z = 0; z < nlp; z++) {
 
         double k1, k2, k1k1, k2k2, k1k2, ksqr;
         double denom;
+        fftw_complex *f_hat      = planes->get_f_hat(z);
+        fftw_complex *f_hat_flex = planes->get_f_hat(flex_batch + z);
+        fftw_complex *f_hat_conv = planes->get_f_hat(conv_batch + z);
 
-        //Compute reduced shear correction factor
+        // Compute residuals (1 - Ax)y - Bx
         for (int y = 0; y < npix ; y++) {
             k2 = (y - npix / 2) * freqFactor;
             int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
@@ -458,26 +659,37 @@ void field::forward_operator(fftwf_complex *delta)
                 int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
 
                 long pos = ky * npix + kx + z * (npix * npix);
-                ps[z]->f_hat[y * npix + x][0] = fft_frame[pos][0];
-                ps[z]->f_hat[y * npix + x][1] = fft_frame[pos][1];
-            }
-        }
 
-        nfft_trafo_2d(ps[z]);
-    }
+                if (include_flexion) {
+                    f_hat_flex[y * npix + x][0] = deltaFlex[pos][0];
+                    f_hat_flex[y * npix + x][1] = deltaFlex[pos][1];
+                }
 
-    #pragma omp parallel for
-    for (int i = 0; i < ngal ; i++) {
-        res_conv[i] = 0;
-        for (int z = 0; z < nlp ; z++) {
-            double q = lensKernelTrue[i * nlp + z];
-            res_conv[i] += q * ps[z]->f[i][0] * fftFactor;
+                if (convergence) {
+                    f_hat_conv[y * npix + x][0] = fft_frame[pos][0];
+                    f_hat_conv[y * npix + x][1] = fft_frame[pos][1];
+                }
+
+                if (k1 == 0 && k2 == 0) {
+                    f_hat[y * npix + x][0] = 0;
+                    f_hat[y * npix + x][1] = 0;
+                    continue;
+                }
+
+                k1k1 = k1 * k1;
+                k2k2 = k2 * k2;
+                k1k2 = k1 * k2;
+                ksqr = k1k1 + k2k2;
+
+                denom = 1.0 / ksqr;
+                f_hat[y * npix + x][0] = denom * (delta[pos][0] * (k2k2 - k1k1) + delta[pos][1] * (2.0 * k1k2));
+                f_hat[y * npix + x][1] = denom * (delta[pos][1] * (k2k2 - k1k1) - delta[pos][0] * (2.0 * k1k2));
+            }
         }
     }
 }
 
-
-void field::adjoint_operator(fftwf_complex *delta, bool preconditionning)
+void field::read_spectra(fftwf_complex *delta)
 {
     double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
 
@@ -486,23 +698,8 @@ void field::adjoint_operator(fftwf_complex *delta, bool preconditionning)
     #pragma omp parallel for
     for (int z = 0; z < nlp; z++) {
         double k1, k2, k1k1, k2k2, k1k2, ksqr;
-        double denom;
-
-        if(preconditionning){
-            for (long i = 0; i < ngal ; i++) {
-                double q = lensKernel[i * nlp + z];
-                ps[z]->f[i][0] = res_gamma1[i] * q;
-                ps[z]->f[i][1] = res_gamma2[i] * q;
-            }
-        }else{
-            for (long i = 0; i < ngal ; i++) {
-                double q = lensKernelTrue[i * nlp + z];
-                ps[z]->f[i][0] = res_gamma1[i] * q;
-                ps[z]->f[i][1] = res_gamma2[i] * q;
-            }
-        }
-
-        nfft_adjoint_2d(ps[z]);
+        fftw_complex *f_hat      = planes->get_f_hat(z);
+        fftw_complex *f_hat_flex = planes->get_f_hat(flex_batch + z);
 
         for (int y = 0; y < npix ; y++) {
             k2 = (y - npix / 2) * freqFactor;
@@ -513,6 +710,12 @@ void field::adjoint_operator(fftwf_complex *delta, bool preconditionning)
                 int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
 
                 long pos = ky * npix + kx + z * (npix * npix);
+
+                if (include_flexion) {
+                    deltaFlex[pos][0] = f_hat_flex[y * npix + x][0];
+                    deltaFlex[pos][1] = f_hat_flex[y * npix + x][1];
+                }
+
                 if (k1 == 0 && k2 == 0) {
                     continue;
                 }
@@ -522,38 +725,50 @@ void field::adjoint_operator(fftwf_complex *delta, bool preconditionning)
                 k1k2 = k1 * k2;
                 ksqr = k1k1 + k2k2;
 
-                delta[pos][0] = (ps[z]->f_hat[y * npix + x][0] * (k2k2 - k1k1) - ps[z]->f_hat[y * npix + x][1] * (2.0 * k1k2)) / ksqr;
-                delta[pos][1] = (ps[z]->f_hat[y * npix + x][1] * (k2k2 - k1k1) + ps[z]->f_hat[y * npix + x][0] * (2.0 * k1k2)) / ksqr;
+                delta[pos][0] = (f_hat[y * npix + x][0] * (k2k2 - k1k1) - f_hat[y * npix + x][1] * (2.0 * k1k2)) / ksqr;
+                delta[pos][1] = (f_hat[y * npix + x][1] * (k2k2 - k1k1) + f_hat[y * npix + x][0] * (2.0 * k1k2)) / ksqr;
             }
         }
         delta[z * (npix * npix)][0] = 0;
         delta[z * (npix * npix)][1] = 0;
+    }
+}
 
-        if (include_flexion) {
-            for (long i = 0; i < ngal ; i++) {
-                double q = lensKernel[i * nlp + z];
-                ps[z]->f[i][0] = res_f1[i] * q;
-                ps[z]->f[i][1] = res_f2[i] * q;
-            }
+void field::evaluate_convergence(fftwf_complex *delta)
+{
+    fftw_complex *f = planes->get_f();
+    int nbatch = planes->get_nbatch();
 
-            nfft_adjoint_2d(ps[z]);
+    combine_components(delta, fft_frame);
+    #pragma omp parallel for
+    for (int z = 0; z < nlp; z++) {
 
-            for (int y = 0; y < npix ; y++) {
-                k2 = (y - npix / 2) * freqFactor;
-                int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
+        fftw_complex *f_hat = planes->get_f_hat(conv_batch + z);
 
-                for (int x = 0; x < npix ; x++) {
-                    k1 = (x - npix / 2) * freqFactor;
-                    int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
+        //Compute reduced shear correction factor
+        for (int y = 0; y < npix ; y++) {
+            int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
 
-                    long pos = ky * npix + kx + z * (npix * npix);
+            for (int x = 0; x < npix ; x++) {
+                int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
 
-                    deltaFlex[pos][0] = ps[z]->f_hat[y * npix + x][0];
-                    deltaFlex[pos][1] = ps[z]->f_hat[y * npix + x][1];
-                }
+                long pos = ky * npix + kx + z * (npix * npix);
+                f_hat[y * npix + x][0] = fft_frame[pos][0];
+                f_hat[y * npix + x][1] = fft_frame[pos][1];
             }
         }
     }
+
+    planes->trafo(conv_batch, nlp);
+
+    #pragma omp parallel for
+    for (long i = 0; i < ngal ; i++) {
+        res_conv[i] = 0;
+        for (int z = 0; z < nlp ; z++) {
+            double q = lensKernelTrue[i * nlp + z];
+            res_conv[i] += q * f[i * nbatch + conv_batch + z][0] * fftFactor;
+        }
+    }
 }
 
 
@@ -600,40 +815,88 @@ void field::combine_components(fftwf_complex *delta, fftwf_complex *delta_comb)
     }
 }
 
-void field::combine_components_inverse(fftwf_complex *delta_comb, fftwf_complex *delta)
+void field::expand_spectrum(fftwf_complex *kappa, fftwf_complex *delta)
 {
     double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
-    double k1, k2, k1k1, k2k2, k1k2, ksqr;
-    double denom;
 
-    fftwf_complex * deltaFlex = delta + nlp * npix * npix;
+    fftwf_complex *deltaFlex = delta + nlp * npix * npix;
 
+    #pragma omp parallel for
     for (int z = 0; z < nlp; z++) {
+        fftwf_complex *kap = kappa + z * npix * nhalf;
 
-        // Computes the convergence at the position of the galaxy
-        for (int y = 0; y < npix ; y++) {
-            k2 = (y - npix / 2) * freqFactor;
-            int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
+        for (int ky = 0; ky < npix ; ky++) {
+            double k2 = (ky < npix / 2 ? ky : ky - npix) * freqFactor;
 
-            for (int x = 0; x < npix ; x++) {
-                k1 = (x - npix / 2) * freqFactor;
-                int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
+            for (int kx = 0; kx < npix ; kx++) {
+                double k1 = (kx < npix / 2 ? kx : kx - npix) * freqFactor;
                 long pos = ky * npix + kx + z * (npix * npix);
 
-                if (include_flexion) {
-                    deltaFlex[pos][0] = (delta_comb[pos][0] * k2 + delta_comb[pos][1] * k1);
-                    deltaFlex[pos][1] = (-delta_comb[pos][0] * k1 + delta_comb[pos][1] * k2);
-                    delta[pos][0] = delta_comb[pos][0];
-                    delta[pos][1] = delta_comb[pos][1];
+                // The negative frequencies are the conjugates of the stored ones
+                double re, im;
+                if (kx < nhalf) {
+                    re = kap[ky * nhalf + kx][0];
+                    im = kap[ky * nhalf + kx][1];
                 } else {
-                    delta[pos][0] = delta_comb[pos][0];
-                    delta[pos][1] = delta_comb[pos][1];
+                    long sym = ((npix - ky) % npix) * nhalf + (npix - kx);
+                    re =  kap[sym][0];
+                    im = -kap[sym][1];
+                }
+
+                delta[pos][0] = re;
+                delta[pos][1] = im;
+                if (include_flexion) {
+                    deltaFlex[pos][0] = (re * k2 + im * k1);
+                    deltaFlex[pos][1] = (-re * k1 + im * k2);
                 }
             }
         }
     }
 }
 
+void field::reduce_spectrum(fftwf_complex *delta, fftwf_complex *kappa)
+{
+    double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
+
+    fftwf_complex *deltaFlex = delta + nlp * npix * npix;
+
+    #pragma omp parallel for
+    for (int z = 0; z < nlp; z++) {
+        fftwf_complex *kap = kappa + z * npix * nhalf;
+
+        for (int ky = 0; ky < npix ; ky++) {
+            double k2 = (ky < npix / 2 ? ky : ky - npix) * freqFactor;
+
+            for (int kx = 0; kx < nhalf ; kx++) {
+                double k1 = (kx < npix / 2 ? kx : kx - npix) * freqFactor;
+
+                // Combined field at k and -k
+                int  kys = (npix - ky) % npix;
+                int  kxs = (npix - kx) % npix;
+                long pos = ky * npix + kx + z * (npix * npix);
+                long sym = kys * npix + kxs + z * (npix * npix);
+                double c0  = delta[pos][0], c1  = delta[pos][1];
+                double cs0 = delta[sym][0], cs1 = delta[sym][1];
+                if (include_flexion) {
+                    double k1s = (kxs < npix / 2 ? kxs : kxs - npix) * freqFactor;
+                    double k2s = (kys < npix / 2 ? kys : kys - npix) * freqFactor;
+                    double denom  = 1.0 / (k1 * k1 + k2 * k2 + sig_frac);
+                    double denoms = 1.0 / (k1s * k1s + k2s * k2s + sig_frac);
+                    c0  = (deltaFlex[pos][0] * k2  - deltaFlex[pos][1] * k1  + sig_frac * c0)  * denom;
+                    c1  = (deltaFlex[pos][0] * k1  + deltaFlex[pos][1] * k2  + sig_frac * c1)  * denom;
+                    cs0 = (deltaFlex[sym][0] * k2s - deltaFlex[sym][1] * k1s + sig_frac * cs0) * denoms;
+                    cs1 = (deltaFlex[sym][0] * k1s + deltaFlex[sym][1] * k2s + sig_frac * cs1) * denoms;
+                }
+
+                // Hermitian part, the spectrum of the real part of the field
+                kap[ky * nhalf + kx][0] = 0.5 * (c0 + cs0);
+                kap[ky * nhalf + kx][1] = 0.5 * (c1 - cs1);
+            }
+        }
+    }
+    kappa[0][0] = 0;
+    kappa[0][1] = 0;
+}
 
 bool field::check_adjoint()
 {
@@ -655,7 +918,7 @@ bool field::check_adjoint()
         double result_backward  = 0;
         double result_backward2 = 0;
 
-        forward_operator(delta1);
+        forward_operator(delta1, false);
 
         for (long ind = 0; ind < ngal ; ind++) {
             test_g1[ind] = res_gamma1[ind];
@@ -697,7 +960,7 @@ bool field::check_adjoint()
         double result_backward  = 0;
         double result_backward2 = 0;
 
-        forward_operator(delta1);
+        forward_operator(delta1, false);
 
         for (long ind = 0; ind < ngal ; ind++) {
             test_g1[ind] = res_gamma1[ind];
@@ -844,7 +1107,7 @@ void field::compute_3D_lensing_kernel()
     // Compute lensing efficiency kernel for each galaxy by marginalising over pdf
     for (int i = 0; i < ngal; i++) {
         if(i % 100 == 0) std::cout  << "Processed " << i << "/" << ngal << " galaxies\r" << std::flush;
-        redshift_distribution * redshift=surv->get_redshift(i);
+        redshift_distribution * redshift=surv->get_redshift(gal_index[i]);
 
 
 	#pragma omp parallel for
@@ -1043,9 +1306,9 @@ void field::compute_surface_lensing_kernel()
     params.w_l   = w_l;
     params.w_inf = w_inf;
 
-    for (long i = 0; i < surv->get_ngal(); i++) {
+    for (long i = 0; i < ngal; i++) {
 
-        redshift_distribution *redshift = surv->get_redshift(i);
+        redshift_distribution *redshift = surv->get_redshift(gal_index[i]);
 
         // Treat the case of spectroscopic redshifts
         if (spectroscopic_redshift *specz = dynamic_cast<spectroscopic_redshift *>(redshift)) {
@@ -1077,12 +1340,9 @@ double field::get_spectral_norm(int niter, double tol) {
     double norm=0;
     double norm_old=0;
 
-    long ncoeff = npix*npix*nlp;
-    if(include_flexion)
-        ncoeff *= 2;
+    long ncoeff = npix*nhalf*nlp;
 
     fftwf_complex* kap = fftwf_alloc_complex(ncoeff);
-    fftwf_complex* kap_tmp = fftwf_alloc_complex(ncoeff);
 
     norm= 0;
     for(long ind =0; ind< ncoeff; ind++) {
@@ -1101,8 +1361,8 @@ double field::get_spectral_norm(int niter, double tol) {
     for(int k=0; k < niter; k++) {
 
         // Apply operator A^t A
-        combine_components(kap, kap_tmp);
-        forward_operator(kap_tmp);
+        expand_spectrum(kap, delta_full);
+        forward_operator(delta_full, false);
 
         // Compute residuals, note that we only differentiate for the second term here
         for(int i=0; i < ngal ; i++) {
@@ -1115,8 +1375,8 @@ double field::get_spectral_norm(int niter, double tol) {
         }
 
         // Apply adjoint operator on normalized results
-        adjoint_operator(kap_tmp);
-        combine_components_inverse(kap_tmp,kap);
+        adjoint_operator(delta_full);
+        reduce_spectrum(delta_full, kap);
 
 
         // Compute norm
@@ -1140,53 +1400,651 @@ double field::get_spectral_norm(int niter, double tol) {
         if(k == niter -1 ) std::cout << "Warning, reached maximum number of iterations" << std::endl;
     }
 
-    fftw_free(kap);
-    fftw_free(kap_tmp);
+    fftwf_free(kap);
 
     return norm*(1.0+tol);
 
 }
 
-void field::update_covariance(fftwf_complex* delta)
+void field::update_covariance(fftwf_complex* kappa)
 {
-    double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
     // Compute the value of the field evaluated at each galaxy position
-    combine_components(delta, fft_frame);
+    expand_spectrum(kappa, delta_full);
+    evaluate_convergence(delta_full);
+
+    for(int i=0; i < ngal ; i++) {
+        double factor = std::max(1.0 -  res_conv[i],0.3);
+        cov[i] = 1.0/(factor*factor);
+    }
+
+    if (toeplitz) {
+        compute_toeplitz_kernels();
+    }
+    convergence_updated(kappa);
+}
+
+bool field::reduced_shear_due(fftwf_complex *kappa)
+{
+    if (! conv_valid) {
+        return true;
+    }
+
+    if (conv_frozen) {
+        return false;
+    }
+
+    if (conv_age + 1 >= conv_every) {
+        return true;
+    }
+
+    // Relative change of the convergence map since the last evaluation
+    if (conv_tol > 0) {
+        double diff = 0;
+        double norm = 0;
+        #pragma omp parallel for reduction(+:diff, norm)
+        for (long ind = 0; ind < npix * nhalf * nlp; ind++) {
+            double d0 = kappa[ind][0] - conv_ref[ind][0];
+            double d1 = kappa[ind][1] - conv_ref[ind][1];
+            diff += d0 * d0 + d1 * d1;
+            norm += conv_ref[ind][0] * conv_ref[ind][0] + conv_ref[ind][1] * conv_ref[ind][1];
+        }
+        if (diff > conv_tol * conv_tol * norm) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void field::convergence_updated(fftwf_complex *kappa)
+{
+    if (conv_ref) {
+        std::memcpy(conv_ref, kappa, sizeof(fftwf_complex) * npix * nhalf * nlp);
+    }
+    conv_valid = true;
+    conv_age   = 0;
+    n_conv_eval++;
+
+    if (bins) {
+        bin_measurements();
+    }
+    if (toeplitz) {
+        compute_toeplitz_data();
+    }
+}
+
+double field::get_fft_time()
+{
+    return planes->get_fft_time() + toep_fft_time;
+}
+
+void field::print_reduced_shear_stats()
+{
+    std::cout << "Reduced shear correction : " << n_conv_eval << " evaluations, "
+              << n_conv_skip << " skipped" << std::endl;
+}
+
+void field::sort_galaxies(const double *pos)
+{
+    // Morton key interleaving the bits of the positions quantized on 16 bits
+    std::vector< std::pair<unsigned long long, long> > keys(ngal);
+
     #pragma omp parallel for
-    for (int z = 0; z < nlp; z++) {
+    for (long i = 0; i < ngal; i++) {
+        unsigned long long key = 0;
+        for (int t = 0; t < 2; t++) {
+            long q = (long) floor((pos[2 * i + t] + 0.5) * 65536.0);
+            q = std::min(std::max(q, 0L), 65535L);
+            for (int bit = 0; bit < 16; bit++) {
+                key |= ((unsigned long long) ((q >> bit) & 1)) << (2 * bit + t);
+            }
+        }
+        keys[i] = std::make_pair(key, i);
+    }
 
-        double k1, k2, k1k1, k2k2, k1k2, ksqr;
-        double denom;
+    std::sort(keys.begin(), keys.end());
 
-        //Compute reduced shear correction factor
-        for (int y = 0; y < npix ; y++) {
-            k2 = (y - npix / 2) * freqFactor;
-            int ky  = (y < npix / 2 ? y + npix / 2 : y - npix / 2);
+    for (long i = 0; i < ngal; i++) {
+        gal_index[i] = keys[i].second;
+    }
+}
 
-            for (int x = 0; x < npix ; x++) {
-                k1 = (x - npix / 2) * freqFactor;
-                int kx  = (x < npix / 2 ? x + npix / 2 : x - npix / 2);
+void field::init_bins()
+{
+    long npixels = bins->get_npixels();
 
-                long pos = ky * npix + kx + z * (npix * npix);
-                ps[z]->f_hat[y * npix + x][0] = fft_frame[pos][0];
-                ps[z]->f_hat[y * npix + x][1] = fft_frame[pos][1];
+    // Index of the occupied pixels
+    bin_index = (long *) malloc(sizeof(long) * npixels);
+    for (long p = 0; p < npixels; p++) {
+        bin_index[p] = -1;
+    }
+    nbins = 0;
+    for (long i = 0; i < ngal; i++) {
+        long p = bins->get_pixel(i);
+        if (bin_index[p] < 0) {
+            bin_index[p] = nbins++;
+        }
+    }
+
+    // Galaxies sorted by pixel
+    bin_pixel = (long *) malloc(sizeof(long) * nbins);
+    bin_start = (long *) malloc(sizeof(long) * (nbins + 1));
+    bin_gal   = (long *) malloc(sizeof(long) * ngal);
+    for (long s = 0; s <= nbins; s++) {
+        bin_start[s] = 0;
+    }
+    for (long i = 0; i < ngal; i++) {
+        long s = bin_index[bins->get_pixel(i)];
+        bin_pixel[s] = bins->get_pixel(i);
+        bin_start[s + 1]++;
+    }
+    for (long s = 0; s < nbins; s++) {
+        bin_start[s + 1] += bin_start[s];
+    }
+    long *fill = (long *) malloc(sizeof(long) * nbins);
+    for (long s = 0; s < nbins; s++) {
+        fill[s] = bin_start[s];
+    }
+    for (long i = 0; i < ngal; i++) {
+        long s = bin_index[bins->get_pixel(i)];
+        bin_gal[fill[s]++] = i;
+    }
+    free(fill);
+
+    // Symmetric nlp x nlp weight matrices for the shear and the flexion
+    int nw = include_flexion ? 2 * npairs : npairs;
+    bin_w  = (double *) malloc(sizeof(double) * nbins * nw);
+    bin_y  = fftw_alloc_complex(nbins * conv_batch);
+}
+
+void field::bin_measurements()
+{
+    int nw = include_flexion ? 2 * npairs : npairs;
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (long s = 0; s < nbins; s++) {
+        double *w_s = bin_w + s * nw;
+        fftw_complex *y_s = bin_y + s * conv_batch;
+
+        for (int k = 0; k < nw; k++) {
+            w_s[k] = 0;
+        }
+        for (int b = 0; b < conv_batch; b++) {
+            y_s[b][0] = 0;
+            y_s[b][1] = 0;
+        }
+
+        for (long n = bin_start[s]; n < bin_start[s + 1]; n++) {
+            long i = bin_gal[n];
+            double factor = std::max(1. - res_conv[i], 0.);
+            double *q = lensKernel + i * nlp;
+
+            double c = cov[i] * w_e[i];
+            for (int z = 0, k = 0; z < nlp; z++) {
+                y_s[z][0] += c * q[z] * factor * shear_gamma1[i];
+                y_s[z][1] += c * q[z] * factor * shear_gamma2[i];
+                for (int z2 = z; z2 < nlp; z2++, k++) {
+                    w_s[k] += c * q[z] * q[z2];
+                }
+            }
+
+            if (include_flexion) {
+                c = cov[i] * w_f[i];
+                for (int z = 0, k = npairs; z < nlp; z++) {
+                    y_s[flex_batch + z][0] += c * q[z] * factor * flexion_f1[i];
+                    y_s[flex_batch + z][1] += c * q[z] * factor * flexion_f2[i];
+                    for (int z2 = z; z2 < nlp; z2++, k++) {
+                        w_s[k] += c * q[z] * q[z2];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void field::binned_gradient(fftwf_complex *delta)
+{
+    long npixels = bins->get_npixels();
+    int nbatch = bins->get_nbatch();
+    int nw = include_flexion ? 2 * npairs : npairs;
+    fftw_complex *g = bins->get_grid();
+
+    fill_spectra(delta, false);
+    bins->synthesis(0, conv_batch);
+
+    // Residuals of the binned measurements, computed in place on the grid
+    #pragma omp parallel
+    {
+        fftw_complex *r = fftw_alloc_complex(conv_batch);
+
+        #pragma omp for
+        for (long p = 0; p < npixels; p++) {
+            fftw_complex *gp = g + p * nbatch;
+            long s = bin_index[p];
+
+            if (s < 0) {
+                for (int b = 0; b < conv_batch; b++) {
+                    gp[b][0] = 0;
+                    gp[b][1] = 0;
+                }
+                continue;
+            }
+
+            double *w_s = bin_w + s * nw;
+            fftw_complex *y_s = bin_y + s * conv_batch;
+            for (int b = 0; b < conv_batch; b++) {
+                r[b][0] = y_s[b][0];
+                r[b][1] = y_s[b][1];
+            }
+
+            for (int z = 0, k = 0; z < nlp; z++) {
+                for (int z2 = z; z2 < nlp; z2++, k++) {
+                    double w = w_s[k] * fftFactor;
+                    r[z][0] -= w * gp[z2][0];
+                    r[z][1] -= w * gp[z2][1];
+                    if (z2 != z) {
+                        r[z2][0] -= w * gp[z][0];
+                        r[z2][1] -= w * gp[z][1];
+                    }
+                }
+            }
+
+            if (include_flexion) {
+                fftw_complex *gf = gp + flex_batch;
+                fftw_complex *rf = r + flex_batch;
+                for (int z = 0, k = npairs; z < nlp; z++) {
+                    for (int z2 = z; z2 < nlp; z2++, k++) {
+                        double w = w_s[k] * fftFactor;
+                        rf[z][0] -= w * gf[z2][0];
+                        rf[z][1] -= w * gf[z2][1];
+                        if (z2 != z) {
+                            rf[z2][0] -= w * gf[z][0];
+                            rf[z2][1] -= w * gf[z][1];
+                        }
+                    }
+                }
+            }
+
+            for (int b = 0; b < conv_batch; b++) {
+                gp[b][0] = r[b][0];
+                gp[b][1] = r[b][1];
+            }
+        }
+
+        fftw_free(r);
+    }
+
+    bins->analysis(0, conv_batch);
+    read_spectra(delta);
+}
+
+bool field::check_backend()
+{
+    double freqFactor = 2.0 * M_PI / pixel_size / ((double) npix);
+    long ncoeff = include_flexion ? 2 * npix * npix * nlp : npix * npix * nlp;
+
+    fftwf_complex *delta = fftwf_alloc_complex(ncoeff);
+    fftwf_complex *delta_adj = fftwf_alloc_complex(ncoeff);
+    fftwf_complex *delta_ref = fftwf_alloc_complex(ncoeff);
+    double *ref = (double *) malloc(sizeof(double) * ngal * 5);
+    double *conv_save = (double *) malloc(sizeof(double) * ngal);
+    std::memcpy(conv_save, res_conv, sizeof(double) * ngal);
+
+    // Random field smoothed on a few pixels, the binning error is otherwise
+    // dominated by the smallest scales
+    double kc = 0.1 * npix * freqFactor;
+    for (long ind = 0; ind < ncoeff; ind++) {
+        long pos = ind % (npix * npix);
+        int x = pos % npix;
+        int y = pos / npix;
+        double k1 = (x < npix / 2 ? x : x - npix) * freqFactor;
+        double k2 = (y < npix / 2 ? y : y - npix) * freqFactor;
+        double filter = exp(-0.5 * (k1 * k1 + k2 * k2) / (kc * kc));
+        delta[ind][0] = gsl_ran_gaussian(rng, 1.0) * filter;
+        delta[ind][1] = gsl_ran_gaussian(rng, 1.0) * filter;
+    }
+
+    forward_operator(delta, true);
+    for (long i = 0; i < ngal; i++) {
+        ref[i * 5]     = res_gamma1[i];
+        ref[i * 5 + 1] = res_gamma2[i];
+        ref[i * 5 + 2] = res_conv[i];
+        ref[i * 5 + 3] = include_flexion ? res_f1[i] : 0;
+        ref[i * 5 + 4] = include_flexion ? res_f2[i] : 0;
+    }
+
+    // Same operator with the reference backend, the double precision nfft
+    // for the binned and single precision backends, the binned one otherwise
+    batched_transform *current = planes;
+    const char *name = binned ? "binned" : (single_nfft ? "single precision nfft" : "nfft");
+    const char *name_ref = (binned || single_nfft) ? "nfft" : "binned";
+    bool own_psi = (binned || single_nfft) && ! (ps->flags & PRE_PSI);
+    if (own_psi) {
+        precompute_psi(ps);
+    }
+    if (binned || single_nfft) {
+        planes = new batched_nfft(ps, current->get_nbatch());
+    } else {
+        planes = new binned_transform(ps, current->get_nbatch());
+    }
+    forward_operator(delta, true);
+
+    // Adjoint of both backends applied to the same residuals
+    adjoint_operator(delta_ref);
+    delete planes;
+    planes = current;
+    adjoint_operator(delta_adj);
+    if (own_psi) {
+        release_psi(ps);
+    }
+
+    double diff_g = 0, norm_g = 0, diff_k = 0, norm_k = 0, diff_f = 0, norm_f = 0;
+    for (long i = 0; i < ngal; i++) {
+        diff_g += pow(ref[i * 5] - res_gamma1[i], 2) + pow(ref[i * 5 + 1] - res_gamma2[i], 2);
+        norm_g += pow(res_gamma1[i], 2) + pow(res_gamma2[i], 2);
+        diff_k += pow(ref[i * 5 + 2] - res_conv[i], 2);
+        norm_k += pow(res_conv[i], 2);
+        if (include_flexion) {
+            diff_f += pow(ref[i * 5 + 3] - res_f1[i], 2) + pow(ref[i * 5 + 4] - res_f2[i], 2);
+            norm_f += pow(res_f1[i], 2) + pow(res_f2[i], 2);
+        }
+    }
+    double diff_a = 0, norm_a = 0;
+    for (long ind = 0; ind < ncoeff; ind++) {
+        diff_a += pow(delta_adj[ind][0] - delta_ref[ind][0], 2) + pow(delta_adj[ind][1] - delta_ref[ind][1], 2);
+        norm_a += pow(delta_ref[ind][0], 2) + pow(delta_ref[ind][1], 2);
+    }
+    std::cout << " Relative difference between " << name << " and " << name_ref << " backends, shear: " << sqrt(diff_g / norm_g)
+              << " convergence: " << sqrt(diff_k / norm_k);
+    if (include_flexion) {
+        std::cout << " flexion: " << sqrt(diff_f / norm_f);
+    }
+    std::cout << " adjoint: " << sqrt(diff_a / norm_a) << std::endl;
+
+    // The binned backend differs from the nfft by the displacement of the
+    // galaxies to the pixel centres and is only reported. The single
+    // precision nfft only differs by its rounding errors, the products of
+    // the window tables and the FFTs stay orders of magnitude below tol.
+    const double tol = 1e-4;
+    bool ok = true;
+    if (single_nfft) {
+        ok = sqrt(diff_g / norm_g) < tol && sqrt(diff_k / norm_k) < tol && sqrt(diff_a / norm_a) < tol;
+        if (include_flexion) {
+            ok = ok && sqrt(diff_f / norm_f) < tol;
+        }
+    }
+
+    // Restore the reduced shear correction the binned measurements were computed with
+    std::memcpy(res_conv, conv_save, sizeof(double) * ngal);
+
+    // The gradient computed from the precomputed sums should match the one
+    // accumulated galaxy by galaxy
+    if (binned || toeplitz) {
+        fftwf_complex *delta2 = fftwf_alloc_complex(ncoeff);
+        std::memcpy(delta2, delta, sizeof(fftwf_complex) * ncoeff);
+
+        if (binned) {
+            binned_gradient(delta);
+        } else {
+            toeplitz_gradient(delta);
+        }
+
+        forward_operator(delta2, false);
+        for (long i = 0; i < ngal ; i++) {
+            double factor = std::max(1. - res_conv[i], 0.);
+            res_gamma1[i] = cov[i] * w_e[i] * (factor * shear_gamma1[i] - res_gamma1[i]);
+            res_gamma2[i] = cov[i] * w_e[i] * (factor * shear_gamma2[i] - res_gamma2[i]);
+            if (include_flexion) {
+                res_f1[i] = cov[i] * w_f[i] * (factor * flexion_f1[i] - res_f1[i]);
+                res_f2[i] = cov[i] * w_f[i] * (factor * flexion_f2[i] - res_f2[i]);
+            }
+        }
+        adjoint_operator(delta2);
+
+        double diff = 0, norm = 0;
+        for (long ind = 0; ind < ncoeff; ind++) {
+            diff += pow(delta[ind][0] - delta2[ind][0], 2) + pow(delta[ind][1] - delta2[ind][1], 2);
+            norm += pow(delta2[ind][0], 2) + pow(delta2[ind][1], 2);
+        }
+        std::cout << " Relative difference of the " << (binned ? "binned" : "Toeplitz") << " gradient: " << sqrt(diff / norm) << std::endl;
+        ok = ok && sqrt(diff / norm) < tol;
+
+        fftwf_free(delta2);
+    }
+
+    fftwf_free(delta);
+    fftwf_free(delta_adj);
+    fftwf_free(delta_ref);
+    free(ref);
+    free(conv_save);
+
+    return ok;
+}
+
+void field::init_toeplitz()
+{
+    int  L  = 2 * npix;
+    long L2 = ((long) L) * L;
+    int  nk = include_flexion ? 2 * npairs : npairs;
+
+    // Nfft plan of twice the size at the same nodes, covering all the
+    // frequency differences between two coefficients of the field
+    ps2 = new nfft_plan();
+    init_node_plan(ps2, L, ngal);
+    for (long ind = 0; ind < 2 * ngal; ind++) {
+        ps2->x[ind] = ps->x[ind];
+    }
+    precompute_psi(ps2);
+
+    toep_kernel = fftw_alloc_complex(L2 * nk);
+    toep_grid   = fftw_alloc_complex(L2 * conv_batch);
+    toep_data   = fftw_alloc_complex(((long) npix) * npix * conv_batch);
+
+    // The padded grids are transformed in parallel over the batches, or one
+    // at a time by all the threads when there are fewer batches than threads
+    setPlannerThreads(1);
+    toep_forward  = fftw_plan_dft_2d(L, L, toep_grid, toep_grid, FFTW_FORWARD,  getPlannerFlags());
+    toep_backward = fftw_plan_dft_2d(L, L, toep_grid, toep_grid, FFTW_BACKWARD, getPlannerFlags());
+    setPlannerThreads(getFFTWThreads());
+    toep_forward_mt  = NULL;
+    toep_backward_mt = NULL;
+    if (getFFTWThreads() > 1) {
+        toep_forward_mt  = fftw_plan_dft_2d(L, L, toep_grid, toep_grid, FFTW_FORWARD,  getPlannerFlags());
+        toep_backward_mt = fftw_plan_dft_2d(L, L, toep_grid, toep_grid, FFTW_BACKWARD, getPlannerFlags());
+    }
+}
+
+void field::execute_toeplitz(fftw_plan p, fftw_plan p_mt, fftw_complex *grids, int count)
+{
+    long L2 = 4l * npix * npix;
+
+    double t0 = omp_get_wtime();
+    if (useThreadedPlans(count)) {
+        for (int b = 0; b < count; b++) {
+            fftw_execute_dft(p_mt, grids + b * L2, grids + b * L2);
+        }
+    } else {
+        #pragma omp parallel for
+        for (int b = 0; b < count; b++) {
+            fftw_execute_dft(p, grids + b * L2, grids + b * L2);
+        }
+    }
+    toep_fft_time += omp_get_wtime() - t0;
+}
+
+void field::compute_toeplitz_kernels()
+{
+    int  L  = 2 * npix;
+    long L2 = ((long) L) * L;
+    int  nk = include_flexion ? 2 * npairs : npairs;
+
+    // Planes of each entry of the symmetric kernel matrices
+    std::vector<int> pz1(npairs), pz2(npairs);
+    for (int z = 0, k = 0; z < nlp; z++) {
+        for (int z2 = z; z2 < nlp; z2++, k++) {
+            pz1[k] = z;
+            pz2[k] = z2;
+        }
+    }
+
+    // The kernels are computed nlp at a time to bound the size of the oversampled grids
+    int chunk = std::min(nk, nlp);
+    batched_nfft *kern = new batched_nfft(ps2, chunk);
+    fftw_complex *f = kern->get_f();
+
+    for (int first = 0; first < nk; first += chunk) {
+        int count = std::min(chunk, nk - first);
+
+        #pragma omp parallel for
+        for (long i = 0; i < ngal; i++) {
+            double *q = lensKernel + i * nlp;
+            for (int c = 0; c < count; c++) {
+                int k = first + c;
+                double w = k < npairs ? cov[i] * w_e[i] : cov[i] * w_f[i];
+                k = k % npairs;
+                f[i * chunk + c][0] = w * q[pz1[k]] * q[pz2[k]];
+                f[i * chunk + c][1] = 0;
             }
         }
 
-        nfft_trafo_2d(ps[z]);
+        kern->adjoint(0, count);
+
+        // Frequency m of the kernel is stored at m modulo L
+        #pragma omp parallel for
+        for (int a0 = 0; a0 < L; a0++) {
+            int i0 = a0 < npix ? a0 + npix : a0 - npix;
+            for (int a1 = 0; a1 < L; a1++) {
+                int i1 = a1 < npix ? a1 + npix : a1 - npix;
+                for (int c = 0; c < count; c++) {
+                    fftw_complex *t_hat = kern->get_f_hat(c);
+                    toep_kernel[(first + c) * L2 + ((long) i0) * L + i1][0] = t_hat[((long) a0) * L + a1][0];
+                    toep_kernel[(first + c) * L2 + ((long) i0) * L + i1][1] = t_hat[((long) a0) * L + a1][1];
+                }
+            }
+        }
     }
+    toep_fft_time += kern->get_fft_time();
+    delete kern;
+
+    execute_toeplitz(toep_forward, toep_forward_mt, toep_kernel, nk);
+}
+
+void field::compute_toeplitz_data()
+{
+    fftw_complex *f = planes->get_f();
+    int nbatch = planes->get_nbatch();
 
     #pragma omp parallel for
-    for (int i = 0; i < ngal ; i++) {
-        res_conv[i] = 0;
-        for (int z = 0; z < nlp ; z++) {
-            double q = lensKernelTrue[i * nlp + z];
-            res_conv[i] += q * ps[z]->f[i][0] * fftFactor;
+    for (long i = 0; i < ngal ; i++) {
+        fftw_complex *fi = f + i * nbatch;
+        double factor = std::max(1. - res_conv[i], 0.);
+
+        for (int z = 0; z < nlp; z++) {
+            double q = cov[i] * w_e[i] * factor * lensKernel[i * nlp + z];
+            fi[z][0] = shear_gamma1[i] * q;
+            fi[z][1] = shear_gamma2[i] * q;
+        }
+
+        if (include_flexion) {
+            for (int z = 0; z < nlp; z++) {
+                double q = cov[i] * w_f[i] * factor * lensKernel[i * nlp + z];
+                fi[flex_batch + z][0] = flexion_f1[i] * q;
+                fi[flex_batch + z][1] = flexion_f2[i] * q;
+            }
         }
     }
 
-    for(int i=0; i < ngal ; i++) {
-        double factor = std::max(1.0 -  res_conv[i],0.3);
-        cov[i] = 1.0/(factor*factor);
+    planes->adjoint(0, conv_batch);
+
+    for (int b = 0; b < conv_batch; b++) {
+        std::memcpy(toep_data + ((long) b) * npix * npix, planes->get_f_hat(b), sizeof(fftw_complex) * npix * npix);
+    }
+}
+
+void field::toeplitz_gradient(fftwf_complex *delta)
+{
+    int  L  = 2 * npix;
+    long L2 = ((long) L) * L;
+
+    fill_spectra(delta, false);
+
+    // Zero padding of the spectra on the L x L grid, parallel over the rows
+    // as there may be fewer batches than threads
+    for (int b = 0; b < conv_batch; b++) {
+        fftw_complex *u = planes->get_f_hat(b);
+        fftw_complex *grid = toep_grid + b * L2;
+
+        #pragma omp parallel for
+        for (long ind = 0; ind < L2; ind++) {
+            grid[ind][0] = 0;
+            grid[ind][1] = 0;
+        }
+        #pragma omp parallel for
+        for (int y = 0; y < npix; y++) {
+            int i0 = y < npix / 2 ? y - npix / 2 + L : y - npix / 2;
+            for (int x = 0; x < npix; x++) {
+                int i1 = x < npix / 2 ? x - npix / 2 + L : x - npix / 2;
+                grid[((long) i0) * L + i1][0] = u[y * npix + x][0];
+                grid[((long) i0) * L + i1][1] = u[y * npix + x][1];
+            }
+        }
+    }
+    execute_toeplitz(toep_forward, toep_forward_mt, toep_grid, conv_batch);
+
+    // Convolution with the kernel matrices, shear and flexion are independent
+    #pragma omp parallel
+    {
+        fftw_complex *u = fftw_alloc_complex(conv_batch);
+
+        #pragma omp for
+        for (long ind = 0; ind < L2; ind++) {
+            for (int b = 0; b < conv_batch; b++) {
+                u[b][0] = toep_grid[b * L2 + ind][0];
+                u[b][1] = toep_grid[b * L2 + ind][1];
+                toep_grid[b * L2 + ind][0] = 0;
+                toep_grid[b * L2 + ind][1] = 0;
+            }
+
+            for (int c = 0; c < (include_flexion ? 2 : 1); c++) {
+                int offset = c * nlp;
+                for (int z = 0, k = c * npairs; z < nlp; z++) {
+                    for (int z2 = z; z2 < nlp; z2++, k++) {
+                        double t0 = toep_kernel[k * L2 + ind][0];
+                        double t1 = toep_kernel[k * L2 + ind][1];
+                        fftw_complex *v = toep_grid + (offset + z) * L2 + ind;
+                        v[0][0] += t0 * u[offset + z2][0] - t1 * u[offset + z2][1];
+                        v[0][1] += t0 * u[offset + z2][1] + t1 * u[offset + z2][0];
+                        if (z2 != z) {
+                            v = toep_grid + (offset + z2) * L2 + ind;
+                            v[0][0] += t0 * u[offset + z][0] - t1 * u[offset + z][1];
+                            v[0][1] += t0 * u[offset + z][1] + t1 * u[offset + z][0];
+                        }
+                    }
+                }
+            }
+        }
+
+        fftw_free(u);
     }
+
+    // Back to the field coefficients, subtracting from the data term
+    double factor = fftFactor / ((double) L2);
+    execute_toeplitz(toep_backward, toep_backward_mt, toep_grid, conv_batch);
+    for (int b = 0; b < conv_batch; b++) {
+        fftw_complex *v = planes->get_f_hat(b);
+        fftw_complex *data = toep_data + ((long) b) * npix * npix;
+        fftw_complex *grid = toep_grid + b * L2;
+
+        #pragma omp parallel for
+        for (int y = 0; y < npix; y++) {
+            int i0 = y < npix / 2 ? y - npix / 2 + L : y - npix / 2;
+            for (int x = 0; x < npix; x++) {
+                int i1 = x < npix / 2 ? x - npix / 2 + L : x - npix / 2;
+                v[y * npix + x][0] = data[y * npix + x][0] - factor * grid[((long) i0) * L + i1][0];
+                v[y * npix + x][1] = data[y * npix + x][1] - factor * grid[((long) i0) * L + i1][1];
+            }
+        }
+    }
+
+    read_spectra(delta);
 }
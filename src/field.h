@@ -41,6 +41,8 @@
 #include <nicaea/cosmo.h>
 
 #include "survey.h"
+#include "batched_nfft.h"
+#include "binned_transform.h"
 
 
 // Reference redshift used to compute the 2D convergence maps
@@ -70,11 +72,18 @@ class field
   // FFTs
   int NpixFFT;
   double fftFactor;
-  nfft_plan** ps;
+  nfft_plan* ps;                        /*!< Nfft plan holding the galaxy positions and window function tables */
+  batched_transform* planes;            /*!< Batched transform over all lens planes and fields, sharing the nodes of ps */
+  binned_transform* bins;               /*!< Same as planes when using the binned backend, NULL otherwise */
+  int flex_batch;                       /*!< Index of the first flexion plane in the batched nfft */
+  int conv_batch;                       /*!< Index of the first convergence plane in the batched nfft */
   fftwf_complex* fft_frame;
+  int nhalf;                            /*!< Number of stored frequencies along x for the half spectra, npix / 2 + 1 */
+  fftwf_complex* delta_full;            /*!< Full spectra of the shear and flexion components */
   
   // Survey data
   long     ngal;                /*!< Number of galaxies */
+  long   * gal_index;           /*!< Index in the survey of each galaxy, the galaxies being stored along a space filling curve */
   double * shear_gamma1;        /*!< 1D Array for storing the shear for each galaxy in the survey.*/
   double * shear_gamma2;        /*!< 1D Array for storing the shear for each galaxy in the survey.*/
   double * flexion_f1;          /*!< 1D Array for storing the first flexion for each galaxy in the survey.*/
@@ -94,6 +103,39 @@ class field
   double * lensKernel;          /*!< Array storing the conditionned lensing efficiency kernel for each galaxy.*/  
   double * lensKernelTrue;      /*!< Array storing the original lensing efficiency kernel for each galaxy.*/  
 
+  // Reduced shear correction schedule
+  int      conv_every;          /*!< Maximum number of gradient evaluations between two updates of res_conv */
+  double   conv_tol;            /*!< Relative change of the convergence map triggering an update, disabled if 0 */
+  bool     conv_freeze_debias;  /*!< Flag indicating whether res_conv is kept fixed during debiasing */
+  bool     conv_frozen;         /*!< Flag indicating whether res_conv is currently kept fixed */
+  bool     conv_valid;          /*!< Flag indicating whether res_conv has been evaluated at least once */
+  int      conv_age;            /*!< Number of gradient evaluations since the last update of res_conv */
+  long     n_conv_eval;         /*!< Number of evaluations of the convergence at the galaxy positions */
+  long     n_conv_skip;         /*!< Number of skipped evaluations of the convergence */
+  fftwf_complex* conv_ref;      /*!< Combined field at the last evaluation of res_conv, used for the adaptive schedule */
+
+  // Binned backend
+  bool     binned;              /*!< Flag indicating whether the galaxies are binned on the pixel grid instead of using the nfft */
+  bool     single_nfft;         /*!< Flag indicating whether the nfft grids are computed in single precision */
+  long     nbins;               /*!< Number of pixels containing at least one galaxy */
+  int      npairs;              /*!< Number of independent entries of a symmetric nlp x nlp matrix */
+  long   * bin_index;           /*!< Index of the bin of each pixel, -1 for empty pixels */
+  long   * bin_pixel;           /*!< Pixel of each bin */
+  long   * bin_start;           /*!< Offset of the first galaxy of each bin in bin_gal */
+  long   * bin_gal;             /*!< Galaxies sorted by bin */
+  double * bin_w;               /*!< Weighted lensing kernel products summed in each bin, for shear then flexion */
+  fftw_complex * bin_y;         /*!< Weighted measurements summed in each bin, for each lens plane */
+
+  // Toeplitz normal operator
+  bool     toeplitz;            /*!< Flag indicating whether the normal operator is precomputed as a convolution */
+  nfft_plan* ps2;               /*!< Nfft plan of size 2 npix at the galaxy positions, used to compute the kernels */
+  fftw_complex * toep_kernel;   /*!< Fourier transform of the 2 npix x 2 npix kernels, for each pair of planes, shear then flexion */
+  fftw_complex * toep_grid;     /*!< Padded grids of the shear and flexion batches */
+  fftw_complex * toep_data;     /*!< Adjoint applied to the weighted measurements, for the shear and flexion batches */
+  fftw_plan toep_forward, toep_backward;        /*!< Plans of a single padded grid running on one thread */
+  fftw_plan toep_forward_mt, toep_backward_mt;  /*!< Plans of a single padded grid using all the FFTW threads, NULL with a single thread */
+  double   toep_fft_time;       /*!< Time spent in the FFTs of the padded grids and kernels, in seconds */
+
   // 3D specific variables
   double r_cond;                /*!< Condition number used for the pre-conditioning matrix. */
   double * P;                   /*!< Preconditionning matrix */
@@ -118,14 +160,99 @@ class field
   void compute_3D_lensing_kernel();
 
   /*! Computes the forward lensing transform from density to shear.
-   * 
+   * The convergence at the galaxy positions is only evaluated if \a convergence is set.
    */
-  void forward_operator(fftwf_complex *delta);
+  void forward_operator(fftwf_complex *delta, bool convergence=true);
   
   /*! Compute the adjoint operation.
    * 
    */
   void adjoint_operator(fftwf_complex *delta, bool preconditionning=true);
+
+  /*! Evaluates the convergence at the position of each galaxy, stored in res_conv.
+   * 
+   */
+  void evaluate_convergence(fftwf_complex *delta);
+
+  /*! Fills the spectra of the shear, flexion and, if requested, convergence batches from delta.
+   * 
+   */
+  void fill_spectra(fftwf_complex *delta, bool convergence);
+
+  /*! Reads back delta from the spectra of the shear and flexion batches, applying the inverse Kaiser-Squires kernel.
+   * 
+   */
+  void read_spectra(fftwf_complex *delta);
+
+  /*! Computes gal_index, ordering the galaxies along a Morton curve from their positions in the nfft domain.
+   * 
+   */
+  void sort_galaxies(const double *pos);
+
+  /*! Sorts the galaxies by pixel for the binned backend.
+   * 
+   */
+  void init_bins();
+
+  /*! Sums the weighted measurements and lensing kernels of the galaxies in each pixel.
+   * 
+   */
+  void bin_measurements();
+
+  /*! Computes the gradient of the chi_2 from the binned measurements, independently of the number of galaxies.
+   * 
+   */
+  void binned_gradient(fftwf_complex *delta);
+
+  /*! Allocates the kernels and plans of the Toeplitz normal operator.
+   * 
+   */
+  void init_toeplitz();
+
+  /*! Computes the kernels of the normal operator, to be updated whenever the covariance changes.
+   * 
+   */
+  void compute_toeplitz_kernels();
+
+  /*! Applies the adjoint to the weighted measurements, to be updated whenever the reduced shear correction changes.
+   * 
+   */
+  void compute_toeplitz_data();
+
+  /*! Computes the gradient of the chi_2 from the precomputed normal operator, without any nfft.
+   * 
+   */
+  void toeplitz_gradient(fftwf_complex *delta);
+
+  /*! Transforms count consecutive padded grids in place, concurrently with the plan p or
+   * one after the other with the threaded plan p_mt when there are fewer grids than threads.
+   */
+  void execute_toeplitz(fftw_plan p, fftw_plan p_mt, fftw_complex *grids, int count);
+
+  /*! Decides whether the reduced shear correction needs to be updated for this gradient evaluation.
+   * 
+   */
+  bool reduced_shear_due(fftwf_complex *kappa);
+
+  /*! Records an evaluation of the reduced shear correction for the field kappa.
+   * 
+   */
+  void convergence_updated(fftwf_complex *kappa);
+
+  /*! Combines shear and flexion components applying a minimum variance filter
+   * 
+   */
+  void combine_components(fftwf_complex * delta, fftwf_complex * delta_comb);
+
+  /*! Computes the full spectra of the shear and flexion components from the half spectrum of a real field.
+   * 
+   */
+  void expand_spectrum(fftwf_complex *kappa, fftwf_complex *delta);
+
+  /*! Combines the shear and flexion components and keeps the half spectrum of the real part of the result.
+   * 
+   */
+  void reduce_spectrum(fftwf_complex *delta, fftwf_complex *kappa);
   
 public:
   /*! Constructor from configuration file and survey
@@ -156,20 +283,38 @@ public:
    */
    void get_pixel_coordinates(double * ra, double *dec);
   
-  /*! Computes the gradient of the chi_2 for a given delta field.
-   * 
+  /*! Computes the gradient of the chi_2 for a given field.
+   * The field is the half spectrum, as given by a real to complex FFT, of the
+   * combined shear and flexion components for each lens plane.
    */
-  void gradient(fftwf_complex *delta);
+  void gradient(fftwf_complex *kappa);
 
-  /*! Computes the gradient of the chi_2 for a given delta field and randomized measurements.
+  /*! Computes the gradient of the chi_2 for randomized measurements, as a half spectrum.
    * 
    */
-  void gradient_noise(fftwf_complex *delta);
+  void gradient_noise(fftwf_complex *kappa);
   
   /*! Updates the non-linear correction factor in the covariance matrix.
    * 
    */
-  void update_covariance(fftwf_complex *delta);
+  void update_covariance(fftwf_complex *kappa);
+
+  /*! Keeps the reduced shear correction fixed during debiasing, if requested in the configuration.
+   * 
+   */
+  void set_debias(bool debias) {
+        conv_frozen = debias && conv_freeze_debias;
+  }
+
+  /*! Prints the number of evaluated and skipped reduced shear corrections.
+   * 
+   */
+  void print_reduced_shear_stats();
+
+  /*! Returns the time spent in the FFTs of the nfft, binned or Toeplitz operators, in seconds.
+   * 
+   */
+  double get_fft_time();
 
   /*! Computes the spectral norm of the lensing operator
    * 
@@ -181,15 +326,12 @@ public:
    */
   bool check_adjoint();
   
-  /*! Combines shear and flexion components applying a minimum variance filter
-   * 
+  /*! Compares the backend in use with a reference backend on the same catalogue.
+   * Returns false if the single precision nfft, the binned or the Toeplitz
+   * gradient depart from their reference by more than rounding errors.
    */
-  void combine_components(fftwf_complex * delta, fftwf_complex * delta_comb);
+  bool check_backend();
   
-  /*! Copies the same combined field into shear and flexion commponents
-   * 
-   */
-  void combine_components_inverse(fftwf_complex * delta_comb, fftwf_complex * delta);
   
   /*! Returns the preconditioning matrix
    * 
@@ -34,6 +34,8 @@
 
 #include <iostream>
 #include <fstream>
+#include <omp.h>
+#include <fftw3.h>
 #include <CCfits/CCfits>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
@@ -46,12 +48,32 @@
 #include "surface_reconstruction.h"
 #include "density_reconstruction.h"
 #include "gpu_utils.h"
+#include "fftw_utils.h"
 
 
 namespace po = boost::program_options;
 using namespace std;
 using namespace CCfits;
 
+// Reconstructs the field on a grid with factor times larger pixels and starts
+// the full resolution reconstruction rec from the interpolated solution
+template<class reconstruction>
+void solve_coarse_level(reconstruction &rec, boost::property_tree::ptree pt, survey *surv, field *f, int factor)
+{
+    pt.put("field.pixel_size", pt.get<double>("field.pixel_size") * factor);
+    pt.put("field.npix", f->get_npix() / factor);
+
+    std::cout << "Reconstructing on the coarse grid" << std::endl;
+    double t0 = omp_get_wtime();
+    field fc(pt, surv);
+    reconstruction rc(pt, &fc);
+    rc.reconstruct();
+
+    rec.initialise_from(rc.get_spectrum(), fc.get_npix());
+    std::cout << "Coarse grid reconstruction time : " << omp_get_wtime() - t0 << " s" << std::endl;
+    std::cout << "Refining on the full resolution grid" << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
     gsl_rng_env_setup();
@@ -65,6 +87,7 @@ int main(int argc, char *argv[])
     generic.add_options()
     ("version,v", "print version string")
     ("help,h", "print help message")
+    ("threads,t", po::value< int >(), "number of threads, overrides parameters.nthreads")
 #ifdef CUDA_ACC
     ("gpu,g", po::value< std::string >(), "comma separated list of GPUs to use (e.g: -g 0,1)")
 #endif
@@ -167,12 +190,68 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    // Set the number of threads once, all the FFTW plans created from now on
+    // use the same number of threads as the OpenMP loops
+    int nthreads = pt.get<int>("parameters.nthreads", omp_get_max_threads());
+    if (vm.count("threads")) {
+        nthreads = vm["threads"].as<int>();
+    }
+    if (nthreads < 1) {
+        std::cerr << "ERROR: Invalid number of threads " << nthreads << std::endl;
+        return 1;
+    }
+    omp_set_num_threads(nthreads);
+#ifdef FFTW_THREADS
+    fftw_init_threads();
+    fftwf_init_threads();
+    setFFTWThreads(nthreads);
+    cout << "Number of threads : " << nthreads << endl;
+#else
+    cout << "Number of threads : " << nthreads << " (single threaded FFTW)" << endl;
+#endif
+
+    // Plans are made once with FFTW_PATIENT and their wisdom is then reused
+    // by the following runs with the same sizes on this host
+    if (pt.get<bool>("parameters.fftw_patient", false)) {
+        setPlannerFlags(FFTW_PATIENT);
+    }
+    std::string wisdomFile = getWisdomFile(pt);
+    importWisdom(wisdomFile);
+
     // Create survey object and load data
     survey *surv = new survey(pt);
     surv->load(vm["data"].as<std::string>());
 
     // Initialize lensing field
     field *f = new field(pt, surv);
+
+    // Coarse-to-fine schedule, the full resolution grid then only refines the
+    // reconstruction of a grid with multigrid_factor times larger pixels
+    int requested_factor = pt.get<int>("parameters.multigrid_factor", 1);
+    int multigrid_factor = requested_factor;
+    while (multigrid_factor > 1 && f->get_npix() % (2 * multigrid_factor) != 0) {
+        multigrid_factor /= 2;
+    }
+    if (multigrid_factor != requested_factor) {
+        if (multigrid_factor > 1) {
+            cout << "Grid size not divisible by " << 2 * requested_factor << ", using a multigrid factor of " << multigrid_factor << endl;
+        } else {
+            cout << "Grid size not divisible by " << 2 * requested_factor << ", multigrid reconstruction disabled" << endl;
+        }
+    }
+    // The refinement starts close to the solution, every stage of the full
+    // resolution schedule runs factor^2 fewer iterations and noise randomisations
+    boost::property_tree::ptree pt_fine = pt;
+    if (multigrid_factor > 1) {
+        int nlevel = multigrid_factor * multigrid_factor;
+        int niter = pt.get<int>("parameters.niter", 500);
+        int niter_debias = pt.get<int>("parameters.niter_debias", 500);
+        int nrandom = pt.get<int>("parameters.nrandom", 1000);
+        pt_fine.put("parameters.niter", pt.get<int>("parameters.multigrid_niter", niter / nlevel));
+        pt_fine.put("parameters.niter_debias", pt.get<int>("parameters.multigrid_niter_debias", niter_debias / nlevel));
+        // Keeps enough randomisations for a few percent error on the thresholds
+        pt_fine.put("parameters.nrandom", pt.get<int>("parameters.multigrid_nrandom", max(nrandom / nlevel, min(nrandom, 200))));
+    }
     
     
     // Open output fits file before performing the actual reconstruction
@@ -200,22 +279,35 @@ int main(int argc, char *argv[])
     // Array holding the reconstruction
     double *reconstruction = (double *) malloc(sizeof(double)* f->get_npix() * f->get_npix() * f->get_nlp());
 
-    // If CUDA is available, give the option to reconstruct in 3D
+    // Reconstruct in 3D when several lens planes are requested
+    double t_rec = omp_get_wtime();
     if (f->get_nlp() > 1) {
-        density_reconstruction rec(pt, f);
+        density_reconstruction rec(pt_fine, f);
+        exportWisdom(wisdomFile);
+
+        if (multigrid_factor > 1) {
+            solve_coarse_level(rec, pt, surv, f, multigrid_factor);
+            exportWisdom(wisdomFile);
+        }
         rec.reconstruct();
         
         // Extracts the reconstructed array
         rec.get_density_map(reconstruction);
     } else {
         // Initialize reconstruction object
-        surface_reconstruction rec(pt, f);
+        surface_reconstruction rec(pt_fine, f);
+        exportWisdom(wisdomFile);
 
+        if (multigrid_factor > 1) {
+            solve_coarse_level(rec, pt, surv, f, multigrid_factor);
+            exportWisdom(wisdomFile);
+        }
         rec.reconstruct();
 
         // Extracts the reconstructed array
         rec.get_convergence_map(reconstruction);
     }
+    cout << "Reconstruction time : " << omp_get_wtime() - t_rec << " s" << endl;
     
     // Number of elements in the array
     long nelements =  naxes[0] * naxes[1] * naxes[2];
@@ -252,5 +344,10 @@ int main(int argc, char *argv[])
     delete f;
     delete surv;
 
+#ifdef FFTW_THREADS
+    fftw_cleanup_threads();
+    fftwf_cleanup_threads();
+#endif
+
     return 0;
 }
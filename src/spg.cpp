@@ -32,13 +32,12 @@
  *
  */
 
-#include <sparse2d/IM_IO.h>
 #include <iostream>
 #include "spg.h"
 #include "spg.cuh"
 
-spg::spg ( int npix, int nz, int nframes, const double *P, const float *l1_weights ) :
-    npix ( npix ), nz ( nz ), nframes ( nframes )
+spg::spg ( int npix, int nz, long ncoeff, const double *P, const float *l1_weights ) :
+    npix ( npix ), nz ( nz ), ncoeff ( ncoeff )
 {
     // Look for the number of available GPUs
     getDeviceCount ( &nGPU );
@@ -60,10 +59,10 @@ spg::spg ( int npix, int nz, int nframes, const double *P, const float *l1_weigh
     for ( int i = 0; i < nGPU; i++ ) {
 
         // Set strided data for each GPU, leaving the last GPU to handle any extra coefficients
-        coeff_stride[i] = npix * npix * nframes / nGPU;
+        coeff_stride[i] = ncoeff / nGPU;
         coeff_stride_pos[i] = npix * npix / nGPU;
         if ( i == ( nGPU - 1 ) ) {
-            coeff_stride[i] += npix * npix * nframes % nGPU;
+            coeff_stride[i] += ncoeff % nGPU;
             coeff_stride_pos[i] += npix * npix % nGPU;
         }
 
@@ -84,7 +83,7 @@ spg::spg ( int npix, int nz, int nframes, const double *P, const float *l1_weigh
         checkCudaErrors ( cudaMemset ( d_w[i],    0, sizeof ( float ) * coeff_stride[i] * nz ) );
 
         // Store the l1_weights for each GPU    
-        checkCudaErrors (cudaMemcpy2DAsync(d_w[i], coeff_stride[i]*sizeof ( float ), &l1_weights[i * coeff_stride[0]], npix * npix * nframes * sizeof ( float ), coeff_stride[i]*sizeof ( float ), nz, cudaMemcpyHostToDevice ) );
+        checkCudaErrors (cudaMemcpy2DAsync(d_w[i], coeff_stride[i]*sizeof ( float ), &l1_weights[i * coeff_stride[0]], ncoeff * sizeof ( float ), coeff_stride[i]*sizeof ( float ), nz, cudaMemcpyHostToDevice ) );
 
 
     }
@@ -186,7 +185,7 @@ void spg::prox_l1 ( float *alpha, int niter )
         checkCudaErrors ( cudaSetDevice ( whichGPUs[i] ) );
 
         // Copy wavelet coefficients to device
-        checkCudaErrors ( cudaMemcpy2DAsync ( d_x[i], coeff_stride[i]*sizeof ( float ), &alpha[i * coeff_stride[0]], npix * npix * nframes * sizeof ( float ), coeff_stride[i]*sizeof ( float ), nz, cudaMemcpyHostToDevice ) );
+        checkCudaErrors ( cudaMemcpy2DAsync ( d_x[i], coeff_stride[i]*sizeof ( float ), &alpha[i * coeff_stride[0]], ncoeff * sizeof ( float ), coeff_stride[i]*sizeof ( float ), nz, cudaMemcpyHostToDevice ) );
         
     }
 
@@ -203,7 +202,7 @@ void spg::prox_l1 ( float *alpha, int niter )
         checkCudaErrors ( cudaSetDevice ( whichGPUs[i] ) );
 
         // Recover wavelet coefficients from device
-        checkCudaErrors ( cudaMemcpy2DAsync ( &alpha[i * coeff_stride[0]], npix * npix * nframes * sizeof ( float ), d_x[i], coeff_stride[i]*sizeof ( float ), coeff_stride[i] * sizeof ( float ), nz, cudaMemcpyDeviceToHost ) );
+        checkCudaErrors ( cudaMemcpy2DAsync ( &alpha[i * coeff_stride[0]], ncoeff * sizeof ( float ), d_x[i], coeff_stride[i]*sizeof ( float ), coeff_stride[i] * sizeof ( float ), nz, cudaMemcpyDeviceToHost ) );
     }
 
     for ( int i = 0; i < nGPU; i++ ) {
@@ -221,7 +220,7 @@ void spg::update_weights ( float *l1_weights )
     // Memory allocation for all GPUs
     for ( int i = 0; i < nGPU; i++ ) {
         // Store the l1_weights for each GPU       
-        checkCudaErrors (cudaMemcpy2DAsync(d_w[i], coeff_stride[i]*sizeof ( float ), &l1_weights[i * coeff_stride[0]], npix * npix * nframes * sizeof ( float ), coeff_stride[i]*sizeof ( float ), nz, cudaMemcpyHostToDevice ) );
+        checkCudaErrors (cudaMemcpy2DAsync(d_w[i], coeff_stride[i]*sizeof ( float ), &l1_weights[i * coeff_stride[0]], ncoeff * sizeof ( float ), coeff_stride[i]*sizeof ( float ), nz, cudaMemcpyHostToDevice ) );
     }
 
     // Wait for all GPUs to be done
@@ -34,16 +34,23 @@
 
 #ifndef SPG_H
 #define SPG_H
+#ifdef CUDA_ACC
 #include <cuda_runtime.h>
 #include <cuda.h>
 #include "helper_timer.h"
 #include "gpu_utils.h"
+#endif
 
 class spg
 {
     int npix;
     int nz;
-    int nframes;
+    long ncoeff;
+    
+    float *p;
+    float *pp;
+    
+#ifdef CUDA_ACC
     int nGPU;
     int whichGPUs[MAX_GPUS];
     
@@ -57,18 +64,20 @@ class spg
     float ** d_u_pos;
     float ** d_w;
     
-    float *p;
-    float *pp;
-    
     StopWatchInterface *timer;
+#else
+    float *u;                           /*!< Dual variables of the sparsity constraint, kept between calls */
+    float *u_pos;                       /*!< Dual variables of the positivity constraint, kept between calls */
+    float *w;                           /*!< l1 thresholds */
+#endif
     
 public:
     
-    /* Initialise cuda accelerated SPG algorithm for evaluating simple
-     * proximal operators.
-     * 
+    /* Initialise SPG algorithm for evaluating simple proximal operators,
+     * cuda accelerated if available, for ncoeff wavelet coefficients per
+     * lens plane.
      */
-    spg( int npix, int nz, int nframes, const double *P, const float *l1_weights );
+    spg( int npix, int nz, long ncoeff, const double *P, const float *l1_weights );
     
     /* Destructor.
      * 
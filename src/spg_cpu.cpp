@@ -0,0 +1,327 @@
+/*! Copyright CEA, 2015-2016
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <omp.h>
+#include "spg.h"
+
+// Number of lines of sight solved together, the inner loops are vectorised
+// along this dimension
+#define SPG_BLOCK 64
+
+/* Projection onto the l1 ball of radius w, or onto the negative orthant when
+ * no thresholds are provided.
+ */
+static inline float spg_project(float u, const float *w, int b)
+{
+    if (w) {
+        return u - copysignf(fdimf(fabsf(u), w[b]), u);
+    }
+    return u - fmaxf(u, 0.f);
+}
+
+/* Runs the projected Barzilai-Borwein iterations of spg_l1_kernel and
+ * spg_pos_kernel on the nb lines of sight starting at x0, the iterations of a
+ * given line of sight stopping once its optimality criterion is reached.
+ * The work array should hold 5 * nz * SPG_BLOCK + 5 * SPG_BLOCK floats and px
+ * nz * SPG_BLOCK doubles.
+ */
+static void spg_block(long nx, int nz, long x0, int nb, float *pt_u, float *pt_x, const float *pt_w,
+                      const float *p, const float *pp, int niter, float epsilon, float *work, double *px)
+{
+    const float epsilon_0 = 1e-5;
+    const int B = SPG_BLOCK;
+
+    float *u    = work;
+    float *w    = u + nz * B;
+    float *g    = w + nz * B;
+    float *gold = g + nz * B;
+    float *uold = gold + nz * B;
+    float *gg0  = uold + nz * B;
+    float *bb   = gg0 + B;
+    float *sy   = bb + B;
+    float *den  = sy + B;
+    float *opt  = den + B;
+
+    // Load the block of lines of sight
+    for (int z = 0; z < nz; z++) {
+        memcpy(&u[z * B], &pt_u[z * nx + x0], sizeof(float) * nb);
+        if (pt_w) {
+            memcpy(&w[z * B], &pt_w[z * nx + x0], sizeof(float) * nb);
+        }
+    }
+    const float *wb = pt_w ? w : NULL;
+
+    // Initialize the loop by computing the transform of the input vectors
+    for (int z = 0; z < nz; z++) {
+        double *pxz = &px[z * B];
+        for (int b = 0; b < nb; b++) {
+            pxz[b] = 0;
+        }
+        for (int z1 = 0; z1 < nz; z1++) {
+            const float *x = &pt_x[z1 * nx + x0];
+            const float c = p[z1 * nz + z];
+            #pragma omp simd
+            for (int b = 0; b < nb; b++) {
+                pxz[b] += x[b] * c;
+            }
+        }
+    }
+
+    // Compute l2 norm of initial gradient
+    for (int b = 0; b < nb; b++) {
+        gg0[b] = 0;
+        bb[b]  = 0.0005;
+    }
+    for (int z = 0; z < nz; z++) {
+        #pragma omp simd
+        for (int b = 0; b < nb; b++) {
+            gg0[b] += (float) (px[z * B + b] * px[z * B + b]);
+        }
+    }
+    for (int b = 0; b < nb; b++) {
+        gg0[b] = sqrtf(gg0[b]);
+    }
+
+    // Main loop of minimisation algorithm
+    for (int iter = 0; iter < niter; iter++) {
+
+        // Compute the gradient g = PP^t u - P^t x
+        for (int z = 0; z < nz; z++) {
+            float *gz = &g[z * B];
+            #pragma omp simd
+            for (int b = 0; b < nb; b++) {
+                gz[b] = -px[z * B + b];
+            }
+            for (int z1 = 0; z1 < nz; z1++) {
+                const float *uz1 = &u[z1 * B];
+                const float c = pp[z1 * nz + z];
+                #pragma omp simd
+                for (int b = 0; b < nb; b++) {
+                    gz[b] += c * uz1[b];
+                }
+            }
+        }
+
+        // Compute BB steps
+        if (iter > 0) {
+            for (int b = 0; b < nb; b++) {
+                sy[b]  = 0;
+                den[b] = 0;
+            }
+            for (int z = 0; z < nz; z++) {
+                #pragma omp simd
+                for (int b = 0; b < nb; b++) {
+                    float y = g[z * B + b] - gold[z * B + b];
+                    float s = u[z * B + b] - uold[z * B + b];
+                    sy[b]  += y * s;
+                    den[b] += (iter % 2) ? y * y : s * s;
+                }
+            }
+            for (int b = 0; b < nb; b++) {
+                if (iter % 2) {
+                    bb[b] = den[b] == 0 ? 0 : sy[b] / den[b];
+                } else {
+                    bb[b] = sy[b] == 0 ? 0 : den[b] / sy[b];
+                }
+            }
+        }
+
+        // Compute optimality check
+        for (int b = 0; b < nb; b++) {
+            opt[b] = 0;
+        }
+        for (int z = 0; z < nz; z++) {
+            #pragma omp simd
+            for (int b = 0; b < nb; b++) {
+                float uz = u[z * B + b];
+                float gz = g[z * B + b];
+                float o;
+                if (wb) {
+                    float wz = wb[z * B + b];
+                    o = uz <= -wz + 1e-5 * wz ? fminf(0.0f, gz) : (uz >= wz - 1e-5 * wz ? fmaxf(0.0f, gz) : gz);
+                } else {
+                    o = uz == 0 ? fmaxf(gz, 0.f) : gz;
+                }
+                opt[b] += o * o / gg0[b];
+            }
+        }
+        bool converged = true;
+        for (int b = 0; b < nb; b++) {
+            opt[b] = sqrtf(gg0[b]) < epsilon_0 ? 0 : sqrtf(opt[b]);
+            if (opt[b] > epsilon) {
+                converged = false;
+                // Small check to prevent all hell from breaking loose
+                if (fabsf(bb[b]) > 1.0) {
+                    bb[b] = 0.001;
+                }
+            }
+        }
+
+        // Exit the loop once optimality is reached for every l.o.s.
+        if (converged) {
+            break;
+        }
+
+        // Update the variables of the l.o.s. which are not optimal yet
+        for (int z = 0; z < nz; z++) {
+            float *uz = &u[z * B];
+            float *gz = &g[z * B];
+            const float *wz = wb ? &wb[z * B] : NULL;
+            #pragma omp simd
+            for (int b = 0; b < nb; b++) {
+                if (opt[b] > epsilon) {
+                    uold[z * B + b] = uz[b];
+                    gold[z * B + b] = gz[b];
+                    uz[b] = spg_project(uz[b] - bb[b] * gz[b], wz, b);
+                }
+            }
+        }
+    }
+
+    // Compute transform of resulting array, the projection is stored in g
+    for (int z = 0; z < nz; z++) {
+        const float *wz = wb ? &wb[z * B] : NULL;
+        for (int b = 0; b < nb; b++) {
+            g[z * B + b] = spg_project(u[z * B + b], wz, b);
+        }
+    }
+    for (int z = 0; z < nz; z++) {
+        double *pxz = &px[z * B];
+        for (int b = 0; b < nb; b++) {
+            pxz[b] = 0;
+        }
+        for (int z1 = 0; z1 < nz; z1++) {
+            const float *cz1 = &g[z1 * B];
+            const float c = p[z1 * nz + z];
+            #pragma omp simd
+            for (int b = 0; b < nb; b++) {
+                pxz[b] += cz1[b] * c;
+            }
+        }
+    }
+
+    // Save the variables back to the main memory
+    for (int z = 0; z < nz; z++) {
+        memcpy(&pt_u[z * nx + x0], &u[z * B], sizeof(float) * nb);
+        for (int b = 0; b < nb; b++) {
+            pt_x[z * nx + x0 + b] = px[z * B + b];
+        }
+    }
+}
+
+/* Solves the nx independent problems, distributing the blocks of lines of
+ * sight among the OpenMP threads.
+ */
+static void spg_solve(long nx, int nz, float *pt_u, float *pt_x, const float *pt_w,
+                      const float *p, const float *pp, int niter, float epsilon)
+{
+    long nblocks = nx / SPG_BLOCK + (nx % SPG_BLOCK > 0 ? 1 : 0);
+
+    #pragma omp parallel
+    {
+        std::vector<float> work(5 * nz * SPG_BLOCK + 5 * SPG_BLOCK);
+        std::vector<double> px(nz * SPG_BLOCK);
+
+        #pragma omp for schedule(dynamic)
+        for (long i = 0; i < nblocks; i++) {
+            long x0 = i * SPG_BLOCK;
+            int nb = std::min((long) SPG_BLOCK, nx - x0);
+            spg_block(nx, nz, x0, nb, pt_u, pt_x, pt_w, p, pp, niter, epsilon, work.data(), px.data());
+        }
+    }
+}
+
+spg::spg ( int npix, int nz, long ncoeff, const double *P, const float *l1_weights ) :
+    npix ( npix ), nz ( nz ), ncoeff ( ncoeff )
+{
+    std::cout << "Running SPG algorithm on " << omp_get_max_threads() << " threads" << std::endl;
+
+    // Dual variables, initialised to zero and kept between calls
+    u     = ( float * ) calloc ( ncoeff * nz, sizeof ( float ) );
+    u_pos = ( float * ) calloc ( ( long ) npix * npix * nz, sizeof ( float ) );
+
+    w = ( float * ) malloc ( sizeof ( float ) * ncoeff * nz );
+    update_weights ( ( float * ) l1_weights );
+
+    // Compute and store the preconditioning matrix
+    pp = ( float * ) malloc ( sizeof ( float ) * nz * nz );
+    p = ( float * ) malloc ( sizeof ( float ) * nz * nz );
+    for ( int z1 = 0; z1 < nz; z1++ )
+        for ( int z2 = 0; z2 < nz; z2++ ) {
+            p[z1 * nz + z2] = P[z1 * nz + z2];
+        }
+    for ( int z1 = 0; z1 < nz; z1++ ) {
+        for ( int z2 = 0; z2 < nz; z2++ ) {
+            double toto = 0;
+            for ( int z3 = 0; z3 < nz; z3++ ) {
+                toto += P[z1 * nz + z3] * P[z3 * nz + z2];
+            }
+            pp[z1 * nz + z2] = toto;
+        }
+    }
+}
+
+spg::~spg()
+{
+    free ( u );
+    free ( u_pos );
+    free ( w );
+    free ( p );
+    free ( pp );
+}
+
+void spg::prox_pos ( float *delta, int niter )
+{
+    double start = omp_get_wtime();
+    spg_solve ( ( long ) npix * npix, nz, u_pos, delta, NULL, p, pp, niter, 1e-4 );
+    std::cout << "Time spent for solving positivity spg " << ( omp_get_wtime() - start ) * 1000 << std::endl;
+}
+
+void spg::prox_l1 ( float *alpha, int niter )
+{
+    double start = omp_get_wtime();
+    spg_solve ( ncoeff, nz, u, alpha, w, p, pp, niter, 1e-3 );
+    std::cout << "Time spent for solving l1 spg " << ( omp_get_wtime() - start ) * 1000 << std::endl;
+}
+
+void spg::update_weights ( float *l1_weights )
+{
+    memcpy ( w, l1_weights, sizeof ( float ) * ncoeff * nz );
+}
@@ -33,11 +33,14 @@
  */
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <omp.h>
 #ifdef DEBUG_FITS
 #include <sparse2d/IM_IO.h>
 #endif
 
 #include "surface_reconstruction.h"
+#include "fftw_utils.h"
 
 using namespace std;
 
@@ -52,8 +55,16 @@ surface_reconstruction::surface_reconstruction(boost::property_tree::ptree confi
     nrandom       = config.get<int>("parameters.nrandom", 1000.0);
     nreweights    = config.get<int>("parameters.nreweights", 5);
     positivity    = config.get<bool>("parameters.positivity", false);
+    tol           = config.get<double>("parameters.tol", 0);
+    tol_reweight  = config.get<double>("parameters.tol_reweight", tol);
+    tol_debias    = config.get<double>("parameters.tol_debias", tol);
+    adaptive_steps= config.get<bool>("parameters.adaptive_steps", false);
     double bl_reg = config.get<double>("parameters.battle_lemarie_reg", 0.1);
     double ls_reg = config.get<double>("parameters.last_scale_reg", 0.1);
+    std::string wavelet_backend = config.get("parameters.wavelet_backend", "auto");
+    std::string wavelet_cache = config.get<bool>("parameters.wavelet_cache", true) ? getCacheDirectory(config) : "";
+    double pyramid_tol = config.get<bool>("parameters.wavelet_pyramid", false) ? config.get<double>("parameters.wavelet_pyramid_tol", 1e-3) : 0;
+    size_t wavelet_memory = config.get<size_t>("parameters.wavelet_memory", 0) << 20;
 
 
     cout << "Using following reconstruction parameters :" << std::endl;
@@ -63,14 +74,29 @@ surface_reconstruction::surface_reconstruction(boost::property_tree::ptree confi
     // Get characteristics of the field
     npix = f->get_npix();
 
-    // Allocate wavelet transform
-    wav = new wavelet_transform(npix, nscales);
+    // Allocate wavelet transform, timing both backends unless one is set
+    if (wavelet_backend == "auto") {
+        wavelet_backend = pyramid_tol > 0 ? "fft" : wavelet_transform::fastest_backend(npix, nscales, 1, wavelet_cache, wavelet_memory);
+    }
+    wav = new wavelet_transform(npix, nscales, 1, wavelet_backend, wavelet_cache, pyramid_tol, wavelet_memory);
+    if (config.get<bool>("parameters.check_wavelet", false)) {
+        if (! wav->check_frames()) {
+            std::cout << "The wavelet frames do not match the impulse responses of the starlet transform" << std::endl;
+            exit(-1);
+        }
+        if (! wav->check_backend()) {
+            std::cout << "The " << (pyramid_tol > 0 ? "pyramidal" : wavelet_backend) << " wavelet transform does not match the reference transform" << std::endl;
+            exit(-1);
+        }
+    }
 
     // Effective number of wavelet frames
     nframes = wav->get_nframes();
 
-    ncoeff = npix * npix * 2;   // The factor 2 is to include both shear and flexion
-    nwavcoeff = npix * npix * nframes;
+    // Half spectrum of the real combined shear and flexion field
+    nhalf  = npix / 2 + 1;
+    ncoeff = npix * nhalf;
+    nwavcoeff = wav->get_ncoeff();
 
     // Allocating internal arrays
     kappa       = fftwf_alloc_complex(ncoeff);
@@ -79,14 +105,13 @@ surface_reconstruction::surface_reconstruction(boost::property_tree::ptree confi
     kappa_old   = fftwf_alloc_complex(ncoeff);
     kappa_grad  = fftwf_alloc_complex(ncoeff);
     kappa_tmp   = fftwf_alloc_complex(ncoeff);
-    kappa_trans = fftwf_alloc_complex(ncoeff);
     alpha       = (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_u     = (float *) malloc(sizeof(float) * nwavcoeff);
-    alpha_res   = (float *) malloc(sizeof(float) * nwavcoeff);
+    alpha_u     = (float *) malloc(sizeof(float) * npix * npix);
     alpha_tmp   = (float *) malloc(sizeof(float) * nwavcoeff);
     thresholds  = (float *) malloc(sizeof(float) * nwavcoeff);
-    weights     = (float *) malloc(sizeof(float) * nwavcoeff);
-    support     = (float *) malloc(sizeof(float) * nwavcoeff);
+    weights     = new active_set(nwavcoeff, true, 1.0f);
+    support     = new active_set(nwavcoeff, false, 0, true);
+    monitor     = new convergence_monitor();
 
     // Initialise internal arrays
     for (long ind = 0; ind < ncoeff; ind++) {
@@ -106,19 +131,17 @@ surface_reconstruction::surface_reconstruction(boost::property_tree::ptree confi
 
     for (long ind = 0; ind < nwavcoeff; ind++) {
         alpha[ind]     = 0;
-        alpha_u[ind]   = 0;
-        alpha_res[ind] = 0;
         alpha_tmp[ind] = 0;
         thresholds[ind]= 0;
-        weights[ind]   = 1;
-        support[ind]   = 1;
     }
 
     // Normalization factor for the fft
     fftFactor     = 1.0 / (((double)npix) * npix);
     fft_frame     = fftwf_alloc_complex(ncoeff);
-    plan_forward  = fftwf_plan_dft_2d(npix, npix, fft_frame, fft_frame, FFTW_FORWARD,  FFTW_MEASURE);
-    plan_backward = fftwf_plan_dft_2d(npix, npix, fft_frame, fft_frame, FFTW_BACKWARD, FFTW_MEASURE);
+    real_frame    = (float *) fftwf_malloc(sizeof(float) * npix * npix);
+    plan_forward  = fftwf_plan_dft_r2c_2d(npix, npix, real_frame, fft_frame, getPlannerFlags());
+    plan_backward = fftwf_plan_dft_c2r_2d(npix, npix, fft_frame, real_frame, getPlannerFlags());
+    fft_time = 0;
 
     // Initialize the threshold levels, with lower thresholds on larger scales
     sigma_thr = (double *) malloc(sizeof(double) * nframes);
@@ -149,15 +172,16 @@ surface_reconstruction::~surface_reconstruction()
     fftwf_free(kappa_old);
     fftwf_free(kappa_grad);
     fftwf_free(kappa_tmp);
-    fftwf_free(kappa_trans);
     fftwf_free(fft_frame);
+    fftwf_free(real_frame);
     free(sigma_thr);
     free(alpha);
     free(alpha_u);
-    free(alpha_res);
     free(alpha_tmp);
     free(thresholds);
-    free(weights);
+    delete weights;
+    delete support;
+    delete monitor;
 
     fftwf_destroy_plan(plan_forward);
     fftwf_destroy_plan(plan_backward);
@@ -167,11 +191,28 @@ surface_reconstruction::~surface_reconstruction()
 
 void surface_reconstruction::run_main_iteration(long int niter, bool debias)
 {
+    f->set_debias(debias);
+
+    // The steps satisfy the convergence condition 1 / tau - sig * mu1 >= mu2 / 2,
+    // mu2 being the Lipschitz constant of the gradient
     mu2 = f->get_spectral_norm(200, 1e-7);
+    sig = 1.0 / mu1;
     tau = 0.9 / (mu2 / 2.0 + sig * mu1);
 
     std::cout << "Step size : " << tau << std::endl;
 
+    // Rate of the residual balancing, decreasing geometrically so that the
+    // steps eventually settle
+    double rate = 0.5;
+
+    // With varying steps, the extrapolation of the primal iterate follows
+    // the ratio of consecutive steps
+    double tau_prev = tau;
+
+    // Reconstructing from wavelet coefficients, kappa_u is then kept up to
+    // date by update_dual
+    wav->trans_adjoint(alpha, kappa_u);
+
     for (long iter = 0; iter < niter; iter++) {
         if (iter % 100 == 0) {
             std::cout << "Iteration :" << iter << std::endl;
@@ -187,70 +228,185 @@ void surface_reconstruction::run_main_iteration(long int niter, bool debias)
 
         f->gradient(kappa_grad);
 
-        // Reconstructing from wavelet coefficients
-        wav->trans_adjoint(alpha, kappa_trans);
-        f->combine_components_inverse(kappa_trans, kappa_u);
+        primal_step();
 
-        // Updating kappa
+        // The gradient is no longer needed and its array receives the first
+        // part of the primal residual, (kappa_old - kappa) / tau - kappa_u
+        fftwf_complex *res = kappa_grad;
+        double theta = tau / tau_prev;
+        tau_prev = tau;
+        double dkappa2 = 0, kappa2 = 0;
         for (long ind = 0; ind < ncoeff; ind++) {
-            kappa[ind][0] += tau * (kappa_grad[ind][0] - kappa_u[ind][0]) ;
-            kappa[ind][1] += tau * (kappa_grad[ind][1] - kappa_u[ind][1]) ;
+            if (theta == 1) {
+                kappa_tmp[ind][0] = 2 * kappa[ind][0] - kappa_old[ind][0];
+                kappa_tmp[ind][1] = 2 * kappa[ind][1] - kappa_old[ind][1];
+            } else {
+                kappa_tmp[ind][0] = kappa[ind][0] + theta * (kappa[ind][0] - kappa_old[ind][0]);
+                kappa_tmp[ind][1] = kappa[ind][1] + theta * (kappa[ind][1] - kappa_old[ind][1]);
+            }
+
+            double dr = kappa_old[ind][0] - kappa[ind][0];
+            double di = kappa_old[ind][1] - kappa[ind][1];
+            dkappa2 += dr * dr + di * di;
+            kappa2  += kappa[ind][0] * kappa[ind][0] + kappa[ind][1] * kappa[ind][1];
+            res[ind][0] = dr / tau - kappa_u[ind][0];
+            res[ind][1] = di / tau - kappa_u[ind][1];
         }
 
-        // Here is the place to compute the prox of the E mode constraint
-        f->combine_components(kappa, kappa_tmp);
-        for (long ind = 0; ind < npix * npix; ind++) {
-            fft_frame[ind][0] = kappa_tmp[ind][0] * fftFactor;
-            fft_frame[ind][1] = kappa_tmp[ind][1] * fftFactor;
+        double dalpha2 = 0, alpha2 = 0;
+        update_dual(debias, dalpha2, alpha2);
+
+        // Completes the primal residual with the updated adjoint
+        double primal2 = 0;
+        for (long ind = 0; ind < ncoeff; ind++) {
+            double pr = res[ind][0] + kappa_u[ind][0];
+            double pi = res[ind][1] + kappa_u[ind][1];
+            primal2 += pr * pr + pi * pi;
         }
-        fftwf_execute(plan_backward);
 
-        if (positivity) {
-            for (long ind = 0; ind < npix * npix; ind++) {
-                fft_frame[ind][0] = max(fft_frame[ind][0], 0.f);
-                fft_frame[ind][1] = 0;
-            }
-        } else {
-            for (long ind = 0; ind < npix * npix; ind++) {
-                fft_frame[ind][1] = 0;
+        kappa2 = max(kappa2, 1e-30);
+        double primal_res = tau * sqrt(primal2 / kappa2);
+        double dual_res   = sqrt(dalpha2 / max(alpha2, 1e-30));
+        bool converged = monitor->update(sqrt(dkappa2 / kappa2), primal_res, dual_res,
+                                         debias ? 0 : ((double) support->get_nchanged()) / nwavcoeff);
+
+        // Residual balancing on the unnormalised residuals, a large primal
+        // residual calling for a larger primal step and thus a smaller dual
+        // step, and conversely
+        if (adaptive_steps) {
+            double primal_norm = sqrt(primal2);
+            double dual_norm   = sqrt(dalpha2) / sig;
+            if (primal_norm > 1.5 * dual_norm) {
+                sig = max(sig * (1 - rate), 1e-3 / mu1);
+            } else if (dual_norm > 1.5 * primal_norm) {
+                sig = min(sig / (1 - rate), 1e3 / mu1);
             }
+            rate *= 0.95;
+            tau = 0.9 / (mu2 / 2.0 + sig * mu1);
+            std::cout << "Iteration " << iter << " tau : " << tau << " ; sigma : " << sig << std::endl;
+        }
+
+        if (converged) {
+            break;
         }
+    }
+
+}
+
+void surface_reconstruction::primal_step()
+{
+    // Updating kappa
+    for (long ind = 0; ind < ncoeff; ind++) {
+        kappa[ind][0] = kappa_old[ind][0] + tau * (kappa_grad[ind][0] - kappa_u[ind][0]) ;
+        kappa[ind][1] = kappa_old[ind][1] + tau * (kappa_grad[ind][1] - kappa_u[ind][1]) ;
+    }
+
+    // Here is the place to compute the prox of the E mode constraint
+    for (long ind = 0; ind < ncoeff; ind++) {
+        fft_frame[ind][0] = kappa[ind][0] * fftFactor;
+        fft_frame[ind][1] = kappa[ind][1] * fftFactor;
+    }
+    execute_fft(plan_backward);
 
-        fftwf_execute(plan_forward);
+    if (positivity) {
         for (long ind = 0; ind < npix * npix; ind++) {
-            kappa_tmp[ind][0] = fft_frame[ind][0];
-            kappa_tmp[ind][1] = fft_frame[ind][1];
+            real_frame[ind] = max(real_frame[ind], 0.f);
         }
-        f->combine_components_inverse(kappa_tmp, kappa);
-        /////////////////////////////////////////////////////////
+    }
 
-        for (long ind = 0; ind < ncoeff; ind++) {
-            kappa_tmp[ind][0] = 2 * kappa[ind][0] - kappa_old[ind][0];
-            kappa_tmp[ind][1] = 2 * kappa[ind][1] - kappa_old[ind][1];
+    execute_fft(plan_forward);
+    for (long ind = 0; ind < ncoeff; ind++) {
+        kappa[ind][0] = fft_frame[ind][0];
+        kappa[ind][1] = fft_frame[ind][1];
+    }
+}
+
+void surface_reconstruction::update_dual(bool debias, double &dalpha2, double &alpha2)
+{
+    // Each frame is analysed, updated and synthesised in turn, so that only
+    // the coefficients of one frame are held besides alpha. The frames are
+    // computed from their Fourier multipliers whatever the wavelet backend,
+    // the direct backend, set or chosen by timing, then only applies to the
+    // thresholds and weights, which use the full transform.
+    for (long ind = 0; ind < ncoeff; ind++) {
+        kappa_u[ind][0] = 0;
+        kappa_u[ind][1] = 0;
+    }
+
+    // The coefficients of the support are fixed to zero during the
+    // debiasing, as well as the coarse scale
+    if (debias && support->is_full()) {
+        for (long ind = 0; ind < nwavcoeff; ind++) {
+            dalpha2 += alpha[ind] * alpha[ind];
+            alpha[ind] = 0;
         }
+        return;
+    }
+
+    int nthreads = omp_get_max_threads();
+    if (! debias) {
+        support->begin_update(nframes * nthreads);
+    }
 
-        f->combine_components(kappa_tmp, kappa_trans);
-        wav->transform(kappa_trans, alpha_u);
+    for (int i = 0; i < nframes; i++) {
+        long first = wav->get_frame_offset(i);
+        long last  = wav->get_frame_offset(i + 1);
+        float *a = alpha + first;
 
-        for (int j = 0; j < nframes; j++) {
-            for (long ind = 0; ind < npix * npix; ind++) {
-                double dum = alpha[j * npix * npix + ind] + sig * alpha_u[j * npix * npix + ind];
+        if (debias && i == nscales - 1) {
+            for (long ind = 0; ind < last - first; ind++) {
+                dalpha2 += a[ind] * a[ind];
+                a[ind] = 0;
+            }
+            continue;
+        }
 
-                if (debias) {
-                    if (j == (nscales - 1)) {
-                        alpha[j * npix * npix + ind] = 0;
-                    } else {
-                        alpha[j * npix * npix + ind] = dum - dum * support[j * npix * npix + ind] ;
+        wav->transform_frame(kappa_tmp, i, alpha_u);
+
+        if (debias) {
+            // The support is cleared first so that its coefficients stay at zero
+            const long *active = support->get_index();
+            long end = support->find(last);
+            #pragma omp parallel for reduction(+:dalpha2)
+            for (long n = support->find(first); n < end; n++) {
+                dalpha2 += alpha[active[n]] * alpha[active[n]];
+                alpha[active[n]] = 0;
+                alpha_u[active[n] - first] = 0;
+            }
+            #pragma omp parallel for reduction(+:dalpha2,alpha2)
+            for (long ind = 0; ind < last - first; ind++) {
+                double d = sig * alpha_u[ind];
+                a[ind] += d;
+                dalpha2 += d * d;
+                alpha2  += a[ind] * a[ind];
+            }
+        } else {
+            #pragma omp parallel reduction(+:dalpha2,alpha2)
+            {
+                int t = omp_get_thread_num();
+                long start, end;
+                support->get_range(t, omp_get_num_threads(), first, last, start, end);
+                long cursor = weights->find(start);
+                for (long ind = start; ind < end; ind++) {
+                    double dum = alpha[ind] + sig * alpha_u[ind - first];
+                    float w = weights->get_value(ind, cursor);
+                    double val = dum - copysign(max(fabs(dum) - sigma_thr[i] * thresholds[ind] * w, 0.0), dum);
+                    if (fabs(val) < fabs(dum)) {
+                        support->push(i * nthreads + t, ind);
                     }
-                } else {
-                    double val = dum - copysign(max(fabs(dum) - sigma_thr[j] * thresholds[j * npix * npix + ind] * weights[j * npix * npix + ind], 0.0), dum);
-                    support[j * npix * npix + ind] = fabs(val) < fabs(dum) ? 1 : 0;
-                    alpha[j * npix * npix + ind] = val;
+                    dalpha2 += (val - alpha[ind]) * (val - alpha[ind]);
+                    alpha2  += val * val;
+                    alpha[ind] = val;
                 }
             }
         }
+
+        wav->trans_adjoint_frame(a, i, kappa_u);
     }
 
+    if (! debias) {
+        support->end_update();
+    }
 }
 
 void surface_reconstruction::reconstruct()
@@ -258,14 +414,18 @@ void surface_reconstruction::reconstruct()
     std::cout << "Computing thresholds" << std::endl;
     compute_thresholds(nrandom);
 #ifdef DEBUG_FITS
-    // Saves the thresholds
-    fltarray thr;
-    thr.alloc(thresholds, npix,npix,nframes);
-    fits_write_fltarr("thresholds.fits", thr);
+    // Saves the thresholds, as a cube when the frames share the same grid
+    if (! wav->is_pyramid()) {
+        fltarray thr;
+        thr.alloc(thresholds, npix,npix,nframes);
+        fits_write_fltarr("thresholds.fits", thr);
+    }
 #endif
     
     std::cout << "Running main iteration" << std::endl;
+    monitor->begin_stage("main", nRecIter, tol);
     run_main_iteration(nRecIter);
+    monitor->end_stage();
 
 
     // Reweighted l1 loop
@@ -273,29 +433,46 @@ void surface_reconstruction::reconstruct()
          f->update_covariance(kappa);
          compute_thresholds(nrandom / 2);
          compute_weights();
+         monitor->begin_stage("reweighting " + std::to_string(i + 1), nRecIter / 2, tol_reweight);
          run_main_iteration(nRecIter / 2);
+         monitor->end_stage();
      }
  
     std::cout  << "Starting debiasing " << std::endl;
     // Final debiasing step
     f->update_covariance(kappa);
+    monitor->begin_stage("debias", nRecIterDebias, tol_debias);
     run_main_iteration(nRecIterDebias, true);
+    monitor->end_stage();
+    monitor->print_summary();
+
+    f->print_reduced_shear_stats();
+
+    std::cout << "Time spent in FFTs with " << omp_get_max_threads() << " threads : "
+              << fft_time + wav->get_fft_time() + f->get_fft_time() << " s (wavelet transform : " << wav->get_fft_time()
+              << " s, lensing operator : " << f->get_fft_time() << " s)" << std::endl;
+}
+
+void surface_reconstruction::execute_fft(fftwf_plan plan)
+{
+    double t0 = omp_get_wtime();
+    fftwf_execute(plan);
+    fft_time += omp_get_wtime() - t0;
 }
 
 void surface_reconstruction::compute_thresholds(int niter)
 {
 
-    for (long ind = 0; ind < npix * npix * nframes; ind++) {
+    for (long ind = 0; ind < nwavcoeff; ind++) {
         thresholds[ind] = 0;
     }
 
     for (int i = 0; i < niter ; i++) {
         f->gradient_noise(kappa_rec);
-        f->combine_components(kappa_rec, kappa_trans);
-        wav->transform(kappa_trans, alpha_tmp);
+        wav->transform(kappa_rec, alpha_tmp);
 
         // Compute gradient step
-        for (long ind = 0; ind < npix * npix * nframes; ind++) {
+        for (long ind = 0; ind < nwavcoeff; ind++) {
 
             thresholds[ind] += pow(alpha_tmp[ind], 2.0);
         }
@@ -303,12 +480,12 @@ void surface_reconstruction::compute_thresholds(int niter)
 
     for (long n = 0; n < nframes; n++) {
         double maxThr = 0;
-        for (long ind = 0; ind < npix * npix; ind++) {
-            thresholds[n * npix * npix + ind] = sqrt(1.0 / ((double) niter) * thresholds[n * npix * npix + ind]);
-            maxThr = thresholds[n * npix * npix + ind] > maxThr ? thresholds[n * npix * npix + ind] : maxThr;
+        for (long ind = wav->get_frame_offset(n); ind < wav->get_frame_offset(n + 1); ind++) {
+            thresholds[ind] = sqrt(1.0 / ((double) niter) * thresholds[ind]);
+            maxThr = thresholds[ind] > maxThr ? thresholds[ind] : maxThr;
         }
-        for (long ind = 0; ind < npix * npix; ind++) {
-            thresholds[n * npix * npix + ind] = max(thresholds[n * npix * npix + ind], (float) (maxThr * 0.1));
+        for (long ind = wav->get_frame_offset(n); ind < wav->get_frame_offset(n + 1); ind++) {
+            thresholds[ind] = max(thresholds[ind], (float) (maxThr * 0.1));
         }
     }
 }
@@ -334,8 +511,8 @@ double surface_reconstruction::get_spectral_norm_prox(int niter, double tol)
     }
 
     for (int k = 0; k < niter; k++) {
-        wav->transform(kappa_rec, alpha_u);
-        wav->trans_adjoint(alpha_u, kappa_rec);
+        wav->transform(kappa_rec, alpha_tmp);
+        wav->trans_adjoint(alpha_tmp, kappa_rec);
 
         // Compute norm
         for (long ind = 0; ind < ncoeff; ind++) {
@@ -363,50 +540,60 @@ double surface_reconstruction::get_spectral_norm_prox(int niter, double tol)
 
 void surface_reconstruction::compute_weights()
 {
-    for (long ind = 0; ind < npix * npix; ind++) {
+    for (long ind = 0; ind < ncoeff; ind++) {
         fft_frame[ind][0] = kappa[ind][0] * fftFactor;
         fft_frame[ind][1] = kappa[ind][1] * fftFactor;
     }
-    fftwf_execute(plan_backward);
+    execute_fft(plan_backward);
     for (long ind = 0; ind < npix * npix; ind++) {
-        fft_frame[ind][0] = max(fft_frame[ind][0], 0.0f);
-        fft_frame[ind][1] = 0;
+        real_frame[ind] = max(real_frame[ind], 0.0f);
     }
 
-    fftwf_execute(plan_forward);
-    for (long ind = 0; ind < npix * npix; ind++) {
+    execute_fft(plan_forward);
+    for (long ind = 0; ind < ncoeff; ind++) {
         kappa_tmp[ind][0] = fft_frame[ind][0];
         kappa_tmp[ind][1] = fft_frame[ind][1];
     }
 
-    wav->transform(kappa_tmp, alpha_res);
-
-    for (long ind = 0; ind < npix * npix * nframes; ind++) {
-        if (fabs(alpha_res[ind]) < lambda * thresholds[ind]) {
-            weights[ind] = 1.0;
-        } else {
-            weights[ind] = lambda * thresholds[ind] / fabs(alpha_res[ind]);
+    wav->transform(kappa_tmp, alpha_tmp);
+
+    // Only the coefficients above the threshold get a weight lower than one
+    weights->begin_update(omp_get_max_threads());
+    #pragma omp parallel
+    {
+        long start, end;
+        weights->get_range(omp_get_thread_num(), omp_get_num_threads(), start, end);
+        for (long ind = start; ind < end; ind++) {
+            if (fabs(alpha_tmp[ind]) >= lambda * thresholds[ind]) {
+                weights->push(omp_get_thread_num(), ind, lambda * thresholds[ind] / fabs(alpha_tmp[ind]));
+            }
         }
     }
+    weights->end_update();
 }
 
 void surface_reconstruction::get_convergence_map(double *kap)
 {
 
-    for (long ind = 0; ind < npix * npix; ind++) {
+    for (long ind = 0; ind < ncoeff; ind++) {
         fft_frame[ind][0] = kappa[ind][0] * fftFactor;
         fft_frame[ind][1] = kappa[ind][1] * fftFactor;
     }
 
-    fftwf_execute(plan_backward);
+    execute_fft(plan_backward);
 
     for (int y = 0; y < npix ; y++) {
         for (int x = 0; x < npix ; x++) {
             long pos = (npix - y - 1) * npix + (npix - x - 1);
-            kap[x * npix + y] = fft_frame[pos][0];
+            kap[x * npix + y] = real_frame[pos];
         }
 
     }
 }
 
+void surface_reconstruction::initialise_from(const fftwf_complex *spectrum, int npix_coarse)
+{
+    interpolateSpectrum(spectrum, npix_coarse, kappa, npix, 1);
+}
+
 
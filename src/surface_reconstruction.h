@@ -39,6 +39,8 @@
 
 #include "field.h"
 #include "wavelet_transform.h"
+#include "active_set.h"
+#include "convergence_monitor.h"
 
 class surface_reconstruction
 {
@@ -49,9 +51,14 @@ class surface_reconstruction
     double lambda;                      /*!< Regularisation parameter. */
     int    nreweights;                  /*!< Number of reweighted l1 iterations.*/
     bool   positivity;                  /*!< Apply positivity constraint on the reconstruction. */
+    double tol;                         /*!< Convergence tolerance of the main iterations, 0 to run them all. */
+    double tol_reweight;                /*!< Convergence tolerance of the reweighted iterations. */
+    double tol_debias;                  /*!< Convergence tolerance of the debiasing iterations. */
+    bool   adaptive_steps;              /*!< Adapt the step sizes by balancing the primal and dual residuals. */
     
     // Internal parameters
     int npix;                           /*!< Number of pixels. */
+    int nhalf;                          /*!< Number of stored frequencies along x for the half spectrum. */
     int ncoeff;                         /*!< Number of reconstruction coefficients. */
     int nframes;                        /*!< Total number of wavelet frames. */
     int nwavcoeff;                      /*!< Number of wavelet coefficients. */
@@ -69,20 +76,39 @@ class surface_reconstruction
     fftwf_complex * kappa_old;
     fftwf_complex * kappa_grad;
     fftwf_complex * kappa_tmp;
-    fftwf_complex * kappa_trans;
     fftwf_complex * fft_frame;
+    float * real_frame;
     float * alpha;                     
-    float * alpha_u;
-    float * alpha_res;
+    float * alpha_u;                    /*!< Coefficients of the frame being updated. */
     float * alpha_tmp;
     float * thresholds;
-    float * support;
-    float * weights;
+    active_set * support;               /*!< Coefficients above the threshold, fixed to zero during the debiasing. */
+    active_set * weights;               /*!< Reweighted l1 weights, equal to one outside of the set. */
+    convergence_monitor * monitor;      /*!< Convergence metrics and early stopping of the stages. */
     
     fftwf_plan plan_backward;
     fftwf_plan plan_forward;
+    double fft_time;                    /*!< Time spent in the FFTs of the convergence map, in seconds. */
 
     double get_spectral_norm_prox(int niter, double tol);
+
+    /*! Computes kappa from kappa_old by a gradient step of size tau, using
+     * the gradient in kappa_grad and the adjoint in kappa_u, followed by the
+     * projection on the constraints.
+     */
+    void primal_step();
+
+    /*! Updates the wavelet coefficients from kappa_tmp one frame at a time,
+     * and accumulates their adjoint in kappa_u. The squared norms of the
+     * change of the coefficients and of the updated coefficients are added
+     * to dalpha2 and alpha2.
+     */
+    void update_dual(bool debias, double &dalpha2, double &alpha2);
+
+    /*! Executes one of the FFT plans, accumulating the time spent in fft_time.
+     *
+     */
+    void execute_fft(fftwf_plan plan);
     
 public:
     
@@ -96,8 +122,8 @@ public:
      */
     ~surface_reconstruction();
     
-    /*! Run the main iteration of the reconstruction algorithm for a number of iterations.
-     * 
+    /*! Run the main iteration of the reconstruction algorithm for a number of iterations,
+     * or until the stage started on the convergence monitor has converged.
      */
     void run_main_iteration(long niter, bool debias=false);
     
@@ -120,6 +146,18 @@ public:
      * 
      */
     void get_convergence_map(double *kap);
+
+    /*! Returns the half spectrum of the current convergence map
+     *
+     */
+    const fftwf_complex *get_spectrum() {
+        return kappa;
+    }
+
+    /*! Starts from the convergence map of a reconstruction over the same
+     * field on a coarser grid of npix_coarse pixels, given by its spectrum.
+     */
+    void initialise_from(const fftwf_complex *spectrum, int npix_coarse);
     
 };
 
@@ -32,46 +32,356 @@
  *
  */
 
+#ifdef USE_SPARSE2D
 #include <sparse2d/MR_Obj.h>
+#endif
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "wavelet_transform.h"
+#include "fftw_utils.h"
 #include "starlet_2d.h"
 
-wavelet_transform::wavelet_transform(int npix, int nscale, int nlp):
-    npix(npix), nscale(nscale), nlp(nlp)
+// Filters used to build the frames, and version of the cache file layout
+#ifdef USE_SPARSE2D
+static const char    *frames_filter  = "starlet_b3_sparse2d_lemarie5";
+#else
+static const char    *frames_filter  = "starlet_b3_lemarie5";
+#endif
+static const uint32_t frames_version = 3;
+
+// Smallest grid of a decimated frame
+static const int min_frame_npix = 8;
+
+wavelet_transform::wavelet_transform(int npix, int nscale, int nlp, std::string backend, std::string cache_dir, double pyramid_tol, size_t max_scratch):
+    npix(npix), nscale(nscale), nlp(nlp), cache_dir(cache_dir), pyramid_tol(pyramid_tol), max_scratch(max_scratch)
 {
 
-    fftw_complex *frame = (fftw_complex *) fftw_malloc(sizeof(fftw_complex) * npix * npix);
-    fftw_plan plan  = fftw_plan_dft_2d(npix, npix, frame, frame, FFTW_FORWARD,   FFTW_MEASURE);
+    nhalf = npix / 2 + 1;
 
     // We begin with starlets combined with battle_lemarie wavelets
     nframes = nscale + 3; // all starlet frames + the 3 first BL scales
-
     frames = new float*[nframes];
+
+    // The filter bank only depends on npix and nscale, it is mapped from
+    // the cache when a previous run already computed it
+    frames_data = NULL;
+    frames_map  = NULL;
+    frames_map_size = 0;
+    std::string cache_file = cache_dir.empty() ? "" : get_frames_file(cache_dir);
+    if (! load_frames(cache_file)) {
+        compute_frames();
+        save_frames(cache_file);
+    }
+
+    // In pyramidal mode each frame has its own grid, which is only
+    // supported by the fft backend on CPU
+#ifdef CUDA_ACC
+    pyramid = false;
+    if (pyramid_tol > 0) {
+        std::cout << "Warning: Pyramidal wavelet transform not available on GPU, using undecimated frames" << std::endl;
+    }
+#else
+    pyramid = pyramid_tol > 0;
+#endif
+    frame_npix   = new int[nframes];
+    frame_offset = new long[nframes + 1];
+    slot_offset  = new long[nframes + 1];
+    if (pyramid) {
+        compute_decimation();
+    } else {
+        for (int i = 0; i < nframes; i++) {
+            frame_npix[i] = npix;
+        }
+    }
+    frame_offset[0] = 0;
     for (int i = 0; i < nframes; i++) {
-        frames[i] = (float *) fftwf_malloc(sizeof(float) * npix * npix);
+        long m = frame_npix[i];
+        frame_offset[i + 1] = frame_offset[i] + m * m;
+    }
+    ncoeff = frame_offset[nframes];
+    if (pyramid) {
+        std::cout << "Pyramidal wavelet transform, frame sizes :";
+        for (int i = 0; i < nframes; i++) {
+            std::cout << " " << frame_npix[i];
+        }
+        std::cout << " (" << ncoeff << " coefficients instead of " << ((long) npix) * npix * nframes << ")" << std::endl;
+    }
+
+    // The starlet frames can be computed in direct space with the a trous
+    // algorithm, in which case the batched FFTs only cover the image itself
+    // and the Battle-Lemarie frames
+#ifdef CUDA_ACC
+    direct = false;
+#else
+    if (pyramid) {
+        direct = false;
+    } else if (backend == "direct") {
+        direct = true;
+    } else {
+        if (backend != "fft") {
+            std::cout << "Unknown wavelet backend " << backend << ", using fft" << std::endl;
+        }
+        direct = false;
+    }
+#endif
+    nslots = direct ? nframes - nscale + 1 : nframes;
+    fft_time = 0;
+    frame_fft = NULL;
+    frame_forward  = NULL;
+    frame_backward = NULL;
+    atrous_tmp = NULL;
+    atrous_out = NULL;
+    if (direct) {
+        atrous_tmp = (float *) malloc(sizeof(float) * npix * npix);
+        atrous_out = (float *) malloc(sizeof(float) * npix * npix);
     }
 
+    // The lens planes are transformed in batches of nbatch planes, as many as
+    // fit in max_scratch bytes of FFT buffer
+    slot_offset[0] = 0;
+    for (int i = 0; i < nframes; i++) {
+        long m = frame_npix[i];
+        slot_offset[i + 1] = slot_offset[i] + m * (m / 2 + 1);
+    }
+#ifdef CUDA_ACC
+    nbatch = nlp;
+#else
+    size_t plane_scratch = sizeof(fftwf_complex) * (pyramid ? slot_offset[nframes] : ((long) npix) * nhalf * nslots);
+    nbatch = max_scratch > 0 ? std::max(1, std::min(nlp, (int) (max_scratch / plane_scratch))) : nlp;
+    if (nbatch < nlp) {
+        std::cout << "Wavelet transform FFT buffer : " << nbatch * plane_scratch / (1 << 20) << " MB, "
+                  << "in batches of " << nbatch << " lens planes" << std::endl;
+    }
+#endif
+    for (int i = 0; i <= nframes; i++) {
+        slot_offset[i] *= nbatch;
+    }
+
+    // Allocate batch wavelet transform either using fftw or CUDA
+#ifdef CUDA_ACC
+    int dimensions[2] = { npix, npix };
+    int rank = 2;
+
+    // The GPU transforms work on the full spectra
+    fft_frame = fftwf_alloc_complex(npix * npix * nlp * nframes);
+
+    cufftResult ret = cufftCreate(&fft_plan);
+
+    // Look for the number of available GPUs
+    getDeviceCount(&nGPU);
+    getGPUs(whichGPUs);
+        
+    std::cout << "Performing wavelet transform using " << nGPU << " GPUs" <<std::endl; 
+    // 2 cases: Single GPU or Multiple GPUs
+    if(nGPU > 1){
+
+        ret =cufftXtSetGPUs(fft_plan , nGPU, whichGPUs);
+        if(ret != 0) std::cout <<"set gpus" << ret << std::endl;
+        
+        ret =cufftMakePlanMany(fft_plan, rank, dimensions,
+                        NULL, 1, npix*npix, NULL, 1, npix*npix,
+                        CUFFT_C2C, nlp * nframes, worksize);
+        if(ret != 0) std::cout <<"make plan " << ret << std::endl;
+        
+        ret = cufftXtMalloc(fft_plan, &d_frameXt, CUFFT_XT_FORMAT_INPLACE);
+        if(ret != 0) std::cout <<"malloc " << ret << std::endl;
+     }else{
+         
+        // Select GPU
+        cudaSetDevice(whichGPUs[0]);
+
+        ret =cufftMakePlanMany(fft_plan, rank, dimensions,
+                        NULL, 1, npix*npix, NULL, 1, npix*npix,
+                        CUFFT_C2C, nlp * nframes, worksize);
+        if(ret != 0) std::cout <<"make plan " << ret << std::endl;
+        
+        cudaMalloc(&d_frame, sizeof(cufftComplex)*nlp*nframes*npix*npix);
+     }
+#else
+    // In place real to complex transforms, the rows of the real frames are
+    // padded to 2 * nhalf floats. In pyramidal mode each frame has its own
+    // plan, on the grid of the frame.
+    fft_frame  = pyramid ? fftwf_alloc_complex(slot_offset[nframes]) : fftwf_alloc_complex(npix * nhalf * nbatch * nslots);
+    real_frame = (float *) fft_frame;
+    nplans = pyramid ? nframes : 1;
+    batch_forward  = new fftwf_plan[nplans];
+    batch_backward = new fftwf_plan[nplans];
+    make_plans(nbatch, batch_forward, batch_backward);
+    last_forward  = NULL;
+    last_backward = NULL;
+    if (nlp % nbatch != 0) {
+        last_forward  = new fftwf_plan[nplans];
+        last_backward = new fftwf_plan[nplans];
+        make_plans(nlp % nbatch, last_forward, last_backward);
+    }
+#endif
+}
+
+#ifndef CUDA_ACC
+void wavelet_transform::make_plans(int nb, fftwf_plan *forward, fftwf_plan *backward)
+{
+    for (int i = 0; i < nplans; i++) {
+        int m = frame_npix[i];
+        int mhalf = m / 2 + 1;
+        int dimensions[2] = { m, m };
+        int embed_half[2] = { m, mhalf };
+        int embed_real[2] = { m, 2 * mhalf };
+        int howmany = pyramid ? nb : nb * nslots;
+        fftwf_complex *frame = fft_frame + (pyramid ? slot_offset[i] : 0);
+        forward[i]  = fftwf_plan_many_dft_r2c(2, dimensions, howmany,
+                                              (float *) frame, embed_real, 1, 2 * m * mhalf,
+                                              frame, embed_half, 1, m * mhalf,
+                                              getPlannerFlags());
+        backward[i] = fftwf_plan_many_dft_c2r(2, dimensions, howmany,
+                                              frame, embed_half, 1, m * mhalf,
+                                              (float *) frame, embed_real, 1, 2 * m * mhalf,
+                                              getPlannerFlags());
+    }
+}
+
+void wavelet_transform::execute_plans(fftwf_plan *plans)
+{
+    double t0 = omp_get_wtime();
+    for (int i = 0; i < nplans; i++) {
+        fftwf_execute(plans[i]);
+    }
+    fft_time += omp_get_wtime() - t0;
+}
+#endif
+
+// Sum over k of sinc(x + k pi)^12, which is pi periodic
+static double lemarie_sum(double x)
+{
+    x = remainder(x, M_PI);
+    double sum = 0;
+    for (int k = -8; k <= 8; k++) {
+        double u = x + k * M_PI;
+        double sinc = fabs(u) < 1e-8 ? 1.0 : sin(u) / u;
+        sum += pow(sinc, 12);
+    }
+    return sum;
+}
+
+// Modulus of the lowpass filter of the Battle-Lemarie wavelet built on
+// splines of degree 5, normalised to 1 at the origin
+static double lemarie_lowpass(double w)
+{
+    return pow(fabs(cos(w / 2)), 6) * sqrt(lemarie_sum(w / 2) / lemarie_sum(w));
+}
+
+void wavelet_transform::compute_frames()
+{
+    frames_data = (float *) fftwf_malloc(sizeof(float) * nframes * npix * nhalf);
+    for (int i = 0; i < nframes; i++) {
+        frames[i] = frames_data + i * npix * nhalf;
+    }
+
+    compute_analytic_frames(frames);
+
+#ifdef USE_SPARSE2D
+    // The Battle-Lemarie frames keep the normalisation of the Sparse2D
+    // filters, the closed form is only used in builds without Sparse2D
+    compute_lemarie_frames(frames + nscale);
+#endif
+}
+
+void wavelet_transform::compute_analytic_frames(float **out)
+{
+    // Responses along one axis: the B3-spline filter with holes of 2^s
+    // pixels at each scale s, and the Battle-Lemarie lowpass and highpass
+    double *h3 = (double *) malloc(sizeof(double) * nscale * npix);
+    double *lo = (double *) malloc(sizeof(double) * npix);
+    double *hi = (double *) malloc(sizeof(double) * npix);
+
+    #pragma omp parallel for
+    for (int k = 0; k < npix; k++) {
+        double w = 2 * M_PI * k / npix;
+        for (int s = 0; s < nscale - 1; s++) {
+            double ws = w * (1 << s);
+            h3[s * npix + k] = 3. / 8. + cos(ws) / 2. + cos(2 * ws) / 8.;
+        }
+        lo[k] = lemarie_lowpass(w);
+        hi[k] = lemarie_lowpass(w + M_PI);
+    }
+
+    #pragma omp parallel for
+    for (int ky = 0; ky < npix; ky++) {
+        for (int kx = 0; kx < nhalf; kx++) {
+            long ind = ky * nhalf + kx;
+
+            // Starlet frames, differences between successive smoothings
+            double phi = 1.0;
+            for (int s = 0; s < nscale - 1; s++) {
+                double h = h3[s * npix + kx] * h3[s * npix + ky];
+                out[s][ind] = phi * (1.0 - h) / npix;
+                phi *= h;
+            }
+            out[nscale - 1][ind] = phi / npix;
+
+            // Detail bands of the first scale of the undecimated Mallat transform
+            out[nscale][ind]     = hi[ky] * lo[kx] / npix;
+            out[nscale + 1][ind] = lo[ky] * hi[kx] / npix;
+            out[nscale + 2][ind] = hi[ky] * hi[kx] / npix;
+        }
+    }
+
+    free(h3);
+    free(lo);
+    free(hi);
+}
+
+void wavelet_transform::compute_reference_frames(float *ref)
+{
+    // The atoms are real so their spectra are Hermitian, only the half
+    // spectra of the frames are computed and stored
+    double *atom = (double *) fftw_malloc(sizeof(double) * npix * npix);
+    fftw_complex *frame = fftw_alloc_complex(npix * nhalf);
+    fftw_plan plan  = fftw_plan_dft_r2c_2d(npix, npix, atom, frame, FFTW_ESTIMATE);
+
     // We extract atoms for each frame
     starlet_2d star(npix, npix, nscale);
 
-    dblarray image(npix, npix);
-    image.init(0);
-    image(npix / 2, npix / 2) = 1.0;
-    dblarray alphaStar(npix, npix, nscale);
-    star.transform_gen1(image.buffer(), alphaStar.buffer());
+    double *image = (double *) calloc(npix * npix, sizeof(double));
+    double *alphaStar = (double *) malloc(sizeof(double) * npix * npix * nscale);
+    image[(npix / 2) * npix + npix / 2] = 1.0;
+    star.transform_gen1(image, alphaStar);
 
     for (int i = 0; i < nscale; i++) {
         for (long ind = 0; ind < npix * npix; ind++) {
-            frame[ind][0] = alphaStar.buffer()[i * npix * npix + ind];
-            frame[ind][1] = 0;
+            atom[ind] = alphaStar[i * npix * npix + ind];
         }
 
         fftw_execute(plan);
 
-        for (long ind = 0; ind < npix * npix; ind++) {
-            frames[i][ind] = sqrt(frame[ind][0] * frame[ind][0] + frame[ind][1] * frame[ind][1])/ npix;
+        for (long ind = 0; ind < npix * nhalf; ind++) {
+            ref[i * npix * nhalf + ind] = sqrt(frame[ind][0] * frame[ind][0] + frame[ind][1] * frame[ind][1])/ npix;
         }
     }
+    free(image);
+    free(alphaStar);
+
+    fftw_free(atom);
+    fftw_free(frame);
+    fftw_destroy_plan(plan);
+}
+
+#ifdef USE_SPARSE2D
+void wavelet_transform::compute_lemarie_frames(float **out)
+{
+    double *atom = (double *) fftw_malloc(sizeof(double) * npix * npix);
+    fftw_complex *frame = fftw_alloc_complex(npix * nhalf);
+    fftw_plan plan  = fftw_plan_dft_r2c_2d(npix, npix, atom, frame, FFTW_ESTIMATE);
 
     MultiResol mr;
     FilterAnaSynt FAS;
@@ -91,70 +401,156 @@ wavelet_transform::wavelet_transform(int npix, int nscale, int nlp):
             for (long y = 0; y < npix; y++) {
                 int k2 = y - npix / 2;
                 k2 = k2 < 0 ? npix + k2 : k2;
-                frame[x + npix * y][0] = im.buffer()[k1 + npix * k2];
-                frame[x + npix * y][1] = 0;
+                atom[x + npix * y] = im.buffer()[k1 + npix * k2];
             }
         }
 
         fftw_execute(plan);
 
-        for (long ind = 0; ind < npix * npix ; ind++) {
-            frames[i + nscale][ind] = sqrt(frame[ind][0] * frame[ind][0] + frame[ind][1] * frame[ind][1])/ npix;
+        for (long ind = 0; ind < npix * nhalf; ind++) {
+            out[i][ind] = sqrt(frame[ind][0] * frame[ind][0] + frame[ind][1] * frame[ind][1])/ npix;
         }
     }
 
+    fftw_free(atom);
     fftw_free(frame);
     fftw_destroy_plan(plan);
+}
+#endif
 
-    // Allocate batch wavelet transform either using fftw or CUDA
-    fft_frame = fftwf_alloc_complex(npix * npix * nlp * nframes);
+bool wavelet_transform::check_frames()
+{
+    long nframe = ((long) npix) * nhalf;
+    float *ref = (float *) malloc(sizeof(float) * nscale * nframe);
+    compute_reference_frames(ref);
 
-    int dimensions[2] = { npix, npix };
-    int rank = 2;
+    // Both constructions are rounded to float, so that each coefficient of
+    // the starlet frames can differ by at most one rounding
+    double diff = 0, norm = 0;
+    for (int i = 0; i < nscale; i++) {
+        for (long ind = 0; ind < nframe; ind++) {
+            double d = frames[i][ind] - ref[i * nframe + ind];
+            diff += d * d;
+            norm += ref[i * nframe + ind] * ref[i * nframe + ind];
+        }
+    }
+    free(ref);
+    double err_starlet = sqrt(diff / norm);
+    std::cout << "Relative difference between analytic and impulse response starlet frames: " << err_starlet << std::endl;
 
-#ifdef CUDA_ACC
-    cufftResult ret = cufftCreate(&fft_plan);
+#ifdef USE_SPARSE2D
+    // The Battle-Lemarie frames in use are the Sparse2D ones, the closed form
+    // used in builds without Sparse2D is only reported
+    float *analytic = (float *) malloc(sizeof(float) * nframes * nframe);
+    float **analytic_frames = new float*[nframes];
+    for (int i = 0; i < nframes; i++) {
+        analytic_frames[i] = analytic + i * nframe;
+    }
+    compute_analytic_frames(analytic_frames);
 
-    // Look for the number of available GPUs
-    getDeviceCount(&nGPU);
-    getGPUs(whichGPUs);
-        
-    std::cout << "Performing wavelet transform using " << nGPU << " GPUs" <<std::endl; 
-    // 2 cases: Single GPU or Multiple GPUs
-    if(nGPU > 1){
+    diff = 0;
+    norm = 0;
+    for (int i = nscale; i < nframes; i++) {
+        for (long ind = 0; ind < nframe; ind++) {
+            double d = analytic_frames[i][ind] - frames[i][ind];
+            diff += d * d;
+            norm += frames[i][ind] * frames[i][ind];
+        }
+    }
+    std::cout << "Relative difference between closed form and Sparse2D Battle-Lemarie frames: " << sqrt(diff / norm) << std::endl;
+    delete[] analytic_frames;
+    free(analytic);
+#endif
 
-        ret =cufftXtSetGPUs(fft_plan , nGPU, whichGPUs);
-        if(ret != 0) std::cout <<"set gpus" << ret << std::endl;
-        
-        ret =cufftMakePlanMany(fft_plan, rank, dimensions,
-                        NULL, 1, npix*npix, NULL, 1, npix*npix,
-                        CUFFT_C2C, nlp * nframes, worksize);
-        if(ret != 0) std::cout <<"make plan " << ret << std::endl;
-        
-        ret = cufftXtMalloc(fft_plan, &d_frameXt, CUFFT_XT_FORMAT_INPLACE);
-        if(ret != 0) std::cout <<"malloc " << ret << std::endl;
-     }else{
-         
-        // Select GPU
-        cudaSetDevice(whichGPUs[0]);
+    return err_starlet < 1e-6;
+}
 
-        ret =cufftMakePlanMany(fft_plan, rank, dimensions,
-                        NULL, 1, npix*npix, NULL, 1, npix*npix,
-                        CUFFT_C2C, nlp * nframes, worksize);
-        if(ret != 0) std::cout <<"make plan " << ret << std::endl;
-        
-        cudaMalloc(&d_frame, sizeof(cufftComplex)*nlp*nframes*npix*npix);
-     }
-#else
-    plan_forward = fftwf_plan_many_dft(rank, dimensions, nlp * nframes,
-                                      fft_frame, NULL, 1, npix*npix,
-                                      fft_frame, NULL, 1, npix*npix,
-                                      FFTW_FORWARD, FFTW_MEASURE);
-    plan_backward = fftwf_plan_many_dft(rank, dimensions, nlp * nframes,
-                                       fft_frame, NULL, 1, npix*npix,
-                                       fft_frame, NULL, 1, npix*npix,
-                                       FFTW_BACKWARD, FFTW_MEASURE);
-#endif
+std::string wavelet_transform::get_frames_file(std::string dir)
+{
+    std::stringstream fileName;
+    fileName << dir << "/wavelet_frames_" << npix << "_" << nscale << "_" << frames_filter
+             << "_v" << frames_version << ".bin";
+    return fileName.str();
+}
+
+void wavelet_transform::get_frames_header(frames_header *header)
+{
+    memset(header, 0, sizeof(frames_header));
+    strncpy(header->magic, "GLIMPSEW", sizeof(header->magic));
+    header->version = frames_version;
+    header->endian  = 0x01020304;
+    header->npix    = npix;
+    header->nscale  = nscale;
+    header->nframes = nframes;
+    header->nhalf   = nhalf;
+    strncpy(header->filter, frames_filter, sizeof(header->filter) - 1);
+}
+
+bool wavelet_transform::load_frames(std::string fileName)
+{
+    if (fileName.empty()) {
+        return false;
+    }
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // The size and the header must both match, otherwise the frames are
+    // recomputed and the file replaced
+    size_t size = sizeof(frames_header) + sizeof(float) * nframes * npix * nhalf;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t) size) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    frames_header header;
+    get_frames_header(&header);
+    if (memcmp(map, &header, sizeof(frames_header)) != 0) {
+        munmap(map, size);
+        return false;
+    }
+
+    frames_map = map;
+    frames_map_size = size;
+    float *data = (float *)((char *) map + sizeof(frames_header));
+    for (int i = 0; i < nframes; i++) {
+        frames[i] = data + i * npix * nhalf;
+    }
+    std::cout << "Loaded wavelet frames from " << fileName << std::endl;
+    return true;
+}
+
+void wavelet_transform::save_frames(std::string fileName)
+{
+    if (fileName.empty()) {
+        return;
+    }
+
+    // Written to a temporary file first, so that concurrent jobs never map
+    // a partially written file
+    std::stringstream tmpName;
+    tmpName << fileName << "." << getpid();
+    FILE *file = fopen(tmpName.str().c_str(), "wb");
+    if (file == NULL) {
+        std::cout << "Warning: Could not save the wavelet frames to " << fileName << std::endl;
+        return;
+    }
+    frames_header header;
+    get_frames_header(&header);
+    bool saved = fwrite(&header, sizeof(frames_header), 1, file) == 1;
+    saved = saved && fwrite(frames_data, sizeof(float), ((size_t) nframes) * npix * nhalf, file) == ((size_t) nframes) * npix * nhalf;
+    saved = (fclose(file) == 0) && saved;
+    saved = saved && rename(tmpName.str().c_str(), fileName.c_str()) == 0;
+    if (! saved) {
+        remove(tmpName.str().c_str());
+        std::cout << "Warning: Could not save the wavelet frames to " << fileName << std::endl;
+    }
 }
 
 wavelet_transform::~wavelet_transform()
@@ -169,32 +565,73 @@ wavelet_transform::~wavelet_transform()
     cufftDestroy(fft_plan);
 
 #else
-    fftwf_destroy_plan(plan_backward);
-    fftwf_destroy_plan(plan_forward);
+    for (int i = 0; i < nplans; i++) {
+        fftwf_destroy_plan(batch_backward[i]);
+        fftwf_destroy_plan(batch_forward[i]);
+        if (last_forward != NULL) {
+            fftwf_destroy_plan(last_backward[i]);
+            fftwf_destroy_plan(last_forward[i]);
+        }
+    }
+    delete[] batch_backward;
+    delete[] batch_forward;
+    delete[] last_backward;
+    delete[] last_forward;
 
 #endif
 
     fftwf_free(fft_frame);
-    for (int i = 0; i < nframes; i++) {
-        free(frames[i]);
+    if (frames_map != NULL) {
+        munmap(frames_map, frames_map_size);
+    } else {
+        fftwf_free(frames_data);
     }
     delete[] frames;
+    delete[] frame_npix;
+    delete[] frame_offset;
+    delete[] slot_offset;
+    if (frame_fft != NULL) {
+        for (int i = 0; i < nframes; i++) {
+            fftwf_destroy_plan(frame_backward[i]);
+            fftwf_destroy_plan(frame_forward[i]);
+        }
+        delete[] frame_backward;
+        delete[] frame_forward;
+        fftwf_free(frame_fft);
+    }
+    free(atrous_tmp);
+    free(atrous_out);
 }
 
 void wavelet_transform::transform(fftwf_complex *image, float *alpha)
 {
+#ifdef CUDA_ACC
+    // Full spectra of the frames, the negative frequencies of the image are
+    // the conjugates of the stored ones
     #pragma omp parallel
     for (int z = 0; z < nlp; z++) {
         for (int i = 0; i < nframes; i++) {
+            fftwf_complex *frame = fft_frame + i * npix * npix + z * npix * npix * nframes;
+            fftwf_complex *im = image + z * npix * nhalf;
+
             #pragma omp for
-            for (long ind = 0; ind < npix * npix; ind++) {
-                fft_frame[ind + i * npix * npix + z * npix * npix * nframes][0] = image[ind + z * npix * npix][0] * frames[i][ind];
-                fft_frame[ind + i * npix * npix + z * npix * npix * nframes][1] = image[ind + z * npix * npix][1] * frames[i][ind];
+            for (int ky = 0; ky < npix; ky++) {
+                for (int kx = 0; kx < npix; kx++) {
+                    long ind = ky * npix + kx;
+                    if (kx < nhalf) {
+                        frame[ind][0] = im[ky * nhalf + kx][0] * frames[i][ky * nhalf + kx];
+                        frame[ind][1] = im[ky * nhalf + kx][1] * frames[i][ky * nhalf + kx];
+                    } else {
+                        long sym = ((npix - ky) % npix) * nhalf + (npix - kx);
+                        frame[ind][0] =  im[sym][0] * frames[i][sym];
+                        frame[ind][1] = -im[sym][1] * frames[i][sym];
+                    }
+                }
             }
         }
     }
 
-#ifdef CUDA_ACC
+    double t0 = omp_get_wtime();
     if(nGPU>1){
         cufftXtMemcpy(fft_plan, d_frameXt, fft_frame, CUFFT_COPY_HOST_TO_DEVICE);
         cufftXtExecDescriptorC2C(fft_plan, d_frameXt, d_frameXt, CUFFT_INVERSE);
@@ -204,9 +641,7 @@ void wavelet_transform::transform(fftwf_complex *image, float *alpha)
         cufftExecC2C(fft_plan,d_frame,d_frame, CUFFT_INVERSE);
         cudaMemcpy(fft_frame, d_frame, sizeof(cufftComplex)* npix*npix*nlp*nframes, cudaMemcpyDeviceToHost);
     }
-#else
-    fftwf_execute(plan_backward);
-#endif
+    fft_time += omp_get_wtime() - t0;
 
     #pragma omp parallel
     for (int z = 0; z < nlp; z++) {
@@ -217,17 +652,73 @@ void wavelet_transform::transform(fftwf_complex *image, float *alpha)
             }
         }
     }
+#else
+    if (pyramid) {
+        pyramid_transform(image, alpha);
+        return;
+    }
+
+    for (int z0 = 0; z0 < nlp; z0 += nbatch) {
+        int nb = std::min(nbatch, nlp - z0);
+
+        // Spectra of each FFT slot, in direct mode the first slot holds the
+        // image itself and the others the Battle-Lemarie frames
+        #pragma omp parallel
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nslots; i++) {
+                fftwf_complex *frame = fft_frame + i * npix * nhalf + (z - z0) * npix * nhalf * nslots;
+                fftwf_complex *im = image + z * npix * nhalf;
+                float *mult = direct ? (i == 0 ? NULL : frames[nscale - 1 + i]) : frames[i];
+
+                #pragma omp for
+                for (int ky = 0; ky < npix; ky++) {
+                    for (int kx = 0; kx < nhalf; kx++) {
+                        float m = mult == NULL ? 1.0f : mult[ky * nhalf + kx];
+                        frame[ky * nhalf + kx][0] = im[ky * nhalf + kx][0] * m;
+                        frame[ky * nhalf + kx][1] = im[ky * nhalf + kx][1] * m;
+                    }
+                }
+            }
+        }
+
+        execute_plans(nb == nbatch ? batch_backward : last_backward);
+
+        #pragma omp parallel
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nslots; i++) {
+                float *frame = real_frame + 2 * (i * npix * nhalf + (z - z0) * npix * nhalf * nslots);
+                int  n = direct ? (i == 0 ? 0 : nscale - 1 + i) : i;
+                float *a = alpha + n * npix * npix + z * npix * npix * nframes;
+                float scale = direct && i == 0 ? 1.0f / npix : 1.0f;
+
+                #pragma omp for
+                for (int y = 0; y < npix; y++) {
+                    for (int x = 0; x < npix; x++) {
+                        a[y * npix + x] = frame[y * 2 * nhalf + x] * scale;
+                    }
+                }
+            }
+        }
+    }
+
+    if (direct) {
+        for (int z = 0; z < nlp; z++) {
+            atrous_transform(alpha + z * npix * npix * nframes);
+        }
+    }
+#endif
 }
 
 void wavelet_transform::trans_adjoint(float *alpha, fftwf_complex *image)
 {
 
     #pragma omp parallel for
-    for (long ind = 0; ind < npix * npix * nlp; ind++) {
+    for (long ind = 0; ind < npix * nhalf * nlp; ind++) {
         image[ind][0] = 0;
         image[ind][1] = 0;
     }
 
+#ifdef CUDA_ACC
     #pragma omp parallel
     for (int z = 0; z < nlp; z++) {
         for (int i = 0; i < nframes; i++) {
@@ -240,7 +731,7 @@ void wavelet_transform::trans_adjoint(float *alpha, fftwf_complex *image)
         }
     }
 
-#ifdef CUDA_ACC
+    double t0 = omp_get_wtime();
     if(nGPU>1){
         cufftXtMemcpy(fft_plan, d_frameXt, fft_frame, CUFFT_COPY_HOST_TO_DEVICE);
         cufftXtExecDescriptorC2C(fft_plan, d_frameXt, d_frameXt, CUFFT_FORWARD);
@@ -250,19 +741,611 @@ void wavelet_transform::trans_adjoint(float *alpha, fftwf_complex *image)
         cufftExecC2C(fft_plan,d_frame,d_frame, CUFFT_FORWARD);
         cudaMemcpy(fft_frame, d_frame, sizeof(cufftComplex)* npix*npix*nlp*nframes, cudaMemcpyDeviceToHost);
     }
-#else
-    fftwf_execute(plan_forward);
-#endif
+    fft_time += omp_get_wtime() - t0;
 
     #pragma omp parallel
     for (int z = 0; z < nlp; z++) {
         for (int i = 0; i < nframes; i++) {
+            fftwf_complex *frame = fft_frame + i * npix * npix + z * npix * npix * nframes;
+            fftwf_complex *im = image + z * npix * nhalf;
 
             #pragma omp for
-            for (long ind = 0; ind < npix * npix; ind++) {
-                image[ind + z * npix * npix][0] += fft_frame[ind + i * npix * npix + z * npix * npix * nframes][0] * frames[i][ind];
-                image[ind + z * npix * npix][1] += fft_frame[ind + i * npix * npix + z * npix * npix * nframes][1] * frames[i][ind];
+            for (int ky = 0; ky < npix; ky++) {
+                for (int kx = 0; kx < nhalf; kx++) {
+                    im[ky * nhalf + kx][0] += frame[ky * npix + kx][0] * frames[i][ky * nhalf + kx];
+                    im[ky * nhalf + kx][1] += frame[ky * npix + kx][1] * frames[i][ky * nhalf + kx];
+                }
+            }
+        }
+    }
+#else
+    if (pyramid) {
+        pyramid_trans_adjoint(alpha, image);
+        return;
+    }
+
+    for (int z0 = 0; z0 < nlp; z0 += nbatch) {
+        int nb = std::min(nbatch, nlp - z0);
+
+        for (int z = z0; z < z0 + nb; z++) {
+            // In direct mode the first slot receives the adjoint of the
+            // starlet frames
+            if (direct) {
+                atrous_trans_adjoint(alpha + z * npix * npix * nframes, atrous_out);
+            }
+
+            #pragma omp parallel
+            for (int i = 0; i < nslots; i++) {
+                float *frame = real_frame + 2 * (i * npix * nhalf + (z - z0) * npix * nhalf * nslots);
+                float *a = alpha + i * npix * npix + z * npix * npix * nframes;
+                float scale = 1.0f;
+
+                if (direct) {
+                    a = i == 0 ? atrous_out : alpha + (nscale - 1 + i) * npix * npix + z * npix * npix * nframes;
+                    scale = i == 0 ? 1.0f / npix : 1.0f;
+                }
+
+                #pragma omp for
+                for (int y = 0; y < npix; y++) {
+                    for (int x = 0; x < npix; x++) {
+                        frame[y * 2 * nhalf + x] = a[y * npix + x] * scale;
+                    }
+                }
+            }
+        }
+
+        execute_plans(nb == nbatch ? batch_forward : last_forward);
+
+        #pragma omp parallel
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nslots; i++) {
+                fftwf_complex *frame = fft_frame + i * npix * nhalf + (z - z0) * npix * nhalf * nslots;
+                fftwf_complex *im = image + z * npix * nhalf;
+                float *mult = direct ? (i == 0 ? NULL : frames[nscale - 1 + i]) : frames[i];
+
+                #pragma omp for
+                for (int ky = 0; ky < npix; ky++) {
+                    for (int kx = 0; kx < nhalf; kx++) {
+                        float m = mult == NULL ? 1.0f : mult[ky * nhalf + kx];
+                        im[ky * nhalf + kx][0] += frame[ky * nhalf + kx][0] * m;
+                        im[ky * nhalf + kx][1] += frame[ky * nhalf + kx][1] * m;
+                    }
+                }
+            }
+        }
+    }
+#endif
+}
+
+void wavelet_transform::compute_decimation()
+{
+    for (int i = 0; i < nframes; i++) {
+        // Energy of the frame, the columns 0 < kx < npix / 2 of the half
+        // spectrum stand for two frequencies
+        double total = 0;
+        for (int ky = 0; ky < npix; ky++) {
+            for (int kx = 0; kx < nhalf; kx++) {
+                double f = frames[i][ky * nhalf + kx];
+                total += (kx == 0 || 2 * kx == npix ? 1 : 2) * f * f;
+            }
+        }
+
+        // The frame is decimated by 2^d if it is negligible outside of the
+        // frequencies |k| < npix / 2^(d + 1) along both axes
+        int d = 0;
+        while (npix % (2 << d) == 0 && (npix >> (d + 1)) >= min_frame_npix) {
+            int m = npix >> (d + 1);
+            double outside = 0;
+            for (int ky = 0; ky < npix; ky++) {
+                int sy = ky < nhalf ? ky : ky - npix;
+                for (int kx = 0; kx < nhalf; kx++) {
+                    if (2 * abs(sy) >= m || 2 * kx >= m) {
+                        double f = frames[i][ky * nhalf + kx];
+                        outside += (kx == 0 || 2 * kx == npix ? 1 : 2) * f * f;
+                    }
+                }
+            }
+            if (outside > pyramid_tol * total) {
+                break;
+            }
+            d++;
+        }
+        frame_npix[i] = npix >> d;
+    }
+}
+
+void wavelet_transform::crop_frame(fftwf_complex *im, int i, fftwf_complex *frame)
+{
+    // The spectrum of the frame is cropped to the frequencies of its grid,
+    // the coefficients are then the samples of the band limited frame on the
+    // decimated grid. The Nyquist frequencies of a decimated grid are dropped
+    // as they stand for two frequencies of the full grid.
+    int m = frame_npix[i];
+    int mhalf = m / 2 + 1;
+
+    #pragma omp parallel for
+    for (int ky = 0; ky < m; ky++) {
+        long row = ((ky < mhalf ? ky : ky - m) + npix) % npix * nhalf;
+        for (int kx = 0; kx < mhalf; kx++) {
+            if (m < npix && (2 * ky == m || 2 * kx == m)) {
+                frame[ky * mhalf + kx][0] = 0;
+                frame[ky * mhalf + kx][1] = 0;
+            } else {
+                float f = frames[i][row + kx];
+                frame[ky * mhalf + kx][0] = im[row + kx][0] * f;
+                frame[ky * mhalf + kx][1] = im[row + kx][1] * f;
+            }
+        }
+    }
+}
+
+void wavelet_transform::pad_frame(fftwf_complex *frame, int i, fftwf_complex *im)
+{
+    // Distinct rows of a decimated grid fall on distinct rows of the image
+    int m = frame_npix[i];
+    int mhalf = m / 2 + 1;
+
+    #pragma omp parallel for
+    for (int ky = 0; ky < m; ky++) {
+        if (m < npix && 2 * ky == m) {
+            continue;
+        }
+        long row = ((ky < mhalf ? ky : ky - m) + npix) % npix * nhalf;
+        int  nx  = m < npix ? m / 2 : mhalf;
+        for (int kx = 0; kx < nx; kx++) {
+            float f = frames[i][row + kx];
+            im[row + kx][0] += frame[ky * mhalf + kx][0] * f;
+            im[row + kx][1] += frame[ky * mhalf + kx][1] * f;
+        }
+    }
+}
+
+void wavelet_transform::pyramid_transform(fftwf_complex *image, float *alpha)
+{
+    for (int z0 = 0; z0 < nlp; z0 += nbatch) {
+        int nb = std::min(nbatch, nlp - z0);
+
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nframes; i++) {
+                int m = frame_npix[i];
+                crop_frame(image + z * npix * nhalf, i, fft_frame + slot_offset[i] + (z - z0) * m * (m / 2 + 1));
+            }
+        }
+
+        execute_plans(nb == nbatch ? batch_backward : last_backward);
+
+        #pragma omp parallel
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nframes; i++) {
+                int m = frame_npix[i];
+                int mhalf = m / 2 + 1;
+                float *frame = real_frame + 2 * (slot_offset[i] + (z - z0) * m * mhalf);
+                float *a = alpha + frame_offset[i] + z * ncoeff;
+
+                #pragma omp for
+                for (int y = 0; y < m; y++) {
+                    for (int x = 0; x < m; x++) {
+                        a[y * m + x] = frame[y * 2 * mhalf + x];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void wavelet_transform::pyramid_trans_adjoint(float *alpha, fftwf_complex *image)
+{
+    for (int z0 = 0; z0 < nlp; z0 += nbatch) {
+        int nb = std::min(nbatch, nlp - z0);
+
+        #pragma omp parallel
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nframes; i++) {
+                int m = frame_npix[i];
+                int mhalf = m / 2 + 1;
+                float *frame = real_frame + 2 * (slot_offset[i] + (z - z0) * m * mhalf);
+                float *a = alpha + frame_offset[i] + z * ncoeff;
+
+                #pragma omp for
+                for (int y = 0; y < m; y++) {
+                    for (int x = 0; x < m; x++) {
+                        frame[y * 2 * mhalf + x] = a[y * m + x];
+                    }
+                }
+            }
+        }
+
+        execute_plans(nb == nbatch ? batch_forward : last_forward);
+
+        for (int z = z0; z < z0 + nb; z++) {
+            for (int i = 0; i < nframes; i++) {
+                int m = frame_npix[i];
+                pad_frame(fft_frame + slot_offset[i] + (z - z0) * m * (m / 2 + 1), i, image + z * npix * nhalf);
+            }
+        }
+    }
+}
+
+void wavelet_transform::init_frame_plans()
+{
+    // Spectra of one frame for all the lens planes
+    int mmax = *std::max_element(frame_npix, frame_npix + nframes);
+    frame_fft = fftwf_alloc_complex(mmax * (mmax / 2 + 1) * nlp);
+    frame_forward  = new fftwf_plan[nframes];
+    frame_backward = new fftwf_plan[nframes];
+    for (int i = 0; i < nframes; i++) {
+        int m = frame_npix[i];
+        int mhalf = m / 2 + 1;
+        int dimensions[2] = { m, m };
+        int embed_half[2] = { m, mhalf };
+        int embed_real[2] = { m, 2 * mhalf };
+        frame_forward[i]  = fftwf_plan_many_dft_r2c(2, dimensions, nlp,
+                                                    (float *) frame_fft, embed_real, 1, 2 * m * mhalf,
+                                                    frame_fft, embed_half, 1, m * mhalf,
+                                                    getPlannerFlags());
+        frame_backward[i] = fftwf_plan_many_dft_c2r(2, dimensions, nlp,
+                                                    frame_fft, embed_half, 1, m * mhalf,
+                                                    (float *) frame_fft, embed_real, 1, 2 * m * mhalf,
+                                                    getPlannerFlags());
+    }
+}
+
+void wavelet_transform::transform_frame(fftwf_complex *image, int i, float *alpha_frame)
+{
+    if (frame_fft == NULL) {
+        init_frame_plans();
+    }
+    int m = frame_npix[i];
+    int mhalf = m / 2 + 1;
+    float *frame = (float *) frame_fft;
+
+    for (int z = 0; z < nlp; z++) {
+        crop_frame(image + z * npix * nhalf, i, frame_fft + z * m * mhalf);
+    }
+
+    double t0 = omp_get_wtime();
+    fftwf_execute(frame_backward[i]);
+    fft_time += omp_get_wtime() - t0;
+
+    #pragma omp parallel for
+    for (long y = 0; y < m * nlp; y++) {
+        for (int x = 0; x < m; x++) {
+            alpha_frame[y * m + x] = frame[y * 2 * mhalf + x];
+        }
+    }
+}
+
+void wavelet_transform::trans_adjoint_frame(float *alpha_frame, int i, fftwf_complex *image)
+{
+    if (frame_fft == NULL) {
+        init_frame_plans();
+    }
+    int m = frame_npix[i];
+    int mhalf = m / 2 + 1;
+    float *frame = (float *) frame_fft;
+
+    #pragma omp parallel for
+    for (long y = 0; y < m * nlp; y++) {
+        for (int x = 0; x < m; x++) {
+            frame[y * 2 * mhalf + x] = alpha_frame[y * m + x];
+        }
+    }
+
+    double t0 = omp_get_wtime();
+    fftwf_execute(frame_forward[i]);
+    fft_time += omp_get_wtime() - t0;
+
+    for (int z = 0; z < nlp; z++) {
+        pad_frame(frame_fft + z * m * mhalf, i, image + z * npix * nhalf);
+    }
+}
+
+void wavelet_transform::atrous_smooth(const float *in, float *out, int step)
+{
+    const float h0 = 3. / 8.;
+    const float h1 = 1. / 4.;
+    const float h2 = 1. / 16.;
+
+    // B3-spline filter along y, whole rows are combined at once
+    #pragma omp parallel for
+    for (int y = 0; y < npix; y++) {
+        const float *rm2 = in + ((y - 2 * step) % npix + npix) % npix * npix;
+        const float *rm1 = in + ((y - step) % npix + npix) % npix * npix;
+        const float *r0  = in + y * npix;
+        const float *rp1 = in + (y + step) % npix * npix;
+        const float *rp2 = in + (y + 2 * step) % npix * npix;
+        float *t = atrous_tmp + y * npix;
+
+        #pragma omp simd
+        for (int x = 0; x < npix; x++) {
+            t[x] = h0 * r0[x] + h1 * (rm1[x] + rp1[x]) + h2 * (rm2[x] + rp2[x]);
+        }
+    }
+
+    // Same filter along x, only the borders need cyclic indices
+    int lo = std::min(2 * step, npix);
+    int hi = std::max(lo, npix - 2 * step);
+
+    #pragma omp parallel for
+    for (int y = 0; y < npix; y++) {
+        const float *t = atrous_tmp + y * npix;
+        float *o = out + y * npix;
+
+        for (int x = 0; x < lo; x++) {
+            o[x] = h0 * t[x] + h1 * (t[((x - step) % npix + npix) % npix] + t[(x + step) % npix])
+                   + h2 * (t[((x - 2 * step) % npix + npix) % npix] + t[(x + 2 * step) % npix]);
+        }
+
+        #pragma omp simd
+        for (int x = lo; x < hi; x++) {
+            o[x] = h0 * t[x] + h1 * (t[x - step] + t[x + step]) + h2 * (t[x - 2 * step] + t[x + 2 * step]);
+        }
+
+        for (int x = hi; x < npix; x++) {
+            o[x] = h0 * t[x] + h1 * (t[((x - step) % npix + npix) % npix] + t[(x + step) % npix])
+                   + h2 * (t[((x - 2 * step) % npix + npix) % npix] + t[(x + 2 * step) % npix]);
+        }
+    }
+}
+
+void wavelet_transform::atrous_transform(float *alpha)
+{
+    long npix2 = ((long) npix) * npix;
+
+    // Same as starlet_2d::transform_gen1, the first scale holds the image
+    for (int s = 0; s < nscale - 1; s++) {
+        float *c  = alpha + s * npix2;
+        float *cn = alpha + (s + 1) * npix2;
+
+        atrous_smooth(c, cn, 1 << s);
+
+        #pragma omp parallel for
+        for (long ind = 0; ind < npix2; ind++) {
+            c[ind] -= cn[ind];
+        }
+    }
+}
+
+void wavelet_transform::atrous_trans_adjoint(float *alpha, float *out)
+{
+    long npix2 = ((long) npix) * npix;
+
+    // Same as starlet_2d::trans_adjoint_gen1, out = H_s(out - w_s) + w_s
+    #pragma omp parallel for
+    for (long ind = 0; ind < npix2; ind++) {
+        out[ind] = alpha[(nscale - 1) * npix2 + ind];
+    }
+
+    for (int s = nscale - 2; s >= 0; s--) {
+        float *w = alpha + s * npix2;
+
+        #pragma omp parallel for
+        for (long ind = 0; ind < npix2; ind++) {
+            out[ind] -= w[ind];
+        }
+
+        atrous_smooth(out, out, 1 << s);
+
+        #pragma omp parallel for
+        for (long ind = 0; ind < npix2; ind++) {
+            out[ind] += w[ind];
+        }
+    }
+}
+
+std::string wavelet_transform::fastest_backend(int npix, int nscale, int nlp, std::string cache_dir, size_t max_scratch)
+{
+#ifdef CUDA_ACC
+    // The direct backend is not available on the GPU
+    return "fft";
+#else
+    double time_fft, time_direct;
+    {
+        wavelet_transform wav(npix, nscale, nlp, "fft", cache_dir, 0, max_scratch);
+        time_fft = wav.time_transform(3);
+    }
+    {
+        wavelet_transform wav(npix, nscale, nlp, "direct", cache_dir, 0, max_scratch);
+        time_direct = wav.time_transform(3);
+    }
+
+    std::string backend = time_direct < time_fft ? "direct" : "fft";
+    std::cout << "Wavelet transform and adjoint take " << time_fft << " s with the fft backend and "
+              << time_direct << " s with the direct backend, using " << backend << std::endl;
+    return backend;
+#endif
+}
+
+double wavelet_transform::time_transform(int nrep)
+{
+    long nimage = ((long) npix) * nhalf * nlp;
+    long ncoeff = ((long) npix) * npix * nframes * nlp;
+
+    // The timing does not depend on the values, a random image only avoids
+    // denormals
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-0.5f, 0.5f);
+    fftwf_complex *image = fftwf_alloc_complex(nimage);
+    for (long ind = 0; ind < nimage; ind++) {
+        image[ind][0] = uniform(rng);
+        image[ind][1] = uniform(rng);
+    }
+    float *alpha = (float *) malloc(sizeof(float) * ncoeff);
+
+    // The first run allocates the scratch buffers and is not timed
+    transform(image, alpha);
+    trans_adjoint(alpha, image);
+
+    double start = omp_get_wtime();
+    for (int r = 0; r < nrep; r++) {
+        transform(image, alpha);
+        trans_adjoint(alpha, image);
+    }
+    double elapsed = (omp_get_wtime() - start) / nrep;
+
+    free(alpha);
+    fftwf_free(image);
+
+    return elapsed;
+}
+
+bool wavelet_transform::check_backend()
+{
+    if (pyramid) {
+        return check_pyramid();
+    }
+
+    // Reference transform using the other backend
+    wavelet_transform ref(npix, nscale, nlp, direct ? "fft" : "direct", cache_dir, 0, max_scratch);
+
+    long nimage = ((long) npix) * nhalf * nlp;
+    long ncoeff = ((long) npix) * npix * nframes * nlp;
+
+    // Half spectrum of a random real image, with a fixed seed so that the
+    // check is reproducible
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-0.5f, 0.5f);
+    float *im = (float *) malloc(sizeof(float) * npix * npix);
+    fftwf_complex *image  = fftwf_alloc_complex(nimage);
+    fftwf_complex *image2 = fftwf_alloc_complex(nimage);
+    fftwf_plan plan = fftwf_plan_dft_r2c_2d(npix, npix, im, image, FFTW_ESTIMATE);
+    for (int z = 0; z < nlp; z++) {
+        for (long ind = 0; ind < npix * npix; ind++) {
+            im[ind] = uniform(rng);
+        }
+        fftwf_execute_dft_r2c(plan, im, image + z * npix * nhalf);
+    }
+    fftwf_destroy_plan(plan);
+
+    float *alpha  = (float *) malloc(sizeof(float) * ncoeff);
+    float *alpha2 = (float *) malloc(sizeof(float) * ncoeff);
+
+    transform(image, alpha);
+    ref.transform(image, alpha2);
+
+    double diff = 0, norm = 0;
+    for (long ind = 0; ind < ncoeff; ind++) {
+        diff += pow(alpha[ind] - alpha2[ind], 2);
+        norm += pow(alpha2[ind], 2);
+    }
+    double err_transform = sqrt(diff / norm);
+
+    trans_adjoint(alpha2, image);
+    ref.trans_adjoint(alpha2, image2);
+
+    diff = 0;
+    norm = 0;
+    for (long ind = 0; ind < nimage; ind++) {
+        diff += pow(image[ind][0] - image2[ind][0], 2) + pow(image[ind][1] - image2[ind][1], 2);
+        norm += pow(image2[ind][0], 2) + pow(image2[ind][1], 2);
+    }
+    double err_adjoint = sqrt(diff / norm);
+
+    std::cout << " Relative difference between " << (direct ? "direct" : "fft") << " and "
+              << (direct ? "fft" : "direct") << " wavelet backends, transform: " << err_transform
+              << " adjoint: " << err_adjoint << std::endl;
+
+    free(im);
+    free(alpha);
+    free(alpha2);
+    fftwf_free(image);
+    fftwf_free(image2);
+
+    return err_transform < 1e-4 && err_adjoint < 1e-4;
+}
+
+bool wavelet_transform::check_pyramid()
+{
+    // Reference undecimated transform
+    wavelet_transform ref(npix, nscale, nlp, "fft", cache_dir, 0, max_scratch);
+
+    long nimage = ((long) npix) * nhalf * nlp;
+    long nref   = ((long) npix) * npix * nframes;
+
+    // Half spectrum of a random real image, with a fixed seed so that the
+    // check is reproducible
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-0.5f, 0.5f);
+    float *im = (float *) malloc(sizeof(float) * npix * npix);
+    fftwf_complex *image  = fftwf_alloc_complex(nimage);
+    fftwf_complex *image2 = fftwf_alloc_complex(nimage);
+    fftwf_complex *image3 = fftwf_alloc_complex(nimage);
+    fftwf_plan plan = fftwf_plan_dft_r2c_2d(npix, npix, im, image, FFTW_ESTIMATE);
+    for (int z = 0; z < nlp; z++) {
+        for (long ind = 0; ind < npix * npix; ind++) {
+            im[ind] = uniform(rng);
+        }
+        fftwf_execute_dft_r2c(plan, im, image + z * npix * nhalf);
+    }
+    fftwf_destroy_plan(plan);
+
+    float *alpha  = (float *) malloc(sizeof(float) * ncoeff * nlp);
+    float *alpha2 = (float *) malloc(sizeof(float) * nref * nlp);
+    float *beta   = (float *) malloc(sizeof(float) * ncoeff * nlp);
+    float *beta2  = (float *) calloc(nref * nlp, sizeof(float));
+
+    // The decimated frames are compared with the samples of the undecimated
+    // ones, they only differ by the energy outside of the decimated bands.
+    // The adjoint of the decimation fills the other pixels with zeros.
+    transform(image, alpha);
+    ref.transform(image, alpha2);
+
+    double diff = 0, norm = 0;
+    for (int z = 0; z < nlp; z++) {
+        for (int i = 0; i < nframes; i++) {
+            int m = frame_npix[i];
+            int step = npix / m;
+            for (int y = 0; y < m; y++) {
+                for (int x = 0; x < m; x++) {
+                    long ind  = z * ncoeff + frame_offset[i] + y * m + x;
+                    long ind2 = z * nref + ((long) i) * npix * npix + ((long) y) * step * npix + x * step;
+                    diff += pow(alpha[ind] - alpha2[ind2], 2);
+                    norm += pow(alpha2[ind2], 2);
+                    beta[ind]   = uniform(rng);
+                    beta2[ind2] = beta[ind];
+                }
             }
         }
     }
+    double err_transform = sqrt(diff / norm);
+
+    trans_adjoint(beta, image2);
+    ref.trans_adjoint(beta2, image3);
+
+    diff = 0;
+    norm = 0;
+    for (long ind = 0; ind < nimage; ind++) {
+        diff += pow(image2[ind][0] - image3[ind][0], 2) + pow(image2[ind][1] - image3[ind][1], 2);
+        norm += pow(image3[ind][0], 2) + pow(image3[ind][1], 2);
+    }
+    double err_adjoint = sqrt(diff / norm);
+
+    // Dot product test, the columns 0 < kx < npix / 2 of the half spectra
+    // stand for two frequencies
+    double lhs = 0, rhs = 0;
+    for (long ind = 0; ind < ncoeff * nlp; ind++) {
+        lhs += alpha[ind] * beta[ind];
+    }
+    for (long ind = 0; ind < nimage; ind++) {
+        long kx = ind % nhalf;
+        double w = (kx == 0 || 2 * kx == npix) ? 1 : 2;
+        rhs += w * (image[ind][0] * image2[ind][0] + image[ind][1] * image2[ind][1]);
+    }
+    double err_dot = fabs(lhs - rhs) / fabs(lhs);
+
+    std::cout << " Relative difference between pyramidal and undecimated wavelet transforms, transform: "
+              << err_transform << " adjoint: " << err_adjoint << " dot product test: " << err_dot << std::endl;
+
+    free(im);
+    free(alpha);
+    free(alpha2);
+    free(beta);
+    free(beta2);
+    fftwf_free(image);
+    fftwf_free(image2);
+    fftwf_free(image3);
+
+    // The differences with the undecimated transform are bounded by the
+    // energy of the frames left outside of the decimated bands
+    return err_dot < 1e-4 && err_transform < 10 * sqrt(pyramid_tol) && err_adjoint < 10 * sqrt(pyramid_tol);
 }
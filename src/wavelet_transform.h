@@ -35,6 +35,9 @@
 #ifndef WAVELET_TRANSFORM_H
 #define WAVELET_TRANSFORM_H
 
+#include <string>
+#include <algorithm>
+#include <stdint.h>
 #include <fftw3.h>
 
 #ifdef CUDA_ACC
@@ -43,12 +46,47 @@
 #include "gpu_utils.h"
 #endif
 
+/*! Header of the cached filter bank, followed by the half spectra of the frames
+ *
+ */
+struct frames_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    int32_t npix, nscale, nframes, nhalf;
+    char filter[32];
+};
+
 class wavelet_transform
 {
     int npix, nscale, nframes, nlp;
+    int nhalf;                          /*!< Number of stored frequencies along x for the half spectra */
 
-    float **frames;
+    float **frames;                     /*!< Half spectra of the frames, npix x nhalf */
+    float *frames_data;                 /*!< Storage of the frames when computed at startup */
+    void *frames_map;                   /*!< Mapping of the cache file when the frames are read from it */
+    size_t frames_map_size;
+    std::string cache_dir;              /*!< Directory of the cached frames, empty to disable the cache */
     fftwf_complex *fft_frame;
+    float *real_frame;                  /*!< Real frames, sharing the memory of fft_frame */
+
+    bool direct;                        /*!< Flag indicating whether the starlet frames are computed in direct space */
+    int nslots;                         /*!< Number of images transformed by FFT for each lens plane */
+    float *atrous_tmp;                  /*!< Scratch image for the a trous convolutions */
+    float *atrous_out;                  /*!< Adjoint of the starlet frames of the current lens plane */
+    double fft_time;                    /*!< Time spent in the batched FFTs, in seconds */
+
+    bool pyramid;                       /*!< Flag indicating whether the coarse frames are decimated */
+    double pyramid_tol;                 /*!< Fraction of the energy of a frame allowed outside of its decimated band */
+    int *frame_npix;                    /*!< Size of the grid of each frame */
+    long *frame_offset;                 /*!< Offset of each frame in the coefficients of a lens plane */
+    long *slot_offset;                  /*!< Offset of the spectra of each frame in a batch, in pyramidal mode */
+    long ncoeff;                        /*!< Number of coefficients for each lens plane */
+    size_t max_scratch;                 /*!< Maximum size of fft_frame in bytes, 0 for no limit */
+    fftwf_complex *frame_fft;           /*!< Spectra of a single frame, allocated on the first call to transform_frame */
+    fftwf_plan *frame_forward, *frame_backward;
+    int nbatch;                         /*!< Number of lens planes transformed at once */
 
 #ifdef CUDA_ACC
     cudaLibXtDesc *d_frameXt;
@@ -58,15 +96,124 @@ class wavelet_transform
     int whichGPUs[MAX_GPUS];
     size_t worksize[MAX_GPUS];
 #else
-    fftwf_plan plan_forward, plan_backward;
+    int nplans;                         /*!< Number of plans for each batch, one for each frame in pyramidal mode */
+    fftwf_plan *batch_forward, *batch_backward;
+    fftwf_plan *last_forward, *last_backward;   /*!< Plans for the last batch if it is smaller, NULL otherwise */
+
+    /*! Makes the plans transforming a batch of nb lens planes
+     *
+     */
+    void make_plans(int nb, fftwf_plan *forward, fftwf_plan *backward);
+
+    /*! Executes the plans of a batch, accumulating the time spent in fft_time
+     *
+     */
+    void execute_plans(fftwf_plan *plans);
+#endif
+
+    /*! Computes the frames, the Battle-Lemarie ones from Sparse2D if available.
+     *
+     */
+    void compute_frames();
+
+    /*! Computes the starlet and Battle-Lemarie frames from their closed form frequency responses.
+     *
+     */
+    void compute_analytic_frames(float **out);
+
+    /*! Computes the starlet frames from the spectra of the impulse responses of starlet_2d.
+     *
+     */
+    void compute_reference_frames(float *ref);
+
+#ifdef USE_SPARSE2D
+    /*! Computes the three Battle-Lemarie frames from the impulse responses of the Sparse2D filters.
+     *
+     */
+    void compute_lemarie_frames(float **out);
 #endif
 
+    /*! Returns the name of the cache file for these frames, in directory dir.
+     *
+     */
+    std::string get_frames_file(std::string dir);
+
+    /*! Fills the header identifying these frames in the cache file.
+     *
+     */
+    void get_frames_header(frames_header *header);
+
+    /*! Maps the frames from the cache file, returns false if the file is missing or does not match.
+     *
+     */
+    bool load_frames(std::string fileName);
+
+    /*! Saves the frames to the cache file.
+     *
+     */
+    void save_frames(std::string fileName);
+
+    /*! Sets the grid of each frame, decimated by the largest power of two
+     * for which the energy of the frame outside of the band of the grid stays
+     * below pyramid_tol.
+     */
+    void compute_decimation();
+
+    /*! Multiplies the half spectrum of one lens plane by frame i, cropped to
+     * the band of the grid of the frame.
+     */
+    void crop_frame(fftwf_complex *im, int i, fftwf_complex *frame);
+
+    /*! Adjoint of crop_frame, accumulated in im.
+     *
+     */
+    void pad_frame(fftwf_complex *frame, int i, fftwf_complex *im);
+
+    /*! Makes the plans of transform_frame and trans_adjoint_frame.
+     *
+     */
+    void init_frame_plans();
+
+    /*! Transform and adjoint in pyramidal mode, each frame is cropped to the
+     * band of its grid before the inverse FFT.
+     */
+    void pyramid_transform(fftwf_complex *image, float *alpha);
+    void pyramid_trans_adjoint(float *alpha, fftwf_complex *image);
+
+    /*! Compares the pyramidal transform with the undecimated one, and checks
+     * that trans_adjoint is the adjoint of transform.
+     */
+    bool check_pyramid();
+
+    /*! Cyclic B3-spline convolution with holes of size step, in may be the same as out.
+     *
+     */
+    void atrous_smooth(const float *in, float *out, int step);
+
+    /*! Starlet frames of the image held in the first frame of alpha, computed in place.
+     *
+     */
+    void atrous_transform(float *alpha);
+
+    /*! Adjoint of atrous_transform.
+     *
+     */
+    void atrous_trans_adjoint(float *alpha, float *out);
 
 public:
     /*! Initialise Fourier based wavelet transform
-     *
+     * The starlet frames are computed as Fourier multipliers if backend is
+     * "fft", or in direct space with the a trous algorithm if it is "direct",
+     * see fastest_backend to choose between them at runtime. The direct backend only applies to transform and trans_adjoint, the
+     * per frame transforms always use the Fourier multipliers.
+     * The frames are cached in cache_dir between runs, unless it is empty.
+     * If pyramid_tol is positive, the coarse frames are decimated as long as
+     * the fraction of their energy lost stays below pyramid_tol, which
+     * requires the fft backend.
+     * The lens planes are transformed in batches so that the FFT buffer fits
+     * in max_scratch bytes, unless it is 0.
      */
-    wavelet_transform ( int npix, int nscale, int nlp=1 );
+    wavelet_transform ( int npix, int nscale, int nlp=1, std::string backend="fft", std::string cache_dir="", double pyramid_tol=0, size_t max_scratch=0 );
 
     /*! Destructor
      *
@@ -80,22 +227,97 @@ public:
         return nframes;
     };
     
+    /*! Returns the number of wavelet coefficients for each lens plane
+     *
+     */
+    long get_ncoeff() {
+        return ncoeff;
+    }
+
+    /*! Returns the offset of frame i in the coefficients of a lens plane,
+     * frame i covers [get_frame_offset(i), get_frame_offset(i + 1))
+     */
+    long get_frame_offset(int i) {
+        return frame_offset[i];
+    }
+
+    /*! Returns the size of the grid of frame i, npix unless it is decimated
+     *
+     */
+    int get_frame_npix(int i) {
+        return frame_npix[i];
+    }
+
+    /*! Returns the frame holding coefficient ind of a lens plane
+     *
+     */
+    int get_frame(long ind) {
+        return std::upper_bound(frame_offset, frame_offset + nframes + 1, ind) - frame_offset - 1;
+    }
+
+    /*! Returns true if the coarse frames are decimated
+     *
+     */
+    bool is_pyramid() {
+        return pyramid;
+    }
+
     /*! Returns the array with wavelet transform coefficients
-     * 
+     * Each frame is stored as a npix x nhalf half spectrum.
      */
     float ** get_frames() {
          return frames;
     }
 
-    /*! Performs forward wavelet transform.
+    /*! Returns the time spent in the batched FFTs since the creation of the transform, in seconds
      *
      */
+    double get_fft_time() {
+        return fft_time;
+    }
+
+    /*! Performs forward wavelet transform.
+     * The image is given as the half spectrum of a real to complex FFT for each lens plane.
+     */
     void transform ( fftwf_complex *image, float *alpha );
 
     /*! Performs adjoint wavelet transform.
      *
      */
     void trans_adjoint ( float *alpha, fftwf_complex *image );
+
+    /*! Computes the coefficients of frame i alone, for all the lens planes.
+     * alpha_frame holds get_frame_npix(i)^2 coefficients for each lens plane,
+     * computed from the Fourier multiplier of the frame whatever the backend.
+     */
+    void transform_frame ( fftwf_complex *image, int i, float *alpha_frame );
+
+    /*! Adds the adjoint of frame i to image, the adjoint of transform_frame.
+     *
+     */
+    void trans_adjoint_frame ( float *alpha_frame, int i, fftwf_complex *image );
+
+    /*! Returns "fft" or "direct", whichever computes transform and trans_adjoint faster.
+     * Both backends are built for these sizes and timed on a random image, so
+     * this costs a few transforms and the planning of both backends.
+     */
+    static std::string fastest_backend ( int npix, int nscale, int nlp=1, std::string cache_dir="", size_t max_scratch=0 );
+
+    /*! Returns the time taken by a transform and its adjoint, averaged over nrep runs.
+     *
+     */
+    double time_transform ( int nrep );
+
+    /*! Compares the transform and its adjoint with the ones of the other backend.
+     *
+     */
+    bool check_backend();
+
+    /*! Compares the starlet frames with the spectra of the impulse responses of starlet_2d.
+     * Returns false if they differ by more than rounding errors. With Sparse2D,
+     * the closed form Battle-Lemarie frames are compared with the Sparse2D ones.
+     */
+    bool check_frames();
 };
 
 #endif // WAVELET_TRANSFORM_H
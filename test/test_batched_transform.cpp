@@ -0,0 +1,233 @@
+/*
+ * Copyright CEA, 2015
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE "batched_transform_module"
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <nfft3.h>
+
+#include "batched_nfft.h"
+#include "binned_transform.h"
+#include "fftw_utils.h"
+
+// Size of the transforms, small enough for the tests to run in a few seconds
+static const int  N      = 64;
+static const long M      = 4000;
+static const int  NBATCH = 3;
+
+/*! Double precision nfft plan with fixed random nodes, the reference for all
+ * the batched transforms. With on_grid, the nodes sit on the points of the
+ * N x N grid, where the binned transform is exact.
+ */
+struct nfft_fixture
+{
+    nfft_plan plan;
+    std::mt19937 rng;
+    std::uniform_real_distribution<double> uniform;
+    std::uniform_int_distribution<int> pixel;
+
+    nfft_fixture(bool on_grid = false):
+        rng(42), uniform(-0.5, 0.5), pixel(-N / 2, N / 2 - 1)
+    {
+        nfft_init_2d(&plan, N, N, M);
+        for (long j = 0; j < 2 * M; j++) {
+            if (on_grid) {
+                plan.x[j] = pixel(rng) / ((double) N);
+            } else {
+                plan.x[j] = uniform(rng);
+            }
+        }
+        nfft_precompute_one_psi(&plan);
+    }
+
+    ~nfft_fixture()
+    {
+        nfft_finalize(&plan);
+    }
+
+    void fill_random(fftw_complex *a, long n)
+    {
+        for (long ind = 0; ind < n; ind++) {
+            a[ind][0] = uniform(rng);
+            a[ind][1] = uniform(rng);
+        }
+    }
+
+    /*! Applies nfft_trafo to each batch of t, out being interleaved as t->get_f() */
+    void reference_trafo(batched_transform *t, fftw_complex *out)
+    {
+        for (int b = 0; b < NBATCH; b++) {
+            std::copy(&t->get_f_hat(b)[0][0], &t->get_f_hat(b)[0][0] + 2 * N * N, &plan.f_hat[0][0]);
+            nfft_trafo(&plan);
+            for (long j = 0; j < M; j++) {
+                out[j * NBATCH + b][0] = plan.f[j][0];
+                out[j * NBATCH + b][1] = plan.f[j][1];
+            }
+        }
+    }
+
+    /*! Applies nfft_adjoint to each batch of t, out being stored plane by plane as t->get_f_hat(0) */
+    void reference_adjoint(batched_transform *t, fftw_complex *out)
+    {
+        for (int b = 0; b < NBATCH; b++) {
+            for (long j = 0; j < M; j++) {
+                plan.f[j][0] = t->get_f()[j * NBATCH + b][0];
+                plan.f[j][1] = t->get_f()[j * NBATCH + b][1];
+            }
+            nfft_adjoint(&plan);
+            std::copy(&plan.f_hat[0][0], &plan.f_hat[0][0] + 2 * N * N, &out[((long) b) * N * N][0]);
+        }
+    }
+};
+
+/*! Relative l2 difference between a and the reference b */
+static double rel_diff(const fftw_complex *a, const fftw_complex *b, long n)
+{
+    double diff = 0, norm = 0;
+    for (long ind = 0; ind < n; ind++) {
+        diff += pow(a[ind][0] - b[ind][0], 2) + pow(a[ind][1] - b[ind][1], 2);
+        norm += pow(b[ind][0], 2) + pow(b[ind][1], 2);
+    }
+    return sqrt(diff / norm);
+}
+
+/*! Real part of the inner product sum conj(a) b */
+static double dot(const fftw_complex *a, const fftw_complex *b, long n)
+{
+    double res = 0;
+    for (long ind = 0; ind < n; ind++) {
+        res += a[ind][0] * b[ind][0] + a[ind][1] * b[ind][1];
+    }
+    return res;
+}
+
+/*! Compares the transform and the adjoint of t with the ones of the double
+ * precision nfft, and checks that the adjoint of t is its own adjoint,
+ * <t f_hat, f> = <f_hat, t^* f>.
+ */
+static void check_transform(nfft_fixture &fx, batched_transform *t, double tol_ref, double tol_dot)
+{
+    long nhat = ((long) N) * N * NBATCH;
+    fftw_complex *f_hat = fftw_alloc_complex(nhat);
+    fftw_complex *f     = fftw_alloc_complex(M * NBATCH);
+    fftw_complex *ref_hat = fftw_alloc_complex(nhat);
+    fftw_complex *ref     = fftw_alloc_complex(M * NBATCH);
+
+    fx.fill_random(t->get_f_hat(0), nhat);
+    std::copy(&t->get_f_hat(0)[0][0], &t->get_f_hat(0)[0][0] + 2 * nhat, &f_hat[0][0]);
+    t->trafo();
+    fx.reference_trafo(t, ref);
+    double err_trafo = rel_diff(t->get_f(), ref, M * NBATCH);
+    BOOST_TEST_MESSAGE("trafo relative difference: " << err_trafo);
+    BOOST_CHECK_LT(err_trafo, tol_ref);
+
+    // Keeps t f_hat for the dot product test
+    std::copy(&t->get_f()[0][0], &t->get_f()[0][0] + 2 * M * NBATCH, &ref[0][0]);
+
+    fx.fill_random(t->get_f(), M * NBATCH);
+    std::copy(&t->get_f()[0][0], &t->get_f()[0][0] + 2 * M * NBATCH, &f[0][0]);
+    t->adjoint();
+    fx.reference_adjoint(t, ref_hat);
+    double err_adjoint = rel_diff(t->get_f_hat(0), ref_hat, nhat);
+    BOOST_TEST_MESSAGE("adjoint relative difference: " << err_adjoint);
+    BOOST_CHECK_LT(err_adjoint, tol_ref);
+
+    double lhs = dot(ref, f, M * NBATCH);
+    double rhs = dot(f_hat, t->get_f_hat(0), nhat);
+    double err_dot = fabs(lhs - rhs) / fabs(lhs);
+    BOOST_TEST_MESSAGE("dot product test: " << err_dot);
+    BOOST_CHECK_LT(err_dot, tol_dot);
+
+    fftw_free(f_hat);
+    fftw_free(f);
+    fftw_free(ref_hat);
+    fftw_free(ref);
+}
+
+BOOST_AUTO_TEST_CASE( batched_nfft_matches_nfft )
+{
+    nfft_fixture fx;
+    batched_nfft t(&fx.plan, NBATCH);
+
+    // Same window tables and algorithm, only the summation order differs
+    check_transform(fx, &t, 1e-10, 1e-12);
+}
+
+BOOST_AUTO_TEST_CASE( binned_transform_matches_nfft_on_grid )
+{
+    nfft_fixture fx(true);
+    binned_transform t(&fx.plan, NBATCH);
+
+    // Exact at the grid points, the difference is the approximation error of the nfft
+    check_transform(fx, &t, 1e-8, 1e-12);
+}
+
+BOOST_AUTO_TEST_CASE( batched_nfftf_matches_nfft )
+{
+    nfft_fixture fx;
+    batched_nfftf t(&fx.plan, NBATCH);
+
+    // Single precision grids, window tables and FFTs, the node values and
+    // coefficients remain in double precision
+    check_transform(fx, &t, 1e-4, 1e-4);
+}
+
+#ifdef FFTW_THREADS
+BOOST_AUTO_TEST_CASE( threaded_grids_match_nfft )
+{
+    // With more threads than batches, the grids are transformed one at a
+    // time by the threaded plans
+    fftw_init_threads();
+    fftwf_init_threads();
+    setFFTWThreads(4);
+    BOOST_REQUIRE( useThreadedPlans(NBATCH) );
+
+    nfft_fixture fx;
+    batched_nfft t(&fx.plan, NBATCH);
+    check_transform(fx, &t, 1e-10, 1e-12);
+
+    batched_nfftf tf(&fx.plan, NBATCH);
+    check_transform(fx, &tf, 1e-4, 1e-4);
+
+    nfft_fixture fx_grid(true);
+    binned_transform tb(&fx_grid.plan, NBATCH);
+    check_transform(fx_grid, &tb, 1e-8, 1e-12);
+
+    setFFTWThreads(1);
+}
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright CEA, 2015
+ * author : Francois Lanusse < francois.lanusse@gmail.com >
+ * 
+ * This software is a computer program whose purpose is to reconstruct mass maps
+ * from weak gravitational lensing.
+ * 
+ * This software is governed by the CeCILL license under French law and
+ * abiding by the rules of distribution of free software.  You can  use, 
+ * modify and/ or redistribute the software under the terms of the CeCILL
+ * license as circulated by CEA, CNRS and INRIA at the following URL
+ * "http://www.cecill.info". 
+ * 
+ * As a counterpart to the access to the source code and  rights to copy,
+ * modify and redistribute granted by the license, users are provided only
+ * with a limited warranty  and the software's author,  the holder of the
+ * economic rights,  and the successive licensors  have only  limited
+ * liability. 
+ * 
+ * In this respect, the user's attention is drawn to the risks associated
+ * with loading,  using,  modifying and/or developing or reproducing the
+ * software by the user in light of its specific status of free software,
+ * that may mean  that it is complicated to manipulate,  and  that  also
+ * therefore means  that it is reserved for developers  and  experienced
+ * professionals having in-depth computer knowledge. Users are therefore
+ * encouraged to load and test the software's suitability as regards their
+ * requirements in conditions enabling the security of their systems and/or 
+ * data to be ensured and,  more generally, to use and operate it in the 
+ * same conditions as regards security. 
+ * 
+ * The fact that you are presently reading this means that you have had
+ * knowledge of the CeCILL license and that you accept its terms.
+ * 
+ */
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE "wavelet_transform_module"
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <random>
+#include <fftw3.h>
+
+#include "wavelet_transform.h"
+
+// Size of the transforms, large enough for a few decimated frames
+static const int NPIX   = 64;
+static const int NSCALE = 5;
+static const int NLP    = 2;
+
+/*! Checks that trans_adjoint is the adjoint of transform, the half spectra
+ * standing for the full spectra of real images.
+ */
+static double dot_product_test(wavelet_transform &wav)
+{
+    int nhalf = NPIX / 2 + 1;
+    long nimage = ((long) NPIX) * nhalf * NLP;
+    long ncoeff = wav.get_ncoeff() * NLP;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-0.5f, 0.5f);
+
+    // Half spectra of random real images
+    float *im = (float *) fftwf_malloc(sizeof(float) * NPIX * NPIX);
+    fftwf_complex *image  = fftwf_alloc_complex(nimage);
+    fftwf_complex *image2 = fftwf_alloc_complex(nimage);
+    fftwf_plan plan = fftwf_plan_dft_r2c_2d(NPIX, NPIX, im, image, FFTW_ESTIMATE);
+    for (int z = 0; z < NLP; z++) {
+        for (long ind = 0; ind < NPIX * NPIX; ind++) {
+            im[ind] = uniform(rng);
+        }
+        fftwf_execute_dft_r2c(plan, im, image + z * NPIX * nhalf);
+    }
+    fftwf_destroy_plan(plan);
+
+    float *alpha = (float *) malloc(sizeof(float) * ncoeff);
+    float *beta  = (float *) malloc(sizeof(float) * ncoeff);
+    for (long ind = 0; ind < ncoeff; ind++) {
+        beta[ind] = uniform(rng);
+    }
+
+    wav.transform(image, alpha);
+    wav.trans_adjoint(beta, image2);
+
+    // The columns 0 < kx < npix / 2 of the half spectra stand for two frequencies
+    double lhs = 0, rhs = 0;
+    for (long ind = 0; ind < ncoeff; ind++) {
+        lhs += alpha[ind] * beta[ind];
+    }
+    for (long ind = 0; ind < nimage; ind++) {
+        long kx = ind % nhalf;
+        double w = (kx == 0 || 2 * kx == NPIX) ? 1 : 2;
+        rhs += w * (image[ind][0] * image2[ind][0] + image[ind][1] * image2[ind][1]);
+    }
+
+    fftwf_free(im);
+    fftwf_free(image);
+    fftwf_free(image2);
+    free(alpha);
+    free(beta);
+
+    return fabs(lhs - rhs) / fabs(lhs);
+}
+
+BOOST_AUTO_TEST_CASE( starlet_frames )
+{
+    wavelet_transform wav(NPIX, NSCALE, NLP, "fft");
+
+    BOOST_CHECK( wav.check_frames() );
+}
+
+BOOST_AUTO_TEST_CASE( fft_backend )
+{
+    wavelet_transform wav(NPIX, NSCALE, NLP, "fft");
+
+    // Compares with the direct backend
+    BOOST_CHECK( wav.check_backend() );
+    BOOST_CHECK_LT( dot_product_test(wav), 1e-4 );
+}
+
+BOOST_AUTO_TEST_CASE( direct_backend )
+{
+    wavelet_transform wav(NPIX, NSCALE, NLP, "direct");
+
+    // Compares with the fft backend
+    BOOST_CHECK( wav.check_backend() );
+    BOOST_CHECK_LT( dot_product_test(wav), 1e-4 );
+}
+
+BOOST_AUTO_TEST_CASE( pyramid_matches_undecimated )
+{
+    wavelet_transform wav(NPIX, NSCALE, NLP, "fft", "", 1e-3);
+    BOOST_REQUIRE( wav.is_pyramid() );
+
+    // Compares the samples of the decimated frames with the undecimated
+    // transform, including the dot product test of the pyramid
+    BOOST_CHECK( wav.check_backend() );
+    BOOST_CHECK_LT( dot_product_test(wav), 1e-4 );
+}